@@ -1,32 +1,93 @@
 #include "BES_CSM.hpp"
 
+#include <numeric> // for iota
+
 ////////////////////////////////////// PRIVATE METHODS ////////////////////////////////////////////////
 
-// Recursive method to find the allowed keys from a given index
-void BES_CSM_scheme::find_allowed_keys(vector<unsigned int>& node_key_ID, vector<uint8_t*>& user_keys, unsigned int index) {
-    if (index >= FCB_tree.size()) {
-        return; // Stop recursion if the index exceeds the size of the tree
+// Iterative method to walk the cover of the subtree of a given index from a sorted list of denied users
+template <typename Visitor>
+void BES_CSM_scheme::for_each_cover_node(unsigned int index, const vector<unsigned int>& revoked, Visitor visit) const {
+    struct Pending_node {
+        unsigned int index;
+        size_t first_revoked; // the denied users under the node are revoked[first_revoked, last_revoked)
+        size_t last_revoked;
+    };
+    // explicit stack, left children are popped first to keep the order of a preorder walk. It holds at most one
+    // pending right child per level plus the current node, so it fits in a fixed array
+    Pending_node pending[max_tree_depth + 2];
+    size_t pending_count = 0;
+    size_t first_user, user_count;
+    size_t visited = 0;
+
+    if (index >= number_of_nodes) {
+        return; // Stop if the index exceeds the size of the tree
     }
-    if (allowed_keys[index] == true) {
+    get_subtree_users(index, depth, first_user, user_count);
+    pending[pending_count++] = {index,
+                                static_cast<size_t>(lower_bound(revoked.begin(), revoked.end(), first_user) - revoked.begin()),
+                                static_cast<size_t>(lower_bound(revoked.begin(), revoked.end(), first_user + user_count) - revoked.begin())};
+    while (pending_count > 0) {
+        Pending_node node = pending[--pending_count];
+        visited++;
+        if (node.first_revoked == node.last_revoked) { // no denied user under the node, its key covers the whole subtree
+            visit(node.index);
+            continue;
+        }
+        if (node.index >= number_of_nodes / 2) {
+            continue; // denied leaf, nothing to cover
+        }
+        // split the denied users between both children, the ones of the right child start at its first user
+        get_subtree_users(get_rightchild_index(node.index), depth, first_user, user_count);
+        size_t split = lower_bound(revoked.begin() + node.first_revoked, revoked.begin() + node.last_revoked, first_user) - revoked.begin();
+        pending[pending_count++] = {get_rightchild_index(node.index), split, node.last_revoked};
+        pending[pending_count++] = {get_leftchild_index(node.index), node.first_revoked, split};
+    }
+    BES_METRIC_ADD(Metric_csm_nodes_visited, visited);
+}
+
+// Method to find the cover of the subtree of a given index from a sorted list of denied users
+void BES_CSM_scheme::find_cover_nodes(unsigned int index, const vector<unsigned int>& revoked, vector<unsigned int>& node_key_ID) const {
+    for_each_cover_node(index, revoked, [&node_key_ID](unsigned int node_index) { node_key_ID.push_back(node_index); });
+}
+
+// Method to find the allowed keys under a given index, with the current denied users
+void BES_CSM_scheme::find_allowed_keys(vector<unsigned int>& node_key_ID, vector<uint8_t*>& user_keys, unsigned int index) {
+    size_t first_key = node_key_ID.size();
+
+    find_cover_nodes(index, revoked_users, node_key_ID);
+    for (size_t i = first_key; i < node_key_ID.size(); i++) {
         uint8_t *newKey = new uint8_t[Key_length / 8];
-        memcpy(newKey, FCB_tree[index], Key_length / 8);
-        node_key_ID.push_back(index);
+        copy_node_key(node_key_ID[i], newKey);
         user_keys.push_back(newKey);
-    } else {
-        // Recursively call on the left and right children
-        find_allowed_keys(node_key_ID, user_keys, get_leftchild_index(index));
-        find_allowed_keys(node_key_ID, user_keys, get_rightchild_index(index));
     }
+    BES_METRIC_ADD(Metric_key_bytes_allocated, (node_key_ID.size() - first_key) * (Key_length / 8));
+}
+
+// Binary search of the highest level whose ancestor of the user has no denied users under it
+unsigned int BES_CSM_scheme::find_cover_node(unsigned int userID) const {
+    unsigned int leaf_index = userID + number_of_nodes / 2;
+    size_t low_level = 0, high_level = depth; // the leaf itself is allowed, so the answer is in [low_level, high_level]
+    size_t first_user, user_count;
+
+    while (low_level < high_level) {
+        size_t level = (low_level + high_level) / 2;
+        unsigned int ancestor = get_ancestor_index(leaf_index, depth - level);
+        get_subtree_users(ancestor, depth, first_user, user_count);
+        auto revoked = lower_bound(revoked_users.begin(), revoked_users.end(), first_user);
+        if (revoked == revoked_users.end() || *revoked >= first_user + user_count) {
+            high_level = level; // no denied user under this ancestor, nor under the ones below it
+        } else {
+            low_level = level + 1;
+        }
+    }
+    return get_ancestor_index(leaf_index, depth - low_level);
 }
 
 
 ////////////////////////////////////// PUBLIC METHODS ////////////////////////////////////////////////
 
 // Constructor for the BES_CSM_scheme class
-BES_CSM_scheme::BES_CSM_scheme(size_t Tree_Depth, size_t node_key_length) : Keytree(Tree_Depth, node_key_length){
-	for(int i = 0 ; i < FCB_tree.size() ; i++){	
-        allowed_keys.push_back(true); // Mark key as allowed to be used at creation
-	}
+BES_CSM_scheme::BES_CSM_scheme(size_t Tree_Depth, size_t node_key_length, unsigned int key_generation_threads, Key_storage storage) : Keytree(Tree_Depth, node_key_length, key_generation_threads, storage){
 }
 
 // Method to deny access to a user by their user ID
@@ -35,19 +96,87 @@ int BES_CSM_scheme::denegate_user(unsigned int userID) {
         throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
         return -1;
     } else {
-        // Calculate the node key index for the user ID
-        int key_index = userID + allowed_users.size() - 1;
-        allowed_users[userID] = false; // Deny access to the user
-
-        // Deny the keys which the user has access to
-        for (int i = depth; i >= 0; i--) {
-            allowed_keys[key_index] = false;
-            key_index = get_father_index(key_index);
-        }
+        // Deny access to the user, the keys of the user path are denied with it as the cover is computed from the denied users
+        mark_user_denied(userID);
         return 1;
     }
 }
 
+// Method to deny access to a batch of users, returning the change of the cover
+int BES_CSM_scheme::denegate_users(const vector<unsigned int>& userIDs, vector<unsigned int>& added_keys_id, vector<uint8_t*>& added_keys, vector<unsigned int>& removed_keys_id) {
+    vector<unsigned int> denied(userIDs);
+    vector<unsigned int> replaced_nodes; // nodes of the cover holding some of the users, in cover order
+    size_t first_user = 0, user_count = 0;
+
+    for (unsigned int userID : denied) {
+        if (userID >= allowed_users.size()) {
+            throw invalid_argument("Invalid User Index"); // Throws an exception if any user ID is invalid, before denying anyone
+            return -1;
+        }
+    }
+    sort(denied.begin(), denied.end());
+    for (unsigned int userID : denied) {
+        if (!allowed_users[userID] || (userID >= first_user && userID < first_user + user_count)) {
+            continue; // already denied, or in the same cover node as the previous user
+        }
+        replaced_nodes.push_back(find_cover_node(userID));
+        get_subtree_users(replaced_nodes.back(), depth, first_user, user_count);
+    }
+    mark_users_denied(denied);
+
+    // every replaced node is split in the cover of its subtree with the new denied users
+    for (unsigned int node_index : replaced_nodes) {
+        removed_keys_id.push_back(node_index);
+        find_allowed_keys(added_keys_id, added_keys, node_index);
+    }
+    return 1;
+}
+
+// Method to deny access to a range of users, returning the change of the cover
+int BES_CSM_scheme::denegate_range(unsigned int first_user, unsigned int last_user, vector<unsigned int>& added_keys_id, vector<uint8_t*>& added_keys, vector<unsigned int>& removed_keys_id) {
+    if (first_user > last_user || last_user > allowed_users.size()) {
+        throw invalid_argument("Invalid User Range"); // Throws an exception if the range is invalid
+        return -1;
+    }
+    vector<unsigned int> userIDs(last_user - first_user);
+    iota(userIDs.begin(), userIDs.end(), first_user);
+    return denegate_users(userIDs, added_keys_id, added_keys, removed_keys_id);
+}
+
+// Method to allow access again to a denied user
+int BES_CSM_scheme::reinstate_user(unsigned int userID) {
+    if (userID >= allowed_users.size()) {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
+    }
+    // the keys of the user path not over other denied users are allowed again with it
+    mark_user_allowed(userID);
+    return 1;
+}
+
+// Method to allow access again to a batch of users, returning the change of the cover
+int BES_CSM_scheme::reinstate_users(const vector<unsigned int>& userIDs, vector<unsigned int>& added_keys_id, vector<uint8_t*>& added_keys, vector<unsigned int>& removed_keys_id) {
+    vector<unsigned int> reinstated(userIDs);
+    vector<unsigned int> previous_revoked(revoked_users);
+    size_t first_user = 0, user_count = 0;
+
+    mark_users_allowed(reinstated); // throws before changing anything if any user ID is invalid
+    for (unsigned int userID : reinstated) {
+        if (userID >= first_user && userID < first_user + user_count) {
+            continue; // in the same new cover node as the previous user
+        }
+        // the new cover node of the user replaces the cover its subtree had before
+        unsigned int node_index = find_cover_node(userID);
+        find_cover_nodes(node_index, previous_revoked, removed_keys_id);
+        added_keys_id.push_back(node_index);
+        added_keys.push_back(new uint8_t[Key_length / 8]);
+        BES_METRIC_ADD(Metric_key_bytes_allocated, Key_length / 8);
+        copy_node_key(node_index, added_keys.back());
+        get_subtree_users(node_index, depth, first_user, user_count);
+    }
+    return 1;
+}
+
 // Method to get the keys for a specific user
 int BES_CSM_scheme::get_user_keys(unsigned int userID, vector<unsigned int>& user_keys_id, vector<uint8_t*>& user_keys) {
     if (userID >= allowed_users.size()) {
@@ -64,147 +193,164 @@ int BES_CSM_scheme::get_user_keys(unsigned int userID, vector<unsigned int>& use
     for (int i = 0; i <= depth; i++) {
         user_keys[i] = new uint8_t[Key_length / 8];
     }
+    BES_METRIC_ADD(Metric_key_bytes_allocated, (depth + 1) * (Key_length / 8));
     // Load the corresponding user keys
     for (int i = depth; i >= 0; i--) {
         user_keys_id[i] = key_index;
-        memcpy(user_keys[i], FCB_tree[key_index], Key_length / 8);
+        copy_node_key(key_index, user_keys[i]);
         key_index = get_father_index(key_index);
     }
     return 1;
 }
 
-// Method to get all the allowed keys for the allowed users
-void BES_CSM_scheme::get_allowed_keys(vector<unsigned int>& node_key_ID, vector<uint8_t*>& user_keys) {
-    find_allowed_keys(node_key_ID, user_keys, 0); // Call the recursive function from the root
-}
-
-ostream& operator << (ostream& os, const BES_CSM_scheme& obj) {
-    unsigned char scheme_name[scheme_name_size] = "CSM_BES_scheme";
-
-    os.write(reinterpret_cast<const char*>(scheme_name), scheme_name_size); // write the scheme name
-
-    os.write(reinterpret_cast<const char*>(&obj.depth), sizeof(obj.depth)); // write the depth of the tree
-
-    os.write(reinterpret_cast<const char*>(&obj.Key_length), sizeof(obj.Key_length)); // write the Key_length of the tree
-
-    size_t allowed_users_size = obj.allowed_users.size();
-    os.write(reinterpret_cast<const char*>(&allowed_users_size), sizeof(size_t)); // write the allowed users vector size
+// Method to get the keys for a specific user into caller buffers
+int BES_CSM_scheme::get_user_keys(unsigned int userID, unsigned int* user_keys_id, uint8_t* user_keys) {
+    if (userID >= allowed_users.size()) {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
+    }
+    size_t Key_length_bytes = Key_length / 8;
+    unsigned int key_index = userID + allowed_users.size() - 1;
 
-    // logic to translate the bool vector array to normal bytes
-    uint8_t byte = 0;
-    size_t bit_index = 0;
+    // Load the corresponding user keys, from the leaf up to the root
+    for (size_t i = depth + 1; i-- > 0;) {
+        user_keys_id[i] = key_index;
+        copy_node_key(key_index, user_keys + i * Key_length_bytes);
+        key_index = get_father_index(key_index);
+    }
+    return 1;
+}
 
-    for (size_t i = 0; i < allowed_users_size; ++i) {
-        if (obj.allowed_users[i]) { // if user is allowed put the bit to 1
-            byte |= (1 << (7 - bit_index));
-        }
-        ++bit_index;
-        if (bit_index == 8) {
-            os.write(reinterpret_cast<const char*>(&byte), sizeof(byte));
-            byte = 0;
-            bit_index = 0;
-        }
+// Method to get the keys for a specific user into caller buffers, only reading the scheme
+int BES_CSM_scheme::read_user_keys(unsigned int userID, unsigned int* user_keys_id, uint8_t* user_keys) const {
+    if (userID >= allowed_users.size()) {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
     }
-    // Write any remaining bits (if the size is not a multiple of 8)
-    if (bit_index != 0) {
-        os.write(reinterpret_cast<const char*>(&byte), sizeof(byte));
+    size_t Key_length_bytes = Key_length / 8;
+    unsigned int key_index = userID + allowed_users.size() - 1;
+
+    for (size_t i = depth + 1; i-- > 0;) {
+        user_keys_id[i] = key_index;
+        read_node_key(key_index, user_keys + i * Key_length_bytes); // bypass the cache of derived keys
+        key_index = get_father_index(key_index);
     }
+    return 1;
+}
 
-    size_t allowed_keys_size = obj.allowed_keys.size();
-    os.write(reinterpret_cast<const char*>(&allowed_keys_size), sizeof(size_t)); // write the length of total allowed keys
+// Auxiliary method to walk down a subtree with the keys of the path to it, emitting the users of a range at the leaves
+void BES_CSM_scheme::provision_subtree(unsigned int index, unsigned int level, size_t first_user, size_t last_user,
+                                       unsigned int* package_id, uint8_t* package, const User_keys_sink<unsigned int>& sink) const {
+    size_t Key_length_bytes = Key_length / 8;
 
-    byte = 0;
-    bit_index = 0;
-    for (size_t i = 0; i < allowed_keys_size; ++i) {
-        if (obj.allowed_keys[i]) { // if key is allowed put the bit to 1
-            byte |= (1 << (7 - bit_index));
-        }
-        ++bit_index;
-        if (bit_index == 8) {
-            os.write(reinterpret_cast<const char*>(&byte), sizeof(byte));
-            byte = 0;
-            bit_index = 0;
-        }
+    package_id[level] = index;
+    read_node_key(index, package + level * Key_length_bytes);
+    if (level == depth) {
+        sink(index - (allowed_users.size() - 1), package_id, package, depth + 1);
+        return;
     }
-    // Write any remaining bits (if the size is not a multiple of 8)
-    if (bit_index != 0) {
-        os.write(reinterpret_cast<const char*>(&byte), sizeof(byte));
+    size_t subtree_users = static_cast<size_t>(1) << (depth - level - 1);
+    size_t left_first_user = (static_cast<size_t>(get_leftchild_index(index)) - ((1u << (level + 1)) - 1)) * subtree_users;
+    if (left_first_user < last_user && left_first_user + subtree_users > first_user) {
+        provision_subtree(get_leftchild_index(index), level + 1, first_user, last_user, package_id, package, sink);
     }
-
-    // write all the keys
-    for (int i = 0; i < obj.FCB_tree.size(); i++) {
-        os.write(reinterpret_cast<const char*>(obj.FCB_tree[i]), obj.Key_length / 8);
+    if (left_first_user + subtree_users < last_user && left_first_user + 2 * subtree_users > first_user) {
+        provision_subtree(get_rightchild_index(index), level + 1, first_user, last_user, package_id, package, sink);
     }
-    return os;
 }
 
-istream& operator >> (istream& is, BES_CSM_scheme& obj) {
-    unsigned char scheme_name[scheme_name_size];
-
-    is.read(reinterpret_cast<char*>(scheme_name), scheme_name_size); // read the scheme name
-
-    // verify scheme name
-    if (strncmp(reinterpret_cast<const char*>(scheme_name), "CSM_BES_scheme", scheme_name_size) != 0) {
-        std::cerr << "Error: Nombre del esquema incorrecto." << std::endl;
-        return is;
+// Method to get the keys of a range of users walking the tree once
+int BES_CSM_scheme::provision_range(unsigned int first_user, unsigned int last_user, const User_keys_sink<unsigned int>& sink, unsigned int threads) const {
+    if (first_user > last_user || last_user > allowed_users.size()) {
+        throw invalid_argument("Invalid User Range"); // Throws an exception if the range is invalid
+        return -1;
     }
+    parallel_user_ranges(first_user, last_user, threads, [&](size_t task_first_user, size_t task_last_user) {
+        vector<unsigned int> package_id(depth + 1);
+        vector<uint8_t> package((depth + 1) * (Key_length / 8));
+        provision_subtree(0, 0, task_first_user, task_last_user, package_id.data(), package.data(), sink);
+    });
+    return 1;
+}
 
-    is.read(reinterpret_cast<char*>(&obj.depth), sizeof(obj.depth)); // read the depth of the tree
-
-    is.read(reinterpret_cast<char*>(&obj.Key_length), sizeof(obj.Key_length)); // read the Key_length of the tree
-
-    size_t allowed_users_size;
-    is.read(reinterpret_cast<char*>(&allowed_users_size), sizeof(size_t)); // read the allowed users vector size
-    obj.allowed_users.resize(allowed_users_size);
+// Method to get the keys for a specific user into a reusable batch
+int BES_CSM_scheme::get_user_keys(unsigned int userID, Key_batch<unsigned int>& batch) {
+    if (userID >= allowed_users.size()) {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
+    }
+    batch.reset(Key_length / 8);
+    batch.resize(depth + 1);
+    return get_user_keys(userID, batch.ids(), batch.keys());
+}
 
-    // read allowed users vector
-    uint8_t byte = 0;
-    size_t bit_index = 0;
+// Method to get all the allowed keys for the allowed users
+void BES_CSM_scheme::get_allowed_keys(vector<unsigned int>& node_key_ID, vector<uint8_t*>& user_keys) {
+    BES_METRIC_TIMER(Metric_csm_allowed_keys_time);
+    size_t bound = get_cover_size_bound();
+    size_t first_key = node_key_ID.size();
 
-    for (size_t i = 0; i < allowed_users_size; ++i) {
-        if (bit_index == 0) {
-            // read next byte
-            is.read(reinterpret_cast<char*>(&byte), sizeof(byte));
-        }
+    node_key_ID.reserve(node_key_ID.size() + bound);
+    user_keys.reserve(user_keys.size() + bound);
+    find_allowed_keys(node_key_ID, user_keys, 0); // Call the recursive function from the root
+    BES_METRIC_ADD(Metric_csm_allowed_keys_calls, 1);
+    BES_METRIC_SET(Metric_csm_cover_size, node_key_ID.size() - first_key);
+}
 
-        obj.allowed_users[i] = (byte & (1 << (7 - bit_index))) != 0; // if bit is 1 write true, else write false
-        ++bit_index;
+// Method to get all the allowed keys into caller buffers, returning the size of the cover
+size_t BES_CSM_scheme::get_allowed_keys(unsigned int* node_key_ID, uint8_t* user_keys, size_t capacity) {
+    BES_METRIC_TIMER(Metric_csm_allowed_keys_time);
+    size_t Key_length_bytes = Key_length / 8;
+    size_t cover_size = 0;
 
-        if (bit_index == 8) {
-            bit_index = 0;
+    for_each_cover_node(0, revoked_users, [&](unsigned int node_index) {
+        if (cover_size < capacity) { // the nodes that do not fit are only counted
+            node_key_ID[cover_size] = node_index;
+            copy_node_key(node_index, user_keys + cover_size * Key_length_bytes);
         }
-    }
-
-    size_t allowed_keys_size;
-    is.read(reinterpret_cast<char*>(&allowed_keys_size), sizeof(size_t)); // read allowed_keys size
-    obj.allowed_keys.resize(allowed_keys_size);
+        cover_size++;
+    });
+    BES_METRIC_ADD(Metric_csm_allowed_keys_calls, 1);
+    BES_METRIC_SET(Metric_csm_cover_size, cover_size);
+    return cover_size;
+}
 
-    byte = 0;
-    bit_index = 0;
-    for (size_t i = 0; i < allowed_keys_size; ++i) {
-        if (bit_index == 0) {
-            // read next byte
-            is.read(reinterpret_cast<char*>(&byte), sizeof(byte));
-        }
+// Method to get all the allowed keys into a reusable batch, pre-sized with the bound of the cover size
+void BES_CSM_scheme::get_allowed_keys(Key_batch<unsigned int>& batch) {
+    size_t bound = get_cover_size_bound();
 
-        obj.allowed_keys[i] = (byte & (1 << (7 - bit_index))) != 0; // if bit is 1 write true, else write false
-        ++bit_index;
+    batch.reset(Key_length / 8);
+    batch.resize(bound);
+    batch.resize(get_allowed_keys(batch.ids(), batch.keys(), bound));
+}
 
-        if (bit_index == 8) {
-            bit_index = 0;
-        }
-    }
+// Bound of the cover size: r denied users leave at most r * log2(n / r) nodes hanging from their paths
+size_t BES_CSM_scheme::get_cover_size_bound() const {
+    size_t revoked = revoked_users.size();
 
-    // free any old keys in the tree
-    for (int i = 0; i < obj.FCB_tree.size(); i++) {
-        delete obj.FCB_tree[i];
+    if (revoked == 0) {
+        return 1; // the root alone
     }
-    // read all keys of the CSM_tree
-    obj.FCB_tree.resize(pow(2, obj.depth + 1) - 1);
-    for (int i = 0; i < obj.FCB_tree.size(); i++) {
-        obj.FCB_tree[i] = new uint8_t[obj.Key_length / 8];
-        is.read(reinterpret_cast<char*>(obj.FCB_tree[i]), obj.Key_length / 8);
+    size_t shared_levels = 0; // the top floor(log2(r)) levels are shared by the paths of the denied users
+    while ((static_cast<size_t>(2) << shared_levels) <= revoked) {
+        shared_levels++;
     }
+    return min(revoked * (depth - shared_levels), allowed_users.size() - revoked);
+}
 
+// Method to open a tree over a memory mapped file
+void BES_CSM_scheme::map_file(const string& path, Map_mode mode) {
+    map_tree(path, "CSM_BES_scheme", mode);
+}
+
+ostream& operator << (ostream& os, const BES_CSM_scheme& obj) {
+    // header, allowed users as words and key arena, the allowed keys are not stored as they follow from the denied users
+    obj.write_tree(os, "CSM_BES_scheme");
+    return os;
+}
+
+istream& operator >> (istream& is, BES_CSM_scheme& obj) {
+    // versioned or legacy file, the legacy one stores a bit per allowed key that is skipped
+    obj.read_tree(is, "CSM_BES_scheme", true);
     return is;
 }
@@ -14,14 +14,28 @@
  */
 class BES_CSM_scheme : public Keytree {
 private:	
-	/**
-	 * @brief Vector representing the current keys that can be used or are not denied.
-	 *
-	*/
-    vector<bool> allowed_keys;
+    /**
+     * @brief Auxiliary method to find the cover of the subtree of a given index, computed from sorted denied users
+     * alone: only the O(r log(n/r)) nodes with denied users under them are visited, with an explicit stack.
+     * 
+     * @param index The starting index for the search.
+     * @param revoked The IDs of the denied users, in ascending order.
+     * @param node_key_ID Vector to store the node key IDs.
+     */
+    void find_cover_nodes(unsigned int index, const vector<unsigned int>& revoked, vector<unsigned int>& node_key_ID) const;
 
     /**
-     * @brief Auxiliary method to find the current allowed keys in the tree starting from a given index.
+     * @brief Auxiliary method to walk the cover of the subtree of a given index as find_cover_nodes, without allocating memory.
+     * 
+     * @param index The starting index for the search.
+     * @param revoked The IDs of the denied users, in ascending order.
+     * @param visit Function called with the index of each node of the cover, in preorder.
+     */
+    template <typename Visitor>
+    void for_each_cover_node(unsigned int index, const vector<unsigned int>& revoked, Visitor visit) const;
+
+    /**
+     * @brief Auxiliary method to find the current allowed keys in the subtree of a given index.
      * 
      * @param node_key_ID Vector to store the node key IDs.
      * @param user_keys Vector to store the user keys.
@@ -29,14 +43,44 @@ private:
      */
     void find_allowed_keys(vector<unsigned int>& node_key_ID, vector<uint8_t*>& user_keys, unsigned int index);
 
+    /**
+     * @brief Finds the node of the current cover holding an allowed user, the highest ancestor of its leaf without denied users.
+     * 
+     * @param userID The ID of an allowed user.
+     * @return The index of the node.
+     */
+    unsigned int find_cover_node(unsigned int userID) const;
+
+    /**
+     * @brief Auxiliary method to walk down the subtree of a node reading each key once for every leaf below it, and pass
+     * the keys of the leaves of the users in a range to a sink.
+     * 
+     * @param index The node, the keys from the root to it are in the package.
+     * @param level Level of the node.
+     * @param first_user The ID of the first user to provision.
+     * @param last_user The ID after the last user to provision.
+     * @param package_id Buffer of depth + 1 key IDs of the current path.
+     * @param package Buffer of depth + 1 keys of the current path, packed.
+     * @param sink Receiver of the keys.
+     */
+    void provision_subtree(unsigned int index, unsigned int level, size_t first_user, size_t last_user,
+                           unsigned int* package_id, uint8_t* package, const User_keys_sink<unsigned int>& sink) const;
+
 public:
+    /**
+     * @brief Type of the IDs of the keys of the scheme, the index of the node.
+     */
+    typedef unsigned int Key_id;
+
     /**
      * @brief Constructor for a Complete Subtree Difference BES scheme.
      * 
      * @param Tree_Depth The depth of the tree.
      * @param node_key_length The length of the node keys in bits.
+     * @param key_generation_threads Number of threads used to generate the node keys (0 uses all the hardware threads).
+     * @param storage Whether the node keys are stored (default) or derived on demand from a master secret.
      */
-    BES_CSM_scheme(size_t Tree_Depth, size_t node_key_length);
+    BES_CSM_scheme(size_t Tree_Depth, size_t node_key_length, unsigned int key_generation_threads = 1, Key_storage storage = Stored_keys);
 
     /**
      * @brief Destructor for a Complete Subtree Difference BES scheme.
@@ -53,6 +97,16 @@ public:
      */
     friend istream& operator >> ( istream& is, BES_CSM_scheme& obj);
 
+    /**
+     * @brief Opens a tree written with operator << over a memory mapped file instead of reading it, so it is available at once
+     * and its keys are paged in when used. Read only mappings of the same file share one physical copy among processes.
+     *
+     * @param path Path of the file.
+     * @param mode Map_read_only (default, the node keys can not be modified) or Map_copy_on_write.
+     * @throws runtime_error if the file can not be mapped or does not hold a tree of this scheme.
+     */
+    void map_file(const string& path, Map_mode mode = Map_read_only);
+
     /**
      * @brief Deny access for keys to a user.
      * 
@@ -61,6 +115,54 @@ public:
      */
     int denegate_user(unsigned int userID);
 
+    /**
+     * @brief Deny access for keys to a batch of users at once, and get the change of the cover it causes.
+     * The users are sorted, each node of the cover holding some of them is replaced once by the cover of its
+     * subtree, and users already denied are skipped.
+     * 
+     * @param userIDs The IDs of the users to be denied access.
+     * @param added_keys_id Vector to store the node key IDs new in the cover.
+     * @param added_keys Vector to store the new keys.
+     * @param removed_keys_id Vector to store the node key IDs no longer in the cover.
+     * @return 1 if the users are successfully denied, -1 if any user ID is invalid.
+     * @throws invalid_argument if any user ID is invalid, no user is denied then.
+     */
+    int denegate_users(const vector<unsigned int>& userIDs, vector<unsigned int>& added_keys_id, vector<uint8_t*>& added_keys, vector<unsigned int>& removed_keys_id);
+
+    /**
+     * @brief Deny access for keys to the users with IDs in [first_user, last_user), as denegate_users.
+     * 
+     * @param first_user The ID of the first user to be denied access.
+     * @param last_user The ID after the last user to be denied access.
+     * @param added_keys_id Vector to store the node key IDs new in the cover.
+     * @param added_keys Vector to store the new keys.
+     * @param removed_keys_id Vector to store the node key IDs no longer in the cover.
+     * @return 1 if the users are successfully denied, -1 if the range is invalid.
+     * @throws invalid_argument if the range is invalid.
+     */
+    int denegate_range(unsigned int first_user, unsigned int last_user, vector<unsigned int>& added_keys_id, vector<uint8_t*>& added_keys, vector<unsigned int>& removed_keys_id);
+
+    /**
+     * @brief Allow access again to a denied user, the keys of its path are allowed again unless other denied users are under them.
+     * 
+     * @param userID The ID of the user.
+     * @return 1 if the user is successfully allowed, -1 if the user ID is invalid.
+     */
+    int reinstate_user(unsigned int userID);
+
+    /**
+     * @brief Allow access again to a batch of denied users at once, and get the change of the cover it causes.
+     * Each new cover node replaces, once, the cover its subtree had before; users already allowed are skipped.
+     * 
+     * @param userIDs The IDs of the users.
+     * @param added_keys_id Vector to store the node key IDs new in the cover.
+     * @param added_keys Vector to store the new keys.
+     * @param removed_keys_id Vector to store the node key IDs no longer in the cover.
+     * @return 1 if the users are successfully allowed, -1 if any user ID is invalid.
+     * @throws invalid_argument if any user ID is invalid, no user is allowed then.
+     */
+    int reinstate_users(const vector<unsigned int>& userIDs, vector<unsigned int>& added_keys_id, vector<uint8_t*>& added_keys, vector<unsigned int>& removed_keys_id);
+
     /**
      * @brief Get the corresponding keys for a determined user.
      * 
@@ -71,6 +173,62 @@ public:
      */
     int get_user_keys(unsigned int userID, vector<unsigned int>& user_keys_id, vector<uint8_t*>& user_keys);
 
+    /**
+     * @brief Get the corresponding keys for a determined user into caller buffers, without allocating memory.
+     * 
+     * @param userID The ID of the user.
+     * @param user_keys_id Buffer of depth + 1 IDs to store the user key IDs, from the root to the leaf.
+     * @param user_keys Buffer of (depth + 1) * Key_length / 8 bytes to store the user keys, packed in the same order.
+     * @return 1 if the keys are successfully retrieved, -1 if the user ID is invalid.
+     */
+    int get_user_keys(unsigned int userID, unsigned int* user_keys_id, uint8_t* user_keys);
+
+    /**
+     * @brief Get the corresponding keys for a determined user into a reusable batch, emptied first.
+     * 
+     * @param userID The ID of the user.
+     * @param batch Batch to store the user keys, from the root to the leaf.
+     * @return 1 if the keys are successfully retrieved, -1 if the user ID is invalid.
+     */
+    int get_user_keys(unsigned int userID, Key_batch<unsigned int>& batch);
+
+    /**
+     * @brief Get the corresponding keys for a determined user into caller buffers as get_user_keys, without modifying the scheme
+     * (derived keys bypass their cache), so several threads can call it at once while no other method is running.
+     * 
+     * @param userID The ID of the user.
+     * @param user_keys_id Buffer of get_user_key_count() IDs to store the user key IDs, from the root to the leaf.
+     * @param user_keys Buffer of get_user_key_count() * Key_length / 8 bytes to store the user keys, packed in the same order.
+     * @return 1 if the keys are successfully retrieved, -1 if the user ID is invalid.
+     */
+    int read_user_keys(unsigned int userID, unsigned int* user_keys_id, uint8_t* user_keys) const;
+
+    /**
+     * @brief Get the number of keys of a user, depth + 1.
+     */
+    size_t get_user_key_count() const { return depth + 1; }
+
+    /**
+     * @brief Get the keys of the users in [first_user, last_user) walking the tree once, each key is read once for every leaf
+     * below it instead of once per user. The range is split by subtrees run on a pool of threads. The scheme is not modified
+     * (derived keys bypass their cache), as read_user_keys.
+     * 
+     * @param first_user The ID of the first user.
+     * @param last_user The ID after the last user.
+     * @param sink Receiver of the keys of each user, from the root to the leaf, called from several threads at once.
+     * @param threads Number of threads to use (0 uses all the hardware threads, 1 runs in the calling thread).
+     * @return 1 if the users are provisioned, -1 if the range is invalid.
+     * @throws invalid_argument if the range is invalid.
+     */
+    int provision_range(unsigned int first_user, unsigned int last_user, const User_keys_sink<unsigned int>& sink, unsigned int threads = 0) const;
+
+    /**
+     * @brief Get the keys of every user, as provision_range.
+     */
+    int provision_all(const User_keys_sink<unsigned int>& sink, unsigned int threads = 0) const {
+        return provision_range(0, allowed_users.size(), sink, threads);
+    }
+
     /**
      * @brief Get the allowed keys that can be used at the moment with the currently allowed users.
      * 
@@ -78,6 +236,31 @@ public:
      * @param user_keys Vector to store the user keys.
      */
     void get_allowed_keys(vector<unsigned int>& node_key_ID, vector<uint8_t*>& user_keys);
+
+    /**
+     * @brief Get the allowed keys into caller buffers, without allocating memory. If the cover does not fit only
+     * its first nodes are written, get_cover_size_bound gives a size that always fits.
+     * 
+     * @param node_key_ID Buffer of capacity IDs to store the node key IDs.
+     * @param user_keys Buffer of capacity * Key_length / 8 bytes to store the keys, packed in the same order.
+     * @param capacity Number of keys the buffers hold.
+     * @return The number of keys of the cover.
+     */
+    size_t get_allowed_keys(unsigned int* node_key_ID, uint8_t* user_keys, size_t capacity);
+
+    /**
+     * @brief Get the allowed keys into a reusable batch, emptied first and pre-sized with get_cover_size_bound.
+     * 
+     * @param batch Batch to store the keys.
+     */
+    void get_allowed_keys(Key_batch<unsigned int>& batch);
+
+    /**
+     * @brief Get an upper bound of the number of keys of the cover with the current denied users, r * log2(n / r) for r denied users.
+     * 
+     * @return The bound.
+     */
+    size_t get_cover_size_bound() const;
 };
 
 #endif
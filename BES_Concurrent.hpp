@@ -0,0 +1,260 @@
+/**
+ * @file file implementing a thread safe wrapper of a BES scheme, where many threads look up user keys without locks
+ * while a single writer at a time denies or allows users.
+ *
+ * The node keys never change, so readers take them straight from the tree. The denied users and the cover they give
+ * are published by the writer as immutable snapshots; readers pin the current one announcing the epoch they started in,
+ * and the writer frees a replaced snapshot once every reader active when it was replaced has finished (epoch based reclamation).
+ */
+#ifndef BES_CONCURRENT_H
+#define BES_CONCURRENT_H
+
+#include "Key_Tree.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+
+/**
+ * @brief Maximum number of readers holding a snapshot at the same time, more readers wait for a free slot.
+ */
+const size_t max_concurrent_readers = 256;
+
+/**
+ * @class Concurrent_scheme
+ * @brief BES scheme shared by several threads: user key lookups and snapshot reads are lock free, changes of the denied users
+ * are serialized and published as a new snapshot. The scheme must only be used through the wrapper while it exists.
+ *
+ * @tparam Scheme BES_CSM_scheme or BES_SDM_scheme.
+ */
+template <class Scheme>
+class Concurrent_scheme {
+public:
+    typedef typename Scheme::Key_id Key_id;
+
+    /**
+     * @brief Immutable state of the denied users published by the writer.
+     */
+    struct Snapshot {
+        uint64_t version;                    ///< number of changes published before this snapshot
+        vector<unsigned int> revoked_users;  ///< IDs of the denied users, in ascending order
+        Key_batch<Key_id> cover;             ///< allowed keys with these denied users
+
+        /**
+         * @brief Whether a user is allowed in this snapshot.
+         */
+        bool is_allowed(unsigned int userID) const {
+            return !binary_search(revoked_users.begin(), revoked_users.end(), userID);
+        }
+    };
+
+    /**
+     * @class Read_guard
+     * @brief Pins a snapshot while it is alive, it must not outlive the Concurrent_scheme.
+     */
+    class Read_guard {
+    private:
+        const Concurrent_scheme* owner;
+        size_t slot;
+        const Snapshot* snapshot;
+
+    public:
+        Read_guard(const Concurrent_scheme* scheme, size_t reader_slot, const Snapshot* pinned)
+            : owner(scheme), slot(reader_slot), snapshot(pinned) {}
+
+        Read_guard(Read_guard&& other) noexcept : owner(other.owner), slot(other.slot), snapshot(other.snapshot) {
+            other.owner = nullptr;
+        }
+
+        Read_guard(const Read_guard&) = delete;
+        Read_guard& operator=(const Read_guard&) = delete;
+        Read_guard& operator=(Read_guard&&) = delete;
+
+        ~Read_guard() {
+            if (owner != nullptr)
+                owner->reader_slots[slot].epoch.store(0, memory_order_release); // the snapshot may be freed from now on
+        }
+
+        const Snapshot& operator*() const { return *snapshot; }
+        const Snapshot* operator->() const { return snapshot; }
+    };
+
+private:
+    /**
+     * @brief Epoch announced by a reader, 0 if the slot is free. One slot per cache line, so readers do not share lines.
+     */
+    struct alignas(64) Reader_slot {
+        atomic<uint64_t> epoch;
+    };
+
+    /**
+     * @brief Snapshot replaced by the writer, freed once no reader announced an epoch up to the one it was replaced in.
+     */
+    struct Retired_snapshot {
+        const Snapshot* snapshot;
+        uint64_t epoch;
+    };
+
+    Scheme& scheme;
+    size_t user_count;
+    mutex writer_mutex;                              ///< serializes the writers
+    atomic<const Snapshot*> current;                 ///< snapshot given to new readers
+    atomic<uint64_t> global_epoch;                   ///< incremented each time a snapshot is replaced
+    mutable Reader_slot reader_slots[max_concurrent_readers];
+    vector<Retired_snapshot> retired;                ///< replaced snapshots not freed yet, only used by the writer
+    uint64_t version;
+
+    /**
+     * @brief Takes a free reader slot announcing the current epoch, starting from a slot chosen by the thread.
+     */
+    size_t acquire_slot() const {
+        size_t start = hash<thread::id>()(this_thread::get_id()) % max_concurrent_readers;
+        for (;;) {
+            for (size_t i = 0; i < max_concurrent_readers; i++) {
+                size_t slot = (start + i) % max_concurrent_readers;
+                uint64_t free_slot = 0;
+                if (reader_slots[slot].epoch.load(memory_order_relaxed) == 0
+                    && reader_slots[slot].epoch.compare_exchange_strong(free_slot, global_epoch.load()))
+                    return slot;
+            }
+            this_thread::yield(); // every slot is taken
+        }
+    }
+
+    /**
+     * @brief Builds a snapshot of the scheme, with the writer lock held.
+     */
+    const Snapshot* take_snapshot() {
+        Snapshot* snapshot = new Snapshot();
+        snapshot->version = version++;
+        snapshot->revoked_users = scheme.get_revoked_users();
+        scheme.get_allowed_keys(snapshot->cover);
+        return snapshot;
+    }
+
+    /**
+     * @brief Replaces the current snapshot and frees the retired ones no reader can hold, with the writer lock held.
+     */
+    void publish() {
+        const Snapshot* replaced = current.exchange(take_snapshot());
+        retired.push_back({replaced, global_epoch.fetch_add(1)}); // readers announcing a later epoch see the new snapshot
+
+        uint64_t oldest_reader = UINT64_MAX;
+        for (size_t slot = 0; slot < max_concurrent_readers; slot++) {
+            uint64_t epoch = reader_slots[slot].epoch.load();
+            if (epoch != 0)
+                oldest_reader = min(oldest_reader, epoch);
+        }
+        size_t kept = 0;
+        for (const Retired_snapshot& old : retired) {
+            if (old.epoch < oldest_reader)
+                delete old.snapshot;
+            else
+                retired[kept++] = old;
+        }
+        retired.resize(kept);
+    }
+
+public:
+    /**
+     * @brief Constructor, publishes the first snapshot of the scheme.
+     *
+     * @param bes_scheme The scheme, used only through the wrapper from now on.
+     */
+    explicit Concurrent_scheme(Scheme& bes_scheme)
+        : scheme(bes_scheme), user_count(bes_scheme.get_numberof_users()), current(nullptr), global_epoch(1), version(0) {
+        for (size_t slot = 0; slot < max_concurrent_readers; slot++)
+            reader_slots[slot].epoch.store(0, memory_order_relaxed);
+        current.store(take_snapshot());
+    }
+
+    /**
+     * @brief Destructor, no reader may hold a snapshot.
+     */
+    ~Concurrent_scheme() {
+        for (const Retired_snapshot& old : retired)
+            delete old.snapshot;
+        delete current.load();
+    }
+
+    Concurrent_scheme(const Concurrent_scheme&) = delete;
+    Concurrent_scheme& operator=(const Concurrent_scheme&) = delete;
+
+    /**
+     * @brief Pins the current snapshot of the denied users and the cover, lock free.
+     *
+     * @return Guard keeping the snapshot alive.
+     */
+    Read_guard read_snapshot() const {
+        size_t slot = acquire_slot();
+        return Read_guard(this, slot, current.load());
+    }
+
+    /**
+     * @brief Gets the keys of an allowed user into a reusable batch, lock free. The keys do not depend on the denied users,
+     * but keys are only handed to users allowed in the current snapshot.
+     *
+     * @param userID The ID of the user.
+     * @param batch Batch to store the user keys (labels for SDM), emptied first.
+     * @return 1 if the keys are retrieved, 0 if the user is denied (the batch is left empty), -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid.
+     */
+    int get_user_keys(unsigned int userID, Key_batch<Key_id>& batch) const {
+        if (userID >= user_count) {
+            throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+            return -1;
+        }
+        batch.reset(scheme.get_key_length() / 8);
+        if (!read_snapshot()->is_allowed(userID))
+            return 0;
+        batch.resize(scheme.get_user_key_count());
+        return scheme.read_user_keys(userID, batch.ids(), batch.keys());
+    }
+
+    /**
+     * @brief Applies a change to the scheme with the writer lock held, and publishes the resulting snapshot.
+     *
+     * @param change Function receiving the scheme, it must not change the node keys.
+     */
+    template <class Change>
+    void update(Change change) {
+        lock_guard<mutex> lock(writer_mutex);
+        change(scheme);
+        publish();
+    }
+
+    /**
+     * @brief Denies access to a batch of users and publishes the new snapshot.
+     *
+     * @param userIDs The IDs of the users.
+     * @throws invalid_argument if any user ID is invalid, nothing is changed then.
+     */
+    void denegate_users(const vector<unsigned int>& userIDs) {
+        update([&userIDs](Scheme& bes_scheme) {
+            vector<Key_id> added_keys_id, removed_keys_id;
+            vector<uint8_t*> added_keys;
+            bes_scheme.denegate_users(userIDs, added_keys_id, added_keys, removed_keys_id);
+            for (uint8_t* key : added_keys)
+                delete[] key;
+        });
+    }
+
+    /**
+     * @brief Allows access again to a batch of users and publishes the new snapshot.
+     *
+     * @param userIDs The IDs of the users.
+     * @throws invalid_argument if any user ID is invalid, nothing is changed then.
+     */
+    void reinstate_users(const vector<unsigned int>& userIDs) {
+        update([&userIDs](Scheme& bes_scheme) {
+            vector<Key_id> added_keys_id, removed_keys_id;
+            vector<uint8_t*> added_keys;
+            bes_scheme.reinstate_users(userIDs, added_keys_id, added_keys, removed_keys_id);
+            for (uint8_t* key : added_keys)
+                delete[] key;
+        });
+    }
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include "BES_Journal.hpp"
+
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <cstdio> // for rename
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+////////////////////////////////////// PRIVATE METHODS ////////////////////////////////////////////////
+
+// Mixes the fields of a record with the generation of the journal, so records of an older journal do not pass as valid
+uint16_t Revocation_journal::record_check(uint32_t userID, uint8_t event, uint64_t generation) {
+    uint64_t hash = (userID * 0x9E3779B97F4A7C15ull) ^ (event * 0xC2B2AE3D27D4EB4Full) ^ (generation * 0x165667B19E3779F9ull);
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 32;
+    return static_cast<uint16_t>(hash) | 1; // never 0, so a zero filled tail is not a valid record
+}
+
+#ifndef _WIN32
+// Writes a whole buffer to a descriptor, retrying partial writes
+static void write_all(int fd, const void* buffer, size_t size) {
+    const char* data = static_cast<const char*>(buffer);
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            throw runtime_error("Error writing the journal");
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+// Reads a whole buffer from a descriptor, returning false at the end of the file
+static bool read_all(int fd, void* buffer, size_t size) {
+    char* data = static_cast<char*>(buffer);
+    while (size > 0) {
+        ssize_t result = read(fd, data, size);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        data += result;
+        size -= result;
+    }
+    return true;
+}
+
+// Flushes the directory of a path, so a file created or renamed in it survives a crash
+static void sync_directory(const string& path) {
+    size_t slash = path.find_last_of('/');
+    string directory = slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+void Revocation_journal::reset_journal(uint64_t new_generation) {
+    Journal_file_header header = {};
+
+    memcpy(header.magic, journal_file_magic, sizeof header.magic);
+    header.version = journal_file_version;
+    header.user_count = user_count;
+    header.generation = new_generation;
+    if (ftruncate(journal_fd, 0) != 0 || lseek(journal_fd, 0, SEEK_SET) != 0)
+        throw runtime_error("Error truncating the journal " + journal_path);
+    write_all(journal_fd, &header, sizeof header);
+    if (fdatasync(journal_fd) != 0)
+        throw runtime_error("Error flushing the journal " + journal_path);
+    generation = new_generation;
+    record_count = 0;
+}
+
+////////////////////////////////////// PUBLIC METHODS ////////////////////////////////////////////////
+
+// Opens or creates the journal, dropping a torn record at its end
+Revocation_journal::Revocation_journal(const string& path, size_t users, size_t group_events)
+    : journal_path(path), checkpoint_path(path + ".checkpoint"), journal_fd(-1), user_count(users), generation(0),
+      group_commit_events(max<size_t>(1, group_events)), record_count(0) {
+    Journal_file_header header, checkpoint_header;
+    uint64_t checkpoint_generation = 0;
+
+    int checkpoint_fd = open(checkpoint_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (checkpoint_fd != -1) {
+        if (read_all(checkpoint_fd, &checkpoint_header, sizeof checkpoint_header))
+            checkpoint_generation = checkpoint_header.generation;
+        close(checkpoint_fd);
+    }
+    pending_records.reserve(group_commit_events);
+    journal_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (journal_fd == -1)
+        throw runtime_error("Error opening the journal " + path);
+    if (!read_all(journal_fd, &header, sizeof header)) { // new journal, start it after the current checkpoint
+        reset_journal(checkpoint_generation);
+        sync_directory(path);
+        return;
+    }
+    if (memcmp(header.magic, journal_file_magic, sizeof header.magic) != 0 || header.version == 0
+        || header.version > journal_file_version || header.user_count != users) {
+        close(journal_fd);
+        throw runtime_error("Invalid journal " + path);
+    }
+    if (header.generation < checkpoint_generation) {
+        // a crash after a checkpoint was renamed and before the journal was emptied, its changes are in the checkpoint
+        reset_journal(checkpoint_generation);
+        return;
+    }
+    generation = header.generation;
+
+    // count the valid records, the first invalid one and everything after it were not committed
+    Journal_record record;
+    while (read_all(journal_fd, &record, sizeof record) && record.check == record_check(record.userID, record.event, generation)
+           && record.userID < user_count) {
+        record_count++;
+    }
+    off_t valid_end = sizeof header + record_count * sizeof(Journal_record);
+    if (ftruncate(journal_fd, valid_end) != 0 || lseek(journal_fd, valid_end, SEEK_SET) != valid_end) {
+        close(journal_fd);
+        throw runtime_error("Error truncating the journal " + path);
+    }
+}
+
+// Destructor, the pending changes are committed
+Revocation_journal::~Revocation_journal() {
+    try {
+        commit();
+    } catch (const runtime_error& error) {
+        cerr << error.what() << endl; // a destructor can not throw, the pending changes are lost
+    }
+    close(journal_fd);
+}
+
+// Commits every group of changes with a single write and flush
+void Revocation_journal::commit() {
+    if (pending_records.empty())
+        return;
+    write_all(journal_fd, pending_records.data(), pending_records.size() * sizeof(Journal_record));
+    pending_records.clear();
+    if (fdatasync(journal_fd) != 0)
+        throw runtime_error("Error flushing the journal " + journal_path);
+}
+
+// Writes the allowed users to a new checkpoint and starts a new generation of the journal
+void Revocation_journal::write_checkpoint(const vector<unsigned int>& revoked_users) {
+    Journal_file_header header = {};
+    string temporary_path = checkpoint_path + ".tmp";
+    User_bitset allowed_users; // packed as in the tree file
+
+    commit();
+    allowed_users.assign(user_count, true);
+    for (unsigned int userID : revoked_users) {
+        allowed_users.deny(userID);
+    }
+    memcpy(header.magic, checkpoint_file_magic, sizeof header.magic);
+    header.version = journal_file_version;
+    header.user_count = user_count;
+    header.generation = generation + 1;
+
+    int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        throw runtime_error("Error creating the checkpoint " + temporary_path);
+    try {
+        write_all(fd, &header, sizeof header);
+        write_all(fd, allowed_users.words(), allowed_users.word_count() * sizeof(uint64_t));
+        if (fsync(fd) != 0)
+            throw runtime_error("Error flushing the checkpoint " + temporary_path);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    if (rename(temporary_path.c_str(), checkpoint_path.c_str()) != 0)
+        throw runtime_error("Error renaming the checkpoint " + temporary_path);
+    sync_directory(checkpoint_path);
+
+    // the changes of the journal are in the checkpoint now
+    reset_journal(generation + 1);
+}
+
+// Applies the checkpoint and then the journal to a list of denied users
+bool Revocation_journal::recover(vector<unsigned int>& revoked_users) {
+    Journal_file_header header;
+    bool found = false;
+
+    int fd = open(checkpoint_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        vector<uint64_t> words((user_count + 63) / 64);
+        bool valid = read_all(fd, &header, sizeof header) && memcmp(header.magic, checkpoint_file_magic, sizeof header.magic) == 0
+                     && header.version != 0 && header.version <= journal_file_version && header.user_count == user_count
+                     && read_all(fd, words.data(), words.size() * sizeof(uint64_t));
+        close(fd);
+        if (!valid)
+            throw runtime_error("Invalid checkpoint " + checkpoint_path);
+        User_bitset allowed_users;
+        allowed_users.assign(user_count, false);
+        allowed_users.load_words(words.data(), 0, words.size());
+        revoked_users.clear();
+        allowed_users.append_revoked(revoked_users);
+        found = true;
+    }
+    if (record_count == 0) {
+        return found;
+    }
+
+    // last change of each user in the journal
+    unordered_map<unsigned int, bool> last_change;
+    vector<Journal_record> records(record_count);
+    if (pread(journal_fd, records.data(), record_count * sizeof(Journal_record), sizeof(Journal_file_header))
+        != static_cast<ssize_t>(record_count * sizeof(Journal_record)))
+        throw runtime_error("Error reading the journal " + journal_path);
+    for (const Journal_record& record : records) {
+        last_change[record.userID] = record.event == Journal_allow;
+    }
+    vector<unsigned int> denied, allowed;
+    for (const auto& change : last_change) {
+        (change.second ? allowed : denied).push_back(change.first);
+    }
+    sort(denied.begin(), denied.end());
+    sort(allowed.begin(), allowed.end());
+    vector<unsigned int> without_allowed, recovered;
+    set_difference(revoked_users.begin(), revoked_users.end(), allowed.begin(), allowed.end(), back_inserter(without_allowed));
+    set_union(without_allowed.begin(), without_allowed.end(), denied.begin(), denied.end(), back_inserter(recovered));
+    revoked_users.swap(recovered);
+    return true;
+}
+
+#else
+// The journal needs POSIX descriptors to flush and rename its files durably
+void Revocation_journal::reset_journal(uint64_t new_generation) {
+    generation = new_generation;
+}
+
+Revocation_journal::Revocation_journal(const string& path, size_t users, size_t group_events)
+    : journal_path(path), checkpoint_path(path + ".checkpoint"), journal_fd(-1), user_count(users), generation(0),
+      group_commit_events(group_events), record_count(0) {
+    throw runtime_error("The revocation journal is not supported on Windows");
+}
+
+Revocation_journal::~Revocation_journal() {
+}
+
+void Revocation_journal::commit() {
+}
+
+void Revocation_journal::write_checkpoint(const vector<unsigned int>& revoked_users) {
+}
+
+bool Revocation_journal::recover(vector<unsigned int>& revoked_users) {
+    return false;
+}
+#endif
+
+// Queues a change, committing the group once it is full
+void Revocation_journal::append(Journal_event event, unsigned int userID) {
+    Journal_record record = {userID, static_cast<uint8_t>(event), 0, record_check(userID, static_cast<uint8_t>(event), generation)};
+
+    pending_records.push_back(record);
+    record_count++;
+    if (pending_records.size() >= group_commit_events)
+        commit();
+}
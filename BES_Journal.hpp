@@ -0,0 +1,273 @@
+/**
+ * @file file implementing a write-ahead journal of the denied and allowed users of a BES scheme, so each change is
+ * persisted appending a few bytes instead of writing the whole tree again.
+ *
+ * The tree is written once with operator << (or mapped with map_file), the changes after it are appended to the journal
+ * and flushed to disk in groups, and from time to time a checkpoint with just the allowed users replaces the journal.
+ * When the scheme is loaded again, the checkpoint and then the journal are applied to it.
+ */
+#ifndef BES_JOURNAL_H
+#define BES_JOURNAL_H
+
+#include "Key_Tree.hpp"
+
+#include <string>
+#include <stdexcept>
+#include <iterator> // for back_inserter
+
+/**
+ * @brief Default number of changes written to the journal with a single flush to disk.
+ */
+const size_t default_group_commit_events = 64;
+
+/**
+ * @brief Default number of changes in the journal after which a checkpoint replaces it.
+ */
+const size_t default_checkpoint_interval = static_cast<size_t>(1) << 20;
+
+/**
+ * @brief Magic numbers at the start of the journal and checkpoint files.
+ */
+const char journal_file_magic[8] = {'B', 'E', 'S', '_', 'J', 'R', 'N', 'L'};
+const char checkpoint_file_magic[8] = {'B', 'E', 'S', '_', 'C', 'K', 'P', 'T'};
+
+/**
+ * @brief Current version of the journal and checkpoint file formats.
+ */
+const uint32_t journal_file_version = 1;
+
+/**
+ * @brief Changes recorded in the journal.
+ */
+enum Journal_event {
+    Journal_deny = 1,  ///< the user was denied access
+    Journal_allow = 2  ///< the user was allowed access again
+};
+
+/**
+ * @brief Header of the journal and checkpoint files, in host byte order. The journal follows it with records of 8 bytes,
+ * the checkpoint with the allowed users as 64 bit words (bit i % 64 of word i / 64 set if user i is allowed), as the tree file.
+ * Each checkpoint increases the generation, a journal older than the checkpoint is already part of it.
+ */
+struct Journal_file_header {
+    char magic[8];       ///< journal_file_magic or checkpoint_file_magic
+    uint32_t version;    ///< journal_file_version of the writer
+    uint32_t reserved;   ///< zero
+    uint64_t user_count; ///< number of users of the scheme
+    uint64_t generation; ///< number of checkpoints written before the file
+};
+
+/**
+ * @brief Record of a change in the journal, the check detects torn writes at the end of the file after a crash.
+ */
+struct Journal_record {
+    uint32_t userID;
+    uint8_t event;    ///< Journal_event
+    uint8_t reserved; ///< zero
+    uint16_t check;   ///< hash of the other fields and the generation of the journal
+};
+
+/**
+ * @class Revocation_journal
+ * @brief Append-only journal file of changes with group commit, and its checkpoint file (same path with ".checkpoint" appended).
+ */
+class Revocation_journal {
+private:
+    string journal_path;
+    string checkpoint_path;
+    int journal_fd;                         ///< descriptor of the journal opened for appending
+    uint64_t user_count;
+    uint64_t generation;                    ///< generation of the journal
+    size_t group_commit_events;             ///< number of pending records that triggers a commit
+    size_t record_count;                    ///< records in the journal, committed or pending
+    vector<Journal_record> pending_records; ///< records not written yet
+
+    /**
+     * @brief Check of a record in a journal of a given generation.
+     */
+    static uint16_t record_check(uint32_t userID, uint8_t event, uint64_t generation);
+
+    /**
+     * @brief Replaces the journal with an empty one of a generation, durably.
+     */
+    void reset_journal(uint64_t new_generation);
+
+public:
+    /**
+     * @brief Opens the journal at a path, or creates it. A torn record at the end, left by a crash, is dropped.
+     *
+     * @param path Path of the journal file.
+     * @param users Number of users of the scheme.
+     * @param group_events Number of changes written with a single flush to disk (1 flushes every change).
+     * @throws runtime_error if the file can not be opened or belongs to a scheme with another number of users.
+     */
+    Revocation_journal(const string& path, size_t users, size_t group_events = default_group_commit_events);
+
+    /**
+     * @brief Destructor, the pending changes are committed.
+     */
+    ~Revocation_journal();
+
+    /**
+     * @brief The journal owns its file descriptor, so it can not be copied.
+     */
+    Revocation_journal(const Revocation_journal&) = delete;
+    Revocation_journal& operator=(const Revocation_journal&) = delete;
+
+    /**
+     * @brief Appends a change, the journal is committed when group_commit_events changes are pending.
+     *
+     * @param event The change.
+     * @param userID The ID of the user.
+     */
+    void append(Journal_event event, unsigned int userID);
+
+    /**
+     * @brief Writes the pending changes and flushes them to disk at once.
+     *
+     * @throws runtime_error if the changes can not be written.
+     */
+    void commit();
+
+    /**
+     * @brief Get the number of changes in the journal since the last checkpoint.
+     */
+    size_t get_record_count() const { return record_count; }
+
+    /**
+     * @brief Writes a checkpoint with the allowed users and empties the journal. The checkpoint is written to a temporary file
+     * and renamed, so a crash leaves either the old or the new one; replaying an old journal over the new checkpoint
+     * gives the same users, as every change sets the state of its user.
+     *
+     * @param revoked_users The IDs of the denied users, in ascending order.
+     */
+    void write_checkpoint(const vector<unsigned int>& revoked_users);
+
+    /**
+     * @brief Reads the denied users after the checkpoint and the committed changes of the journal.
+     *
+     * @param revoked_users On input the denied users of the tree the journal was started from, in ascending order;
+     * on return the denied users after the checkpoint and the journal, in ascending order.
+     * @return true if a checkpoint or any change was found.
+     */
+    bool recover(vector<unsigned int>& revoked_users);
+};
+
+/**
+ * @class Journaled_scheme
+ * @brief BES scheme whose denied users are persisted through a Revocation_journal. The scheme must be loaded from the tree file
+ * the journal was started from (or be the one that will be written to it), the journal is replayed on it when constructed.
+ *
+ * @tparam Scheme BES_CSM_scheme or BES_SDM_scheme.
+ */
+template <class Scheme>
+class Journaled_scheme {
+private:
+    Scheme& scheme;
+    Revocation_journal journal;
+    size_t checkpoint_interval; ///< number of changes in the journal that triggers a checkpoint
+
+    /**
+     * @brief Denies or allows a batch of users in the scheme, the change of the cover is not needed.
+     */
+    void change_users(const vector<unsigned int>& userIDs, bool allowed) {
+        vector<typename Scheme::Key_id> added_keys_id, removed_keys_id;
+        vector<uint8_t*> added_keys;
+
+        if (userIDs.empty())
+            return;
+        if (allowed)
+            scheme.reinstate_users(userIDs, added_keys_id, added_keys, removed_keys_id);
+        else
+            scheme.denegate_users(userIDs, added_keys_id, added_keys, removed_keys_id);
+        for (uint8_t* key : added_keys)
+            delete[] key;
+    }
+
+    /**
+     * @brief Writes a checkpoint if enough changes are in the journal.
+     */
+    void checkpoint_if_needed() {
+        if (journal.get_record_count() >= checkpoint_interval)
+            checkpoint();
+    }
+
+public:
+    /**
+     * @brief Constructor, the checkpoint and the journal at a path are applied to the scheme.
+     *
+     * @param bes_scheme The scheme, as loaded from its tree file.
+     * @param journal_path Path of the journal file, the checkpoint is at journal_path + ".checkpoint".
+     * @param changes_per_checkpoint Number of changes in the journal that triggers a checkpoint.
+     * @param group_events Number of changes written with a single flush to disk.
+     * @throws runtime_error if the journal can not be opened or belongs to another scheme.
+     */
+    Journaled_scheme(Scheme& bes_scheme, const string& journal_path, size_t changes_per_checkpoint = default_checkpoint_interval,
+                     size_t group_events = default_group_commit_events)
+        : scheme(bes_scheme), journal(journal_path, bes_scheme.get_numberof_users(), group_events), checkpoint_interval(changes_per_checkpoint)
+    {
+        const vector<unsigned int>& current = scheme.get_revoked_users();
+        vector<unsigned int> recovered(current);
+        vector<unsigned int> to_deny, to_allow;
+
+        if (!journal.recover(recovered))
+            return;
+        set_difference(recovered.begin(), recovered.end(), current.begin(), current.end(), back_inserter(to_deny));
+        set_difference(current.begin(), current.end(), recovered.begin(), recovered.end(), back_inserter(to_allow));
+        change_users(to_allow, true);
+        change_users(to_deny, false);
+    }
+
+    /**
+     * @brief Denies access to a user in the scheme and appends the change to the journal.
+     *
+     * @param userID The ID of the user.
+     * @return 1 if the user is successfully denied, -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid, nothing is journaled then.
+     */
+    int denegate_user(unsigned int userID) {
+        int result = scheme.denegate_user(userID);
+        journal.append(Journal_deny, userID);
+        checkpoint_if_needed();
+        return result;
+    }
+
+    /**
+     * @brief Allows access again to a user in the scheme and appends the change to the journal.
+     *
+     * @param userID The ID of the user.
+     * @return 1 if the user is successfully allowed, -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid, nothing is journaled then.
+     */
+    int reinstate_user(unsigned int userID) {
+        int result = scheme.reinstate_user(userID);
+        journal.append(Journal_allow, userID);
+        checkpoint_if_needed();
+        return result;
+    }
+
+    /**
+     * @brief Writes the pending changes of the journal to disk, the changes are durable on return.
+     */
+    void commit() { journal.commit(); }
+
+    /**
+     * @brief Writes a checkpoint of the denied users of the scheme and empties the journal.
+     */
+    void checkpoint() {
+        journal.commit();
+        journal.write_checkpoint(scheme.get_revoked_users());
+    }
+
+    /**
+     * @brief Get the journaled scheme.
+     */
+    Scheme& get_scheme() { return scheme; }
+
+    /**
+     * @brief Get the journal.
+     */
+    Revocation_journal& get_journal() { return journal; }
+};
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef BES_METRICS_H
+#define BES_METRICS_H
+
+/**
+ * @file BES_Metrics.hpp
+ * @brief File containing the optional counters and timers of the BES schemes: calls, AES blocks generated, nodes visited,
+ * bytes allocated, cover sizes and serialization traffic. They are process wide and only compiled in with -DBES_ENABLE_METRICS;
+ * otherwise the BES_METRIC_* macros expand to nothing (their arguments are not evaluated) and every value reads as 0.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+
+#ifdef BES_ENABLE_METRICS
+#include <atomic>
+#include <chrono>
+#endif
+
+using namespace std;
+
+/**
+ * @brief Metrics kept by the schemes, the index of each one in Metrics_stats::values.
+ */
+enum Metric_id
+{
+    Metric_sdm_allowed_keys_calls,   ///< calls to BES_SDM_scheme::get_allowed_keys
+    Metric_sdm_allowed_keys_time,    ///< nanoseconds spent in BES_SDM_scheme::get_allowed_keys, cover update included
+    Metric_sdm_cover_size,           ///< subsets in the last cover returned by BES_SDM_scheme::get_allowed_keys
+    Metric_sdm_nodes_classified,     ///< nodes classified while building or updating the SDM cover
+    Metric_sdm_subsets_found,        ///< subsets located by walking down to their low node
+    Metric_sdm_subset_keys_derived,  ///< subset keys derived from the label chains
+    Metric_sdm_user_labels_calls,    ///< users whose labels were derived, get_user_labels, read_user_keys and provisioning
+    Metric_csm_allowed_keys_calls,   ///< calls to BES_CSM_scheme::get_allowed_keys
+    Metric_csm_allowed_keys_time,    ///< nanoseconds spent in BES_CSM_scheme::get_allowed_keys
+    Metric_csm_cover_size,           ///< nodes in the last cover returned by BES_CSM_scheme::get_allowed_keys
+    Metric_csm_nodes_visited,        ///< nodes visited while searching the CSM cover
+    Metric_aes_blocks,               ///< AES blocks generated for node keys, labels and subset keys
+    Metric_key_bytes_allocated,      ///< bytes of the keys allocated with new[] and handed to the caller
+    Metric_tree_writes,              ///< trees written with operator <<
+    Metric_tree_write_time,          ///< nanoseconds spent writing trees
+    Metric_tree_write_bytes,         ///< bytes of the trees written
+    Metric_tree_reads,               ///< trees read with operator >>
+    Metric_tree_read_time,           ///< nanoseconds spent reading trees
+    Metric_tree_read_bytes,          ///< bytes of the trees read, legacy files excluded
+    Metric_count
+};
+
+/**
+ * @brief Name, Prometheus type and help text of a metric. Times are kept in nanoseconds and exported in seconds.
+ */
+struct Metric_info
+{
+    const char* name;
+    const char* type;
+    const char* help;
+    bool nanoseconds;
+};
+
+const Metric_info metric_info[Metric_count] = {
+    {"bes_sdm_get_allowed_keys_calls_total", "counter", "Calls to BES_SDM_scheme::get_allowed_keys.", false},
+    {"bes_sdm_get_allowed_keys_seconds_total", "counter", "Time spent in BES_SDM_scheme::get_allowed_keys.", true},
+    {"bes_sdm_cover_size", "gauge", "Subsets in the last SDM cover returned.", false},
+    {"bes_sdm_nodes_classified_total", "counter", "Nodes classified while building or updating the SDM cover.", false},
+    {"bes_sdm_subsets_found_total", "counter", "SDM subsets located walking down to their low node.", false},
+    {"bes_sdm_subset_keys_derived_total", "counter", "SDM subset keys derived from the label chains.", false},
+    {"bes_sdm_user_labels_total", "counter", "Users whose SDM labels were derived.", false},
+    {"bes_csm_get_allowed_keys_calls_total", "counter", "Calls to BES_CSM_scheme::get_allowed_keys.", false},
+    {"bes_csm_get_allowed_keys_seconds_total", "counter", "Time spent in BES_CSM_scheme::get_allowed_keys.", true},
+    {"bes_csm_cover_size", "gauge", "Nodes in the last CSM cover returned.", false},
+    {"bes_csm_nodes_visited_total", "counter", "Nodes visited while searching the CSM cover.", false},
+    {"bes_aes_blocks_total", "counter", "AES blocks generated for node keys, labels and subset keys.", false},
+    {"bes_key_bytes_allocated_total", "counter", "Bytes of keys allocated for the caller.", false},
+    {"bes_tree_writes_total", "counter", "Trees written.", false},
+    {"bes_tree_write_seconds_total", "counter", "Time spent writing trees.", true},
+    {"bes_tree_write_bytes_total", "counter", "Bytes of the trees written.", false},
+    {"bes_tree_reads_total", "counter", "Trees read.", false},
+    {"bes_tree_read_seconds_total", "counter", "Time spent reading trees.", true},
+    {"bes_tree_read_bytes_total", "counter", "Bytes of the trees read.", false},
+};
+
+/**
+ * @brief Snapshot of the metrics, all 0 when they are not compiled in.
+ */
+struct Metrics_stats
+{
+    uint64_t values[Metric_count];
+
+    uint64_t operator[](Metric_id metric) const { return values[metric]; }
+
+    /**
+     * @brief Value of a metric as exported, times in seconds.
+     */
+    double exported(Metric_id metric) const {
+        return metric_info[metric].nanoseconds ? values[metric] * 1e-9 : static_cast<double>(values[metric]);
+    }
+};
+
+/**
+ * @brief Number of AES blocks generated for an output of out_len bytes.
+ */
+inline uint64_t aes_output_blocks(size_t out_len) {
+    return (out_len + 15) / 16;
+}
+
+#ifdef BES_ENABLE_METRICS
+
+/**
+ * @brief Whether the metrics are compiled in.
+ */
+const bool metrics_enabled = true;
+
+/**
+ * @brief The counters of the process, updated with relaxed atomics so the threads of the schemes do not synchronize on them.
+ */
+inline atomic<uint64_t>* metric_values() {
+    static atomic<uint64_t> values[Metric_count];
+    return values;
+}
+
+inline void metric_add(Metric_id metric, uint64_t value) {
+    metric_values()[metric].fetch_add(value, memory_order_relaxed);
+}
+
+inline void metric_set(Metric_id metric, uint64_t value) {
+    metric_values()[metric].store(value, memory_order_relaxed);
+}
+
+/**
+ * @class Metric_timer
+ * @brief Adds the nanoseconds from its construction to its destruction to a metric.
+ */
+class Metric_timer
+{
+private:
+    Metric_id metric;
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit Metric_timer(Metric_id timed_metric) : metric(timed_metric), start(chrono::steady_clock::now()) {}
+
+    ~Metric_timer() {
+        metric_add(metric, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+
+    Metric_timer(const Metric_timer&) = delete;
+    Metric_timer& operator=(const Metric_timer&) = delete;
+};
+
+#define BES_METRIC_ADD(metric, value) metric_add(metric, value)
+#define BES_METRIC_SET(metric, value) metric_set(metric, value)
+#define BES_METRIC_TIMER(metric) Metric_timer metric_timer_##metric(metric)
+
+#else
+
+const bool metrics_enabled = false;
+
+// sizeof keeps the operands "used" for the compiler without evaluating them
+#define BES_METRIC_ADD(metric, value) ((void)sizeof(value))
+#define BES_METRIC_SET(metric, value) ((void)sizeof(value))
+#define BES_METRIC_TIMER(metric) ((void)0)
+
+#endif
+
+/**
+ * @brief Reads the current value of every metric.
+ */
+inline Metrics_stats get_metrics_stats() {
+    Metrics_stats stats = {};
+#ifdef BES_ENABLE_METRICS
+    for (size_t i = 0; i < Metric_count; i++)
+        stats.values[i] = metric_values()[i].load(memory_order_relaxed);
+#endif
+    return stats;
+}
+
+/**
+ * @brief Sets every metric back to 0.
+ */
+inline void reset_metrics_stats() {
+#ifdef BES_ENABLE_METRICS
+    for (size_t i = 0; i < Metric_count; i++)
+        metric_values()[i].store(0, memory_order_relaxed);
+#endif
+}
+
+/**
+ * @brief Writes the metrics in the Prometheus text exposition format, nothing if they are not compiled in.
+ *
+ * @param os Stream to write to, e.g. the body of a /metrics response.
+ */
+inline void write_metrics_prometheus(ostream& os) {
+    if (!metrics_enabled)
+        return;
+    Metrics_stats stats = get_metrics_stats();
+    ios::fmtflags flags = os.flags();
+    streamsize precision = os.precision(9); // times in seconds keep their nanoseconds
+    for (size_t i = 0; i < Metric_count; i++) {
+        const Metric_info& info = metric_info[i];
+        os << "# HELP " << info.name << ' ' << info.help << '\n';
+        os << "# TYPE " << info.name << ' ' << info.type << '\n';
+        os << info.name << ' ';
+        if (info.nanoseconds)
+            os << fixed << stats.exported(static_cast<Metric_id>(i)) << '\n';
+        else
+            os << stats.values[i] << '\n';
+    }
+    os.precision(precision);
+    os.flags(flags);
+}
+
+#endif
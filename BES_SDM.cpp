@@ -1,336 +1,1303 @@
 #include "BES_SDM.hpp"
 
-////////////////////////////////////// PRIVATE METHODS ////////////////////////////////////////////////
+#include <numeric> // for iota
+#include <thread>
 
-// finds the path between a leaf and a node
-int BES_SDM_scheme::find_path(unsigned int leaf_node_index, unsigned int root_node_index, vector<unsigned int> &path)
-{
-    if (leaf_node_index == root_node_index)
-    {
-        return -1; // both are same node, nothing to be done
-    }
-    path.push_back(leaf_node_index); // the leaf node is the first node on the path
-    while (leaf_node_index != root_node_index)
-    {
-        leaf_node_index = get_father_index(leaf_node_index);
-        path.push_back(leaf_node_index); // add the node to the path as it is father of the current index
-        if (leaf_node_index == 0)
-        { // if we already found the root, stop the while loop
-            break;
-        }
-    }
-    return 1; // path found correctly
-}
+////////////////////////////////////// PRIVATE METHODS ////////////////////////////////////////////////
 
-void BES_SDM_scheme::drbg_triplesize(uint8_t *key_in, size_t key_size, uint8_t *triple_out)
+void BES_SDM_scheme::drbg_triplesize(const uint8_t *key_in, uint8_t *left, uint8_t *middle, uint8_t *right)
 {
-    aes_stream_state drbg_context;                         // context for the deterministic random byte generator used for key derivation
-    aes_stream_init(&drbg_context, key_in);                // initializates the DRBG with the input key
-    aes_stream(&drbg_context, triple_out, (key_size) * 3); // triples de output with the DRBG
+    aes_triple_prg(key_in, Key_length / 8, left, middle, right); // one-shot DRBG, only the requested thirds are computed
+    BES_METRIC_ADD(Metric_aes_blocks, ((left != nullptr) + (middle != nullptr) + (right != nullptr)) * aes_output_blocks(Key_length / 8));
 }
 
-Key_subset BES_SDM_scheme::find_subset_and_key(int subtree_root_node, std::vector<char> node_tree, uint8_t *key)
+Key_subset BES_SDM_scheme::find_subset(unsigned int subtree_root_node) const
 {
-    uint8_t drbg_output[32 * 3]; // data buffer to triple the output of the DRBG
-    uint8_t iterator_key[32];    // data buffer to iterate the key tree
-    int current_index = subtree_root_node;
-    unsigned int key_length_bytes = Key_length / 8;
+    unsigned int current_index = subtree_root_node;
     Key_subset KS_to_return;
 
-    memcpy(iterator_key, FCB_tree[current_index], key_length_bytes); // copy the subtree root node key
-    while (node_tree[current_index] != D_node)
+    while (get_node_type(current_index) != D_node)
     {
-        if (node_tree[get_leftchild_index(current_index)] == S_node)
+        if (get_node_type(get_leftchild_index(current_index)) == S_node)
         { // if the S node is on the left, iterate in the tree to the left
-            drbg_triplesize(iterator_key, key_length_bytes, drbg_output);
-            memcpy(iterator_key, drbg_output, key_length_bytes);
             current_index = get_leftchild_index(current_index);
         }
-        else if (node_tree[get_rightchild_index(current_index)] == S_node)
+        else if (get_node_type(get_rightchild_index(current_index)) == S_node)
         { // if the S node is on the right, iterate in the tree to the right
-            drbg_triplesize(iterator_key, key_length_bytes, drbg_output);
-            memcpy(iterator_key, drbg_output + (key_length_bytes * 2), key_length_bytes);
             current_index = get_rightchild_index(current_index);
         }
         else
         {
-            if (node_tree[get_leftchild_index(current_index)] == D_node)
+            if (get_node_type(get_leftchild_index(current_index)) == D_node)
             {
-                drbg_triplesize(iterator_key, key_length_bytes, drbg_output);
-                memcpy(iterator_key, drbg_output, key_length_bytes);
                 current_index = get_leftchild_index(current_index);
             }
-            else if (node_tree[get_rightchild_index(current_index)] == D_node)
+            else if (get_node_type(get_rightchild_index(current_index)) == D_node)
             {
-                drbg_triplesize(iterator_key, key_length_bytes, drbg_output);
-                memcpy(iterator_key, drbg_output + (key_length_bytes * 2), key_length_bytes);
                 current_index = get_rightchild_index(current_index);
             }
         }
     }
     KS_to_return.high_node = subtree_root_node;
     KS_to_return.low_node = current_index;
-    drbg_triplesize(iterator_key, key_length_bytes, drbg_output);
-    memcpy(key, drbg_output + key_length_bytes, key_length_bytes); // key supposed to be allocated from the outside
-    return KS_to_return;                                           // everything ok, key also calculated
+    BES_METRIC_ADD(Metric_sdm_subsets_found, 1);
+    return KS_to_return; // everything ok, the key is derived later with derive_subset_keys
 }
 
-////////////////////////////////////// PUBLIC METHODS ////////////////////////////////////////////////
+char BES_SDM_scheme::classify_children(char left_node, char right_node, bool &close_left, bool &close_right)
+{
+    close_left = close_right = false;
+    if (left_node == O_node && right_node == O_node) // if both children are allowed nodes
+        return O_node;
+    if (left_node == D_node && right_node == D_node) // if both children are denied nodes
+        return D_node;
+    if ((left_node == D_node && right_node == O_node) || (left_node == O_node && right_node == D_node)) // if either of both child nodes is denied, and the other is operative
+        return S_node;
+    if ((left_node == S_node && right_node == O_node) || (left_node == O_node && right_node == S_node))
+        return S_node;
+    // at least one S child and no O child: the S children subtrees are closed as subsets and the node becomes denied
+    close_left = left_node == S_node;
+    close_right = right_node == S_node;
+    return D_node;
+}
 
-// Constructor for the BES_SDM_scheme class
-BES_SDM_scheme::BES_SDM_scheme(size_t Tree_Depth, size_t node_key_length): Keytree(Tree_Depth, node_key_length) {
-    Fill_With_Random(all_users_allowed_key,node_key_length/8);
+void BES_SDM_scheme::classify_node(unsigned int node_index, Cover_node &emitted)
+{
+    unsigned int left_index = get_leftchild_index(node_index);
+    unsigned int right_index = get_rightchild_index(node_index);
+    bool close_left, close_right;
+
+    emitted.subset_count = 0;
+    emitted.keys_ready = false;
+    set_node_type(node_index, classify_children(get_node_type(left_index), get_node_type(right_index), close_left, close_right));
+    if (close_left)
+        emitted.subsets[emitted.subset_count++] = find_subset(left_index);
+    if (close_right)
+        emitted.subsets[emitted.subset_count++] = find_subset(right_index);
+    if (node_index == 0 && get_node_type(0) == S_node)
+    { // base case, the root closes the last subset
+        emitted.subsets[emitted.subset_count++] = find_subset(0);
+    }
 }
 
-// Method to deny access to a user by their user ID
-int BES_SDM_scheme::denegate_user(unsigned int userID)
+// Keeps the 2 bit fields at bits 4j of a word and packs them in its low 32 bits
+static inline uint64_t pack_pair_fields(uint64_t fields)
 {
-    if (userID >= allowed_users.size())
+    fields &= 0x3333333333333333ull;
+    fields = (fields | fields >> 2) & 0x0F0F0F0F0F0F0F0Full;
+    fields = (fields | fields >> 4) & 0x00FF00FF00FF00FFull;
+    fields = (fields | fields >> 8) & 0x0000FFFF0000FFFFull;
+    return (fields | fields >> 16) & 0x00000000FFFFFFFFull;
+}
+
+// Classifies the 16 parents of the 32 children packed in a word, as classify_children on each pair of 2 bit fields at once.
+// The O, D and S types are 0, 1 and 2, so bit 0 of a field is set for D nodes and bit 1 for S nodes
+static inline void classify_children_word(uint64_t children, uint64_t &types, uint64_t &closed)
+{
+    const uint64_t pair_bits = 0x1111111111111111ull;      // bit 4j, the first bit of the left child of pair j
+    uint64_t operative = ~(children | children >> 1);       // bit 2k set if child k is an O node
+    uint64_t left_operative = operative & pair_bits;
+    uint64_t right_operative = (operative >> 2) & pair_bits;
+    uint64_t denied = ~(left_operative | right_operative) & pair_bits; // no O child
+    uint64_t semi = left_operative ^ right_operative;                  // a single O child
+
+    types = pack_pair_fields(denied | semi << 1);
+    closed = pack_pair_fields((denied & children >> 1) | (denied & children >> 3) << 1); // the S children of a D parent
+}
+
+// Classifies the parents of the children in 2 * parent_words words, giving their packed types and for each parent a field
+// with bit 0 set if its left child closes a subset and bit 1 if its right child does
+#if defined(__GNUC__)
+__attribute__((always_inline))
+#endif
+static inline void classify_children_words_loop(const uint64_t *children, size_t parent_words, uint64_t *types, uint64_t *closed)
+{
+    for (size_t word = 0; word < parent_words; word++)
     {
-        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
-        return -1;
+        uint64_t low_types, low_closed, high_types, high_closed;
+        classify_children_word(children[2 * word], low_types, low_closed);
+        classify_children_word(children[2 * word + 1], high_types, high_closed);
+        types[word] = low_types | high_types << 32;
+        closed[word] = low_closed | high_closed << 32;
     }
-    else
+}
+
+typedef void (*Classify_children_words)(const uint64_t *, size_t, uint64_t *, uint64_t *);
+
+// GCC only vectorizes at -O3 or when asked, clang at -O2 already
+#if defined(__GNUC__) && !defined(__clang__)
+# define SDM_VECTORIZE __attribute__((optimize("tree-vectorize")))
+#else
+# define SDM_VECTORIZE
+#endif
+
+SDM_VECTORIZE
+static void classify_children_words_portable(const uint64_t *children, size_t parent_words, uint64_t *types, uint64_t *closed)
+{
+    classify_children_words_loop(children, parent_words, types, closed);
+}
+
+// The same loop compiled for AVX2 and AVX-512, the compiler packs 4 or 8 words in a vector
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define SDM_CLASSIFY_SIMD 1
+SDM_VECTORIZE __attribute__((target("avx2")))
+static void classify_children_words_avx2(const uint64_t *children, size_t parent_words, uint64_t *types, uint64_t *closed)
+{
+    classify_children_words_loop(children, parent_words, types, closed);
+}
+
+SDM_VECTORIZE __attribute__((target("avx512f")))
+static void classify_children_words_avx512(const uint64_t *children, size_t parent_words, uint64_t *types, uint64_t *closed)
+{
+    classify_children_words_loop(children, parent_words, types, closed);
+}
+#else
+# define SDM_CLASSIFY_SIMD 0
+#endif
+
+// Picks the widest kernel supported by the CPU the first time it is used
+static void classify_children_words(const uint64_t *children, size_t parent_words, uint64_t *types, uint64_t *closed)
+{
+    static const Classify_children_words kernel = []() -> Classify_children_words {
+#if SDM_CLASSIFY_SIMD
+        if (__builtin_cpu_supports("avx512f"))
+            return classify_children_words_avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return classify_children_words_avx2;
+#endif
+        return classify_children_words_portable;
+    }();
+    kernel(children, parent_words, types, closed);
+}
+
+void BES_SDM_scheme::classify_level_range(size_t first_position, size_t node_count, vector<pair<unsigned long long, Cover_node>> &emitted)
+{
+    const size_t chunk_words = 64;
+    uint64_t types[chunk_words];
+    uint64_t closed[chunk_words];
+    size_t first_word = first_position / 32;
+    size_t words = (node_count + 31) / 32;
+    // a level of less than 32 nodes shares its word with the levels above it
+    uint64_t level_mask = node_count >= 32 ? ~0ull : ((1ull << (2 * node_count)) - 1) << (2 * (first_position % 32));
+    Cover_node node;
+
+    for (size_t chunk = 0; chunk < words; chunk += chunk_words)
     {
-        // Calculate the node key index for the user ID
-        int key_index = userID + allowed_users.size() - 1;
-        allowed_users[userID] = false; // Deny access to the user
-        return 1;
+        size_t count = min(chunk_words, words - chunk);
+        classify_children_words(node_tree.data() + 2 * (first_word + chunk), count, types, closed);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t word = first_word + chunk + i;
+            node_tree[word] = (node_tree[word] & ~level_mask) | (types[i] & level_mask);
+            for (uint64_t pending = closed[i] & level_mask; pending != 0;)
+            { // the subsets of the S children of each D parent in the mask, the left one first
+                unsigned int field = ctz64(pending) / 2;
+                unsigned int node_index = static_cast<unsigned int>(word * 32 + field - 1);
+                node.subset_count = 0;
+                node.keys_ready = false;
+                if ((pending >> (2 * field)) & 1)
+                    node.subsets[node.subset_count++] = find_subset(get_leftchild_index(node_index));
+                if ((pending >> (2 * field)) & 2)
+                    node.subsets[node.subset_count++] = find_subset(get_rightchild_index(node_index));
+                pending &= ~(3ull << (2 * field));
+                emitted.push_back({cover_order(node_index), node});
+            }
+        }
     }
+    BES_METRIC_ADD(Metric_sdm_nodes_classified, node_count);
 }
 
-// Method to get the keys for a specific user
-int BES_SDM_scheme::get_user_labels(unsigned int userID, vector<Key_subset> &user_labels_id, vector<uint8_t *> &user_labels)
+void BES_SDM_scheme::build_cover()
 {
-    if (userID >= allowed_users.size())
+    map<unsigned long long, Cover_node> fresh;
+    vector<pair<unsigned long long, Cover_node>> top_cover;
+    const size_t word_levels = 5; // levels below the root of a subtree until a level of it fills a word
+
+    node_tree.assign(max<size_t>(2, (number_of_nodes + 32) / 32), 0); // every node O, the position number_of_nodes included
+    for (unsigned int userID : revoked_users)
+    { // initialize leaf nodes, denegated users are denied nodes
+        set_node_type(number_of_nodes / 2 + userID, D_node);
+    }
+    // the subtrees below the split level own whole words of node_tree from word_levels below their root, each one is
+    // classified there by a thread with a partial cover of its own
+    size_t split_level = cover_threads == 1 ? 0 : parallel_split_level(cover_threads);
+    size_t subtrees = static_cast<size_t>(1) << split_level;
+    vector<vector<pair<unsigned long long, Cover_node>>> partial_covers(subtrees);
+    parallel_for(subtrees, cover_threads, [&](size_t subtree) {
+        for (size_t level = depth; level-- > split_level + word_levels;) // children before parents
+        {
+            size_t level_nodes = static_cast<size_t>(1) << (level - split_level);
+            classify_level_range((subtrees + subtree) * level_nodes, level_nodes, partial_covers[subtree]);
+        }
+    });
+    for (const auto &partial_cover : partial_covers)
     {
-        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
-        return -1;
+        fresh.insert(partial_cover.begin(), partial_cover.end());
     }
-    Key_subset aux_subset;                                                 // auxiliar struct for adding the key indexs
-    unsigned int user_node_index = pow(2, depth) + userID - 1;             // calculate the leaf position in the tree corresponding to the user
-    unsigned int current_node_iterator = user_node_index;                  // iterator for move between the leaf and the subtree root node
-    unsigned int current_subtree_root = get_father_index(user_node_index); // root node of the current subtree
-    vector<unsigned int> path;                                             // path from the subtree root, to the leaf node
-    uint8_t drbg_output[32 * 3];                                           // data buffer to triple the output of the DRBG
-    uint8_t iterator_key[32];                                              // data buffer to iterate the key tree
-    uint8_t *ptr_key = nullptr;
-    size_t Key_length_bytes = Key_length / 8;
+    for (size_t level = min(depth, split_level + word_levels); level-- > 0;) // the levels above, a whole level at a time
+    {
+        classify_level_range(static_cast<size_t>(1) << level, static_cast<size_t>(1) << level, top_cover);
+    }
+    if (get_node_type(0) == S_node)
+    { // base case, the root closes the last subset
+        Cover_node root;
+        root.subset_count = 1;
+        root.keys_ready = false;
+        root.subsets[0] = find_subset(0);
+        top_cover.push_back({cover_order(0), root});
+    }
+    fresh.insert(top_cover.begin(), top_cover.end());
+    merge_cover(fresh);
+}
 
-    for (int i = depth; i > 0; i--)
-    { // for each subtree such that the current node leaf is part of
-        find_path(current_node_iterator, current_subtree_root, path);
-        memcpy(iterator_key, FCB_tree[current_subtree_root], Key_length_bytes);
-        for (int j = path.size() - 1; j > 0; j--)
-        {                                                                 // add the key with subset: i=current_subtree_root and j = get_rightchild_index(path[j])
-            drbg_triplesize(iterator_key, Key_length_bytes, drbg_output); // derivate the subnodes labels, and the current node key
+void BES_SDM_scheme::merge_steiner_levels(vector<Steiner_node> &level, size_t bottom_level, size_t top_level,
+                                          vector<pair<unsigned long long, Cover_node>> &emitted_nodes) const
+{
+    vector<Steiner_node> parents; // the non O nodes of a level, by index, nodes missing from the lists are O nodes
+    Cover_node emitted;
+    bool close_left, close_right;
 
-            if (path[j - 1] == get_leftchild_index(path[j]))
+    parents.reserve(level.size());
+    for (size_t current_level = bottom_level; current_level > top_level; current_level--)
+    {
+        parents.clear();
+        for (size_t i = 0; i < level.size();)
+        { // siblings are next to each other in the list, an absent sibling is an O node
+            unsigned int node_index = get_father_index(level[i].index);
+            Steiner_node left = {get_leftchild_index(node_index), O_node, 0};
+            Steiner_node right = {get_rightchild_index(node_index), O_node, 0};
+            if (level[i].index == left.index)
+                left = level[i++];
+            if (i < level.size() && level[i].index == right.index)
+                right = level[i++];
+
+            Steiner_node node = {node_index, classify_children(left.type, right.type, close_left, close_right), 0};
+            emitted.subset_count = 0;
+            emitted.keys_ready = false;
+            if (close_left)
+                emitted.subsets[emitted.subset_count++] = {left.index, left.low_node};
+            if (close_right)
+                emitted.subsets[emitted.subset_count++] = {right.index, right.low_node};
+            if (node.type == S_node)
+            { // same walk as find_subset: follow the S child if any, else stop at the D child
+                if (left.type == S_node)
+                    node.low_node = left.low_node;
+                else if (right.type == S_node)
+                    node.low_node = right.low_node;
+                else
+                    node.low_node = left.type == D_node ? left.index : right.index;
+                if (node_index == 0)
+                { // base case, the root closes the last subset
+                    emitted.subsets[emitted.subset_count++] = {0, node.low_node};
+                }
+            }
+            if (emitted.subset_count > 0)
             {
-                memcpy(iterator_key, drbg_output, Key_length_bytes);
-                ptr_key = new uint8_t[Key_length_bytes];
-                memcpy(ptr_key, drbg_output + (Key_length_bytes * 2), Key_length / 8);
-                aux_subset.low_node = get_rightchild_index(path[j]);
+                emitted_nodes.push_back({cover_order(node_index), emitted});
             }
-            else
-            { // add the key with subset: i=current_subtree_root and j = get_leftchild_index(path[j])
-                memcpy(iterator_key, drbg_output + (Key_length_bytes * 2), Key_length / 8);
-                ptr_key = new uint8_t[Key_length_bytes];
-                memcpy(ptr_key, drbg_output, Key_length_bytes);
-                aux_subset.low_node = get_leftchild_index(path[j]);
+            parents.push_back(node);
+        }
+        BES_METRIC_ADD(Metric_sdm_nodes_classified, parents.size());
+        swap(level, parents);
+    }
+}
+
+void BES_SDM_scheme::build_revoked_leaves_cover(map<unsigned long long, Cover_node> &fresh) const
+{
+    // the denied users of each subtree below the split level are merged up to its root by a thread, then the roots up to the tree root
+    size_t split_level = cover_threads == 1 ? 0 : parallel_split_level(cover_threads);
+    size_t subtree_users = static_cast<size_t>(1) << (depth - split_level);
+    vector<size_t> piece_starts; // position in revoked_users of the first denied user of each subtree with any
+    for (size_t i = 0; i < revoked_users.size();)
+    {
+        piece_starts.push_back(i);
+        size_t next_subtree_user = (revoked_users[i] / subtree_users + 1) * subtree_users;
+        i = lower_bound(revoked_users.begin() + i, revoked_users.end(), next_subtree_user) - revoked_users.begin();
+    }
+    piece_starts.push_back(revoked_users.size());
+
+    size_t pieces = piece_starts.size() - 1;
+    vector<vector<Steiner_node>> piece_roots(pieces);
+    vector<vector<pair<unsigned long long, Cover_node>>> partial_covers(pieces);
+    parallel_for(pieces, cover_threads, [&](size_t piece) {
+        piece_roots[piece].reserve(piece_starts[piece + 1] - piece_starts[piece]);
+        for (size_t i = piece_starts[piece]; i < piece_starts[piece + 1]; i++)
+        {
+            unsigned int leaf_index = number_of_nodes / 2 + revoked_users[i];
+            piece_roots[piece].push_back({leaf_index, D_node, leaf_index});
+        }
+        merge_steiner_levels(piece_roots[piece], depth, split_level, partial_covers[piece]);
+    });
+
+    vector<Steiner_node> level;
+    vector<pair<unsigned long long, Cover_node>> top_cover;
+    for (size_t piece = 0; piece < pieces; piece++)
+    {
+        level.insert(level.end(), piece_roots[piece].begin(), piece_roots[piece].end());
+        fresh.insert(partial_covers[piece].begin(), partial_covers[piece].end());
+    }
+    merge_steiner_levels(level, split_level, 0, top_cover);
+    fresh.insert(top_cover.begin(), top_cover.end());
+}
+
+void BES_SDM_scheme::set_cover_node(unsigned long long order, const Cover_node &emitted)
+{
+    auto current = cover_nodes.find(order);
+    bool changed;
+    if (current == cover_nodes.end())
+        changed = emitted.subset_count > 0;
+    else
+        changed = emitted.subset_count != current->second.subset_count ||
+                  !equal(emitted.subsets, emitted.subsets + emitted.subset_count, current->second.subsets,
+                         [](const Key_subset &a, const Key_subset &b) { return a.high_node == b.high_node && a.low_node == b.low_node; });
+    if (!changed)
+        return; // the subsets of the node (and their cached keys) are still valid
+
+    if (cover_reported && cover_changes.find(order) == cover_changes.end())
+    { // remember what was reported for this node, to compute the delta later
+        Cover_node reported = {};
+        if (current != cover_nodes.end())
+            reported = current->second;
+        cover_changes[order] = reported;
+    }
+    if (emitted.subset_count == 0)
+    {
+        cover_nodes.erase(current);
+    }
+    else
+    {
+        cover_nodes[order] = emitted;
+        cover_nodes[order].keys_ready = false;
+        pending_cover_keys.push_back(order);
+    }
+}
+
+void BES_SDM_scheme::merge_cover(const map<unsigned long long, Cover_node> &fresh)
+{
+    Cover_node no_subsets = {};
+    vector<unsigned long long> stale; // nodes of the old cover that no longer emit subsets
+
+    for (const auto &node : cover_nodes)
+    {
+        if (fresh.find(node.first) == fresh.end())
+            stale.push_back(node.first);
+    }
+    for (unsigned long long order : stale)
+    {
+        set_cover_node(order, no_subsets);
+    }
+    for (const auto &node : fresh)
+    {
+        set_cover_node(node.first, node.second);
+    }
+}
+
+void BES_SDM_scheme::update_cover()
+{
+    if (cover_method == Revoked_leaves_cover)
+    { // recomputed from the denied users on every call, only the changed subsets get new keys
+        map<unsigned long long, Cover_node> fresh;
+        build_revoked_leaves_cover(fresh);
+        merge_cover(fresh);
+    }
+    else if (node_tree.empty() && !revoked_users.empty())
+    { // the classification is built once, then kept up to date by denegate_user
+        build_cover();
+    }
+}
+
+void BES_SDM_scheme::update_cover_paths(const vector<unsigned int> &leaf_indexes)
+{
+    vector<unsigned int> level(leaf_indexes), parents; // changed nodes of the current level, in ascending order
+    Cover_node emitted;
+
+    while (!level.empty() && level[0] != 0)
+    {
+        parents.clear();
+        for (unsigned int node_index : level)
+        { // siblings share their father, reclassify it once
+            unsigned int father_index = get_father_index(node_index);
+            if (parents.empty() || parents.back() != father_index)
+                parents.push_back(father_index);
+        }
+        level.clear();
+        for (unsigned int node_index : parents)
+        {
+            char previous_type = get_node_type(node_index);
+            classify_node(node_index, emitted);
+            BES_METRIC_ADD(Metric_sdm_nodes_classified, 1);
+            set_cover_node(cover_order(node_index), emitted);
+            if (get_node_type(node_index) != previous_type || get_node_type(node_index) == S_node)
+                level.push_back(node_index); // the ancestors may change, an O or D node that stays the same hides its subtree
+        }
+    }
+}
+
+void BES_SDM_scheme::collect_cover_changes(const map<unsigned long long, Cover_node> &changes, bool all_users_before,
+                                           vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id)
+{
+    auto same_subset = [](const Key_subset &a, const Key_subset &b) { return a.high_node == b.high_node && a.low_node == b.low_node; };
+    bool all_users_allowed = revoked_users.empty();
+
+    if (all_users_before && !all_users_allowed)
+    {
+        Key_subset all_users_key = {0, 0};
+        removed_keys_id.push_back(all_users_key);
+    }
+    for (const auto &change : changes)
+    {
+        const Cover_node &reported = change.second;
+        auto current = cover_nodes.find(change.first);
+        unsigned int current_count = current == cover_nodes.end() ? 0 : current->second.subset_count;
+
+        for (unsigned int i = 0; i < reported.subset_count; i++)
+        { // subsets of the node that are no longer emitted
+            if (current_count == 0 || none_of(current->second.subsets, current->second.subsets + current_count,
+                                              [&](const Key_subset &s) { return same_subset(s, reported.subsets[i]); }))
+                removed_keys_id.push_back(reported.subsets[i]);
+        }
+        for (unsigned int i = 0; i < current_count; i++)
+        { // subsets of the node that were not reported
+            if (none_of(reported.subsets, reported.subsets + reported.subset_count,
+                        [&](const Key_subset &s) { return same_subset(s, current->second.subsets[i]); }))
+            {
+                added_keys_id.push_back(current->second.subsets[i]);
+                added_keys.push_back(new uint8_t[Key_length / 8]);
+                BES_METRIC_ADD(Metric_key_bytes_allocated, Key_length / 8);
+                memcpy(added_keys.back(), current->second.keys[i], Key_length / 8);
             }
-            aux_subset.high_node = current_subtree_root;
-            user_labels_id.push_back(aux_subset); // add both high and low index, corresponding to a subset in the SDM scheme
-            user_labels.push_back(ptr_key);       // add the corresponding user key to the key vector
         }
-        current_subtree_root = get_father_index(current_subtree_root); // iterate to the next subtree, which is the one rooted as the father of current one
-        path.clear();                                                  // reset the path to calculate the new path
     }
-    return 1;
+    if (!all_users_before && all_users_allowed)
+    {
+        append_all_users_key(added_keys_id, added_keys);
+    }
 }
 
-void BES_SDM_scheme::get_allowed_keys(std::vector<Key_subset> &user_keys_id, std::vector<uint8_t *> &user_keys)
+void BES_SDM_scheme::change_users(vector<unsigned int> &userIDs, bool allowed, vector<Key_subset> &added_keys_id,
+                                  vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id)
 {
-    unsigned int number_of_nodes = FCB_tree.size();  // number of node in the complete binary tree
-    std::vector<char> node_tree(number_of_nodes);    // vector used as the Steiner Tree of FCB_tree for the cover finding algorithm
-    Key_subset aux_subset;                           // auxiliar key subset for output user_keys_id vector
-    uint8_t *aux_key;                                // ptr to allocate memory for keys
-    unsigned int key_length_bytes = Key_length / 8;  // length of the current tree keys in bytes
+    map<unsigned long long, Cover_node> reported_changes;
 
-    //Check if no user is denied, if no user is denied, return all_users_allowed_key, else continue with normal execution of the functionn
-    bool all_users_allowed = all_of(this->allowed_users.begin(),this->allowed_users.end(), [](bool v) {return v;});
-    if(all_users_allowed){
-        Key_subset all_users_key= {0,0};
-        user_keys_id.push_back(all_users_key);
-        user_keys.push_back(all_users_allowed_key);
+    update_cover(); // the cover before the batch is the base of the returned delta
+    bool all_users_before = revoked_users.empty();
+    if (allowed) // both throw before changing anything if any user ID is invalid
+        mark_users_allowed(userIDs);
+    else
+        mark_users_denied(userIDs);
+
+    // record the changes of the batch in a log of their own, the one of get_cover_delta is put aside
+    bool reported = cover_reported;
+    cover_changes.swap(reported_changes);
+    cover_reported = true;
+    if (!node_tree.empty())
+    { // only the paths of the changed users change, shared ancestors are reclassified once
+        vector<unsigned int> leaf_indexes;
+        leaf_indexes.reserve(userIDs.size());
+        for (unsigned int userID : userIDs)
+        {
+            leaf_indexes.push_back(userID + number_of_nodes / 2);
+            set_node_type(leaf_indexes.back(), allowed ? O_node : D_node);
+        }
+        update_cover_paths(leaf_indexes);
+    }
+    else
+    {
+        update_cover();
+    }
+    derive_pending_cover_keys();
+    collect_cover_changes(cover_changes, all_users_before, added_keys_id, added_keys, removed_keys_id);
+
+    // merge both logs, what was reported before the batch is kept for get_cover_delta
+    if (reported)
+        reported_changes.insert(cover_changes.begin(), cover_changes.end());
+    cover_changes.swap(reported_changes);
+    cover_reported = reported;
+}
+
+void BES_SDM_scheme::derive_pending_cover_keys()
+{
+    vector<Key_subset> subsets;
+    vector<uint8_t *> keys;
+
+    for (unsigned long long order : pending_cover_keys)
+    {
+        auto node = cover_nodes.find(order);
+        if (node == cover_nodes.end() || node->second.keys_ready)
+            continue; // the node stopped emitting subsets, or it was queued twice
+        for (unsigned int i = 0; i < node->second.subset_count; i++)
+        {
+            subsets.push_back(node->second.subsets[i]);
+            keys.push_back(node->second.keys[i]);
+        }
+        node->second.keys_ready = true;
+    }
+    pending_cover_keys.clear();
+    if (cover_threads == 1)
+    {
+        derive_subset_keys(subsets.data(), subsets.size(), keys.data());
         return;
     }
+    // chunks of subsets derived by the threads, with enough chains to fill the lanes many times
+    size_t chunk_size = max<size_t>(8 * AES_TRIPLE_PRG_LANES, (subsets.size() + cover_threads * parallel_tasks_per_thread - 1) / (cover_threads * parallel_tasks_per_thread));
+    size_t chunks = (subsets.size() + chunk_size - 1) / chunk_size;
+    parallel_for(chunks, cover_threads, [&](size_t chunk) {
+        size_t first = chunk * chunk_size;
+        derive_subset_keys(subsets.data() + first, min(chunk_size, subsets.size() - first), keys.data() + first, false);
+    });
+}
 
-    //else, normal functioning:
-    for (int i = number_of_nodes / 2, j = 0; i < number_of_nodes; i++, j++)
-    { // setup the initial vector representing the binary tree, and initialize leaf nodes
-        if (allowed_users[j]) // if user is allowed to acces the system, setup his node as operative node
-            node_tree[i] = O_node;
-        else                  // else setup node as denegated node
-            node_tree[i] = D_node;
+void BES_SDM_scheme::report_cover()
+{
+    update_cover();
+    cover_reported = true; // the returned cover is the new base of get_cover_delta
+    cover_changes.clear();
+    all_users_reported = revoked_users.empty();
+
+    // derive the keys of the subsets that changed, the label chains of several subsets advance in lock-step
+    if (!revoked_users.empty())
+        derive_pending_cover_keys();
+}
+
+void BES_SDM_scheme::append_cover_node(const Cover_node &node, vector<Key_subset> &keys_id, vector<uint8_t *> &keys) const
+{
+    for (unsigned int i = 0; i < node.subset_count; i++)
+    {
+        keys_id.push_back(node.subsets[i]);
+        keys.push_back(new uint8_t[Key_length / 8]);
+        memcpy(keys.back(), node.keys[i], Key_length / 8);
     }
-    for (int iteration = number_of_nodes / 4; iteration >= 0; iteration /= 2) // for each tree level, excluding the one with the leafs
+    BES_METRIC_ADD(Metric_key_bytes_allocated, node.subset_count * (Key_length / 8));
+}
+
+void BES_SDM_scheme::append_all_users_key(vector<Key_subset> &keys_id, vector<uint8_t *> &keys) const
+{
+    Key_subset all_users_key = {0, 0};
+    keys_id.push_back(all_users_key);
+    keys.push_back(new uint8_t[Key_length / 8]);
+    memcpy(keys.back(), all_users_allowed_key, Key_length / 8);
+    BES_METRIC_ADD(Metric_key_bytes_allocated, Key_length / 8);
+}
+
+void BES_SDM_scheme::invalidate_cover()
+{
+    set_label_cache_capacity(label_cache_sets * label_cache_ways); // the node keys and their length may have changed too
+    node_tree.clear();
+    node_tree.shrink_to_fit();
+    cover_nodes.clear();
+    cover_changes.clear();
+    pending_cover_keys.clear();
+    cover_reported = false;
+    rebuild_revoked_users();
+}
+
+void BES_SDM_scheme::derive_subset_keys(const Key_subset *subsets, size_t count, uint8_t *const *keys, bool cached)
+{
+    uint8_t iterator_keys[AES_TRIPLE_PRG_LANES][AES_STREAM_SEEDBYTES]; // one label chain per lane, zero padded for short keys
+    const uint8_t *seeds[AES_TRIPLE_PRG_LANES];
+    uint8_t *left[AES_TRIPLE_PRG_LANES];
+    uint8_t *middle[AES_TRIPLE_PRG_LANES];
+    uint8_t *right[AES_TRIPLE_PRG_LANES];
+    size_t lane_subset[AES_TRIPLE_PRG_LANES];     // subset whose chain is in each lane
+    unsigned int lane_steps[AES_TRIPLE_PRG_LANES]; // levels left until the low node of each lane
+    size_t active = 0;
+    size_t next_subset = 0;
+    size_t prg_outputs = 0;
+
+    while (true)
     {
+        // refill the free lanes, starting each chain at the label of the high node
+        while (active < AES_TRIPLE_PRG_LANES && next_subset < count)
+        {
+            memset(iterator_keys[active], 0, AES_STREAM_SEEDBYTES);
+            if (cached)
+                copy_node_key(subsets[next_subset].high_node, iterator_keys[active]);
+            else
+                read_node_key(subsets[next_subset].high_node, iterator_keys[active]);
+            lane_subset[active] = next_subset;
+            lane_steps[active] = get_node_level(subsets[next_subset].low_node) - get_node_level(subsets[next_subset].high_node);
+            active++;
+            next_subset++;
+        }
+        if (active == 0)
+        {
+            break;
+        }
+        for (size_t lane = 0; lane < active; lane++)
+        {
+            seeds[lane] = iterator_keys[lane];
+            left[lane] = middle[lane] = right[lane] = nullptr;
+            if (lane_steps[lane] == 0)
+            { // the chain reached the low node, its middle output is the subset key
+                middle[lane] = keys[lane_subset[lane]];
+            }
+            else if (get_ancestor_index(subsets[lane_subset[lane]].low_node, lane_steps[lane] - 1) % 2 == 1)
+            { // the low node is under the left child
+                left[lane] = iterator_keys[lane];
+            }
+            else
+            { // the low node is under the right child
+                right[lane] = iterator_keys[lane];
+            }
+        }
+        aes_triple_prg_batch(active, seeds, Key_length / 8, left, middle, right);
+        prg_outputs += active; // a single output per chain
+        // retire the finished chains, moving the last active lane into their place
+        for (size_t lane = 0; lane < active;)
+        {
+            if (lane_steps[lane] == 0)
+            {
+                active--;
+                memcpy(iterator_keys[lane], iterator_keys[active], AES_STREAM_SEEDBYTES);
+                lane_subset[lane] = lane_subset[active];
+                lane_steps[lane] = lane_steps[active];
+            }
+            else
+            {
+                lane_steps[lane]--;
+                lane++;
+            }
+        }
+    }
+    BES_METRIC_ADD(Metric_sdm_subset_keys_derived, count);
+    BES_METRIC_ADD(Metric_aes_blocks, prg_outputs * aes_output_blocks(Key_length / 8));
+}
+
+void BES_SDM_scheme::load_ancestor_keys(unsigned int userID, uint8_t (*ancestor_keys)[AES_STREAM_SEEDBYTES])
+{
+    unsigned int user_node_index = (1u << depth) + userID - 1;
+
+    for (unsigned int chain = 0; chain < depth; chain++)
+    { // chain c starts at the ancestor c + 1 levels above the leaf, its key is zero padded up to a seed
+        memset(ancestor_keys[chain], 0, AES_STREAM_SEEDBYTES);
+        copy_node_key(get_ancestor_index(user_node_index, chain + 1), ancestor_keys[chain]);
+    }
+}
+
+template <size_t Key_bytes>
+void BES_SDM_scheme::derive_user_labels_fixed(unsigned int userID, const uint8_t (*ancestor_keys)[AES_STREAM_SEEDBYTES],
+                                              Key_subset *user_labels_id, uint8_t *const *user_labels) const
+{
+    unsigned int path[max_tree_depth + 1];                                 // node of the path from the root to the leaf of the user at each level
+    uint8_t iterator_keys[AES_TRIPLE_PRG_LANES][AES_STREAM_SEEDBYTES];     // one label chain per lane, zero padded for short keys
+    const uint8_t *seeds[AES_TRIPLE_PRG_LANES];
+    uint8_t *left[AES_TRIPLE_PRG_LANES];
+    uint8_t *right[AES_TRIPLE_PRG_LANES];
+    unsigned int lane_chain[AES_TRIPLE_PRG_LANES]; // chain walking down in each lane
+    unsigned int lane_step[AES_TRIPLE_PRG_LANES];  // next step of the chain of each lane
+    unsigned int next_chain = depth;               // chains still to start, the longest ones first
+    unsigned int active = 0;
+
+    path[depth] = (1u << depth) + userID - 1; // calculate the leaf position in the tree corresponding to the user
+    for (unsigned int level = depth; level-- > 0;)
+    {
+        path[level] = get_father_index(path[level + 1]);
+    }
 
-        for (int index = iteration; index <= iteration * 2; index++)
+    // the leaf is part of one subtree per ancestor, chain c walks down from the ancestor c + 1 levels above the leaf.
+    // The labels of chain c follow the ones of the c smaller subtrees, so they start at position c * (c + 1) / 2.
+    // Every call advances one step of up to AES_TRIPLE_PRG_LANES chains, a lane is given the next chain as soon as its own ends
+    while (true)
+    {
+        while (active < AES_TRIPLE_PRG_LANES && next_chain > 0)
+        {
+            next_chain--;
+            memcpy(iterator_keys[active], ancestor_keys[next_chain], AES_STREAM_SEEDBYTES);
+            lane_chain[active] = next_chain;
+            lane_step[active] = 0;
+            active++;
+        }
+        if (active == 0)
         {
-            if (node_tree[get_leftchild_index(index)] == O_node && node_tree[get_rightchild_index(index)] == O_node) // if both children are allowed nodes
-                node_tree[index] = O_node;
-            else if (node_tree[get_leftchild_index(index)] == D_node && node_tree[get_rightchild_index(index)] == D_node) // if both children are denied nodes
-                node_tree[index] = D_node;
-            else if ((node_tree[get_leftchild_index(index)] == D_node && node_tree[get_rightchild_index(index)] == O_node) || (node_tree[get_leftchild_index(index)] == O_node && node_tree[get_rightchild_index(index)] == D_node)) // if either of both child nodes is denied, and the other is operative
-                node_tree[index] = S_node;
+            break;
+        }
+        for (unsigned int lane = 0; lane < active; lane++)
+        {
+            unsigned int chain = lane_chain[lane];
+            unsigned int step = lane_step[lane];
+            unsigned int high_level = depth - chain - 1;
+            unsigned int current_node = path[high_level + step]; // node on the path from the subtree root to the leaf
+            size_t label_index = chain * (chain + 1) / 2 + step;
+            uint8_t *label = user_labels[label_index];
+            uint8_t *next_label = step < chain ? iterator_keys[lane] : nullptr; // the label of the leaf itself is not needed
+            user_labels_id[label_index].high_node = path[high_level];
+            seeds[lane] = iterator_keys[lane];
+            if (path[high_level + step + 1] == get_leftchild_index(current_node))
+            { // keep iterating on the left child, the label goes to the subset with j = right child
+                left[lane] = next_label;
+                right[lane] = label;
+                user_labels_id[label_index].low_node = get_rightchild_index(current_node);
+            }
             else
+            { // keep iterating on the right child, the label goes to the subset with j = left child
+                left[lane] = label;
+                right[lane] = next_label;
+                user_labels_id[label_index].low_node = get_leftchild_index(current_node);
+            }
+        }
+        aes_triple_prg_batch(active, seeds, Key_bytes, left, nullptr, right);
+        // retire the chains that reached the leaf, moving the last active lane into their place
+        for (unsigned int lane = 0; lane < active;)
+        {
+            if (lane_step[lane]++ == lane_chain[lane])
             {
-                if ((node_tree[get_leftchild_index(index)] == S_node && node_tree[get_rightchild_index(index)] == O_node) || (node_tree[get_leftchild_index(index)] == O_node && node_tree[get_rightchild_index(index)] == S_node))
-                {
-                    node_tree[index] = S_node;
-                }
-                else if (node_tree[get_leftchild_index(index)] == S_node && node_tree[get_rightchild_index(index)] == D_node)
-                {
-                    aux_key = new uint8_t[key_length_bytes];
-                    aux_subset = find_subset_and_key(get_leftchild_index(index), node_tree, aux_key);
-                    user_keys_id.push_back(aux_subset);
-                    user_keys.push_back(aux_key);
-                    node_tree[index] = D_node;
-                }
-                else if (node_tree[get_leftchild_index(index)] == D_node && node_tree[get_rightchild_index(index)] == S_node)
-                {
-                    aux_key = new uint8_t[key_length_bytes];
-                    aux_subset = find_subset_and_key(get_rightchild_index(index), node_tree, aux_key);
-                    user_keys_id.push_back(aux_subset);
-                    user_keys.push_back(aux_key);
-                    node_tree[index] = D_node;
-                }
-                else if (node_tree[get_leftchild_index(index)] == S_node && node_tree[get_rightchild_index(index)] == S_node)
-                {
-                    // find subset for left path
-                    aux_key = new uint8_t[key_length_bytes];
-                    aux_subset = find_subset_and_key(get_leftchild_index(index), node_tree, aux_key);
-                    user_keys_id.push_back(aux_subset);
-                    user_keys.push_back(aux_key);
-                    // find subset for right path
-                    aux_key = new uint8_t[key_length_bytes];
-                    aux_subset = find_subset_and_key(get_rightchild_index(index), node_tree, aux_key);
-                    user_keys_id.push_back(aux_subset);
-                    user_keys.push_back(aux_key);
-                    // update subtree root node
-                    node_tree[index] = D_node;
-                }
+                active--;
+                memcpy(iterator_keys[lane], iterator_keys[active], AES_STREAM_SEEDBYTES);
+                lane_chain[lane] = lane_chain[active];
+                lane_step[lane] = lane_step[active];
+            }
+            else
+            {
+                lane++;
+            }
+        }
+    }
+    BES_METRIC_ADD(Metric_aes_blocks, depth * depth * aes_output_blocks(Key_bytes)); // 2 outputs per step but the last of each chain
+}
+
+template void BES_SDM_scheme::derive_user_labels_fixed<16>(unsigned int, const uint8_t (*)[AES_STREAM_SEEDBYTES], Key_subset *, uint8_t *const *) const;
+template void BES_SDM_scheme::derive_user_labels_fixed<24>(unsigned int, const uint8_t (*)[AES_STREAM_SEEDBYTES], Key_subset *, uint8_t *const *) const;
+template void BES_SDM_scheme::derive_user_labels_fixed<32>(unsigned int, const uint8_t (*)[AES_STREAM_SEEDBYTES], Key_subset *, uint8_t *const *) const;
+
+void BES_SDM_scheme::derive_user_labels(unsigned int userID, const uint8_t (*ancestor_keys)[AES_STREAM_SEEDBYTES],
+                                        Key_subset *user_labels_id, uint8_t *const *user_labels) const
+{
+    switch (Key_length / 8)
+    {
+    case 16:
+        derive_user_labels_fixed<16>(userID, ancestor_keys, user_labels_id, user_labels);
+        break;
+    case 24:
+        derive_user_labels_fixed<24>(userID, ancestor_keys, user_labels_id, user_labels);
+        break;
+    default:
+        derive_user_labels_fixed<32>(userID, ancestor_keys, user_labels_id, user_labels);
+        break;
+    }
+}
+
+uint8_t *BES_SDM_scheme::find_label_pair(unsigned int high_node, unsigned int node)
+{
+    uint64_t tag = (static_cast<uint64_t>(high_node) << 32) | node;
+    size_t set = ((tag * 0x9E3779B97F4A7C15ull) >> 32) & (label_cache_sets - 1);
+    uint64_t *tags = label_cache_tags.data() + set * label_cache_ways;
+    size_t pair_bytes = 2 * (Key_length / 8);
+    uint8_t *pairs = label_cache_labels.data() + set * label_cache_ways * pair_bytes;
+
+    for (size_t way = 0; way < label_cache_ways; way++)
+    {
+        if (tags[way] == tag)
+        { // move the way to the front of its set, the ways before it shift back one position
+            uint8_t pair[64];
+            memcpy(pair, pairs + way * pair_bytes, pair_bytes);
+            memmove(tags + 1, tags, way * sizeof(uint64_t));
+            memmove(pairs + pair_bytes, pairs, way * pair_bytes);
+            tags[0] = tag;
+            memcpy(pairs, pair, pair_bytes);
+            return pairs;
+        }
+    }
+    return nullptr;
+}
+
+uint8_t *BES_SDM_scheme::insert_label_pair(unsigned int high_node, unsigned int node)
+{
+    uint64_t tag = (static_cast<uint64_t>(high_node) << 32) | node;
+    size_t set = ((tag * 0x9E3779B97F4A7C15ull) >> 32) & (label_cache_sets - 1);
+    uint64_t *tags = label_cache_tags.data() + set * label_cache_ways;
+    size_t pair_bytes = 2 * (Key_length / 8);
+    uint8_t *pairs = label_cache_labels.data() + set * label_cache_ways * pair_bytes;
+
+    if (tags[label_cache_ways - 1] == UINT64_MAX)
+    {
+        label_cache_entries++; // the last way is free, the set was not full
+    }
+    // the least recently used way is dropped, the new entry goes to the front
+    memmove(tags + 1, tags, (label_cache_ways - 1) * sizeof(uint64_t));
+    memmove(pairs + pair_bytes, pairs, (label_cache_ways - 1) * pair_bytes);
+    tags[0] = tag;
+    return pairs;
+}
+
+void BES_SDM_scheme::derive_user_labels_cached(unsigned int userID, uint8_t (*ancestor_keys)[AES_STREAM_SEEDBYTES],
+                                               Key_subset *user_labels_id, uint8_t *const *user_labels)
+{
+    unsigned int user_node_index = (1u << depth) + userID - 1;
+    unsigned int next_step[max_tree_depth]; // first step of each chain not found in the cache
+    size_t Key_length_bytes = Key_length / 8;
+
+    // a step of chain c at the node current_node derives the labels of both children: the one off the path is a label
+    // of the user, the one on it is the seed of the next step
+    auto take_step = [&](unsigned int chain, unsigned int step, const uint8_t *left_label, const uint8_t *right_label) {
+        unsigned int current_node = get_ancestor_index(user_node_index, chain + 1 - step);
+        unsigned int next_node = get_ancestor_index(user_node_index, chain - step);
+        size_t label_index = chain * (chain + 1) / 2 + step;
+        bool go_left = next_node == get_leftchild_index(current_node);
+        user_labels_id[label_index].high_node = get_ancestor_index(user_node_index, chain + 1);
+        user_labels_id[label_index].low_node = go_left ? get_rightchild_index(current_node) : get_leftchild_index(current_node);
+        memcpy(user_labels[label_index], go_left ? right_label : left_label, Key_length_bytes);
+        if (step < chain)
+        {
+            memcpy(ancestor_keys[chain], go_left ? left_label : right_label, Key_length_bytes); // the padding stays zero
+        }
+    };
+
+    // the top of every chain is shared with the users nearby, take the steps from the cache while they are there
+    for (unsigned int chain = 0; chain < depth; chain++)
+    {
+        unsigned int high_node = get_ancestor_index(user_node_index, chain + 1);
+        unsigned int step = 0;
+        for (; step <= chain; step++)
+        {
+            const uint8_t *pair = find_label_pair(high_node, get_ancestor_index(user_node_index, chain + 1 - step));
+            if (pair == nullptr)
+            {
+                break;
             }
+            label_cache_hits++;
+            take_step(chain, step, pair, pair + Key_length_bytes);
         }
-        if (iteration == 0)
-        { // base case
-            if (node_tree[0] == S_node)
+        next_step[chain] = step;
+    }
+
+    // derive the rest of the chains in lock-step, one step of up to AES_TRIPLE_PRG_LANES chains per call
+    uint8_t left_labels[AES_TRIPLE_PRG_LANES][32];
+    uint8_t right_labels[AES_TRIPLE_PRG_LANES][32];
+    const uint8_t *seeds[AES_TRIPLE_PRG_LANES];
+    uint8_t *left[AES_TRIPLE_PRG_LANES];
+    uint8_t *right[AES_TRIPLE_PRG_LANES];
+    unsigned int lane_chain[AES_TRIPLE_PRG_LANES];
+    bool pending = true;
+    while (pending)
+    {
+        pending = false;
+        for (unsigned int chain = 0; chain < depth;)
+        {
+            unsigned int active = 0;
+            for (; chain < depth && active < AES_TRIPLE_PRG_LANES; chain++)
             {
-                unsigned char root_left_node = node_tree[get_leftchild_index(iteration)];
-                unsigned char root_right_node = node_tree[get_rightchild_index(iteration)];
-                if ((root_left_node == S_node && root_right_node == O_node) || (root_left_node == O_node && root_right_node == S_node) || (root_left_node == D_node && root_right_node == O_node) || (root_left_node == O_node && root_right_node == D_node))
+                if (next_step[chain] > chain)
                 {
-                    // find last subset
-                    aux_key = new uint8_t[key_length_bytes];
-                    aux_subset = find_subset_and_key(iteration, node_tree, aux_key);
-                    user_keys_id.push_back(aux_subset);
-                    user_keys.push_back(aux_key);
+                    continue; // this chain already reached the leaf
                 }
+                seeds[active] = ancestor_keys[chain];
+                left[active] = left_labels[active];
+                right[active] = right_labels[active];
+                lane_chain[active++] = chain;
+            }
+            if (active == 0)
+            {
+                break;
+            }
+            aes_triple_prg_batch(active, seeds, Key_length_bytes, left, nullptr, right);
+            BES_METRIC_ADD(Metric_aes_blocks, 2 * active * aes_output_blocks(Key_length_bytes));
+            for (unsigned int lane = 0; lane < active; lane++)
+            {
+                unsigned int lane_step = next_step[lane_chain[lane]]++;
+                uint8_t *pair = insert_label_pair(get_ancestor_index(user_node_index, lane_chain[lane] + 1),
+                                                  get_ancestor_index(user_node_index, lane_chain[lane] + 1 - lane_step));
+                memcpy(pair, left_labels[lane], Key_length_bytes);
+                memcpy(pair + Key_length_bytes, right_labels[lane], Key_length_bytes);
+                label_cache_misses++;
+                take_step(lane_chain[lane], lane_step, left_labels[lane], right_labels[lane]);
+                pending = pending || next_step[lane_chain[lane]] <= lane_chain[lane];
             }
-            break;
         }
     }
 }
 
-ostream& operator << (ostream& os, const BES_SDM_scheme& obj) {
-    unsigned char scheme_name[scheme_name_size] = "SDM_BES_scheme";
-
-    os.write(reinterpret_cast<const char*>(scheme_name), scheme_name_size); // write the scheme name
+void BES_SDM_scheme::provision_subtree(unsigned int node_index, unsigned int level, size_t first_user, size_t last_user,
+                                       Provision_state &state, const User_keys_sink<Key_subset> &sink) const
+{
+    size_t Key_length_bytes = Key_length / 8;
 
-    os.write(reinterpret_cast<const char*>(&obj.depth), sizeof(obj.depth)); // write the depth of the tree
+    if (level == depth)
+    {
+        BES_METRIC_ADD(Metric_sdm_user_labels_calls, 1);
+        sink(node_index - ((1u << depth) - 1), state.package_id.data(), state.package.data(), state.package_id.size());
+        return;
+    }
+    // one step of every chain reaching the node: the left output continues the chains to the left child, the right one to the right child
+    const uint8_t *seeds[AES_TRIPLE_PRG_LANES];
+    uint8_t *left[AES_TRIPLE_PRG_LANES];
+    uint8_t *right[AES_TRIPLE_PRG_LANES];
+    uint8_t *right_labels = state.right_labels.data() + level * depth * AES_STREAM_SEEDBYTES;
+    for (unsigned int first_chain = 0; first_chain <= level; first_chain += AES_TRIPLE_PRG_LANES)
+    {
+        unsigned int lanes = min<unsigned int>(AES_TRIPLE_PRG_LANES, level + 1 - first_chain);
+        for (unsigned int lane = 0; lane < lanes; lane++)
+        {
+            seeds[lane] = state.chain_label(level, first_chain + lane, depth);
+            left[lane] = state.chain_label(level + 1, first_chain + lane, depth);
+            right[lane] = right_labels + (first_chain + lane) * AES_STREAM_SEEDBYTES;
+        }
+        aes_triple_prg_batch(lanes, seeds, Key_length_bytes, left, nullptr, right);
+        BES_METRIC_ADD(Metric_aes_blocks, 2 * lanes * aes_output_blocks(Key_length_bytes));
+    }
 
-    os.write(reinterpret_cast<const char*>(&obj.Key_length), sizeof(obj.Key_length)); // write the Key_length of the tree
+    size_t subtree_users = static_cast<size_t>(1) << (depth - level - 1);
+    size_t left_first_user = (static_cast<size_t>(get_leftchild_index(node_index)) - ((1u << (level + 1)) - 1)) * subtree_users;
+    unsigned int children[2] = {get_leftchild_index(node_index), get_rightchild_index(node_index)};
+    for (unsigned int side = 0; side < 2; side++)
+    {
+        size_t child_first_user = left_first_user + side * subtree_users;
+        if (child_first_user >= last_user || child_first_user + subtree_users <= first_user)
+        {
+            continue; // no user of the range below this child
+        }
+        for (unsigned int chain = 0; chain <= level; chain++)
+        { // the chain starting at level j is chain depth - j - 1 of the leaves, at step level - j
+            size_t chain_number = depth - chain - 1;
+            size_t label_index = chain_number * (chain_number + 1) / 2 + level - chain;
+            uint8_t *label_out = side == 0 ? right_labels + chain * AES_STREAM_SEEDBYTES : state.chain_label(level + 1, chain, depth);
+            state.package_id[label_index].high_node = get_ancestor_index(node_index, level - chain);
+            state.package_id[label_index].low_node = children[1 - side]; // the label goes to the subset with j = the other child
+            memcpy(state.package.data() + label_index * Key_length_bytes, label_out, Key_length_bytes);
+            if (side == 1)
+            {
+                memcpy(state.chain_label(level + 1, chain, depth), right_labels + chain * AES_STREAM_SEEDBYTES, AES_STREAM_SEEDBYTES);
+            }
+        }
+        read_node_key(children[side], state.chain_label(level + 1, level + 1, depth)); // the chain starting at the child
+        provision_subtree(children[side], level + 1, first_user, last_user, state, sink);
+    }
+}
 
-    size_t allowed_users_size = obj.allowed_users.size();
-    os.write(reinterpret_cast<const char*>(&allowed_users_size), sizeof(size_t)); // write the allowed users vector size
+////////////////////////////////////// PUBLIC METHODS ////////////////////////////////////////////////
 
-    // logic to translate the bool vector array to normal bytes
-    uint8_t byte = 0;
-    size_t bit_index = 0;
+// Constructor for the BES_SDM_scheme class
+BES_SDM_scheme::BES_SDM_scheme(size_t Tree_Depth, size_t node_key_length, unsigned int key_generation_threads, Key_storage storage): Keytree(Tree_Depth, node_key_length, key_generation_threads, storage),
+    cover_method(Tree_cover), cover_reported(false), all_users_reported(false), cover_threads(1),
+    label_cache_sets(0), label_cache_entries(0), label_cache_hits(0), label_cache_misses(0) {
+    Fill_With_Random(all_users_allowed_key,sizeof all_users_allowed_key); // whole buffer, a tree read later may have longer keys
+}
 
-    for (size_t i = 0; i < allowed_users_size; ++i) {
-        if (obj.allowed_users[i]) { // if user is allowed put the bit to 1
-            byte |= (1 << (7 - bit_index));
+// Method to deny access to a user by their user ID
+int BES_SDM_scheme::denegate_user(unsigned int userID)
+{
+    if (userID >= allowed_users.size())
+    {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
+    }
+    else if (mark_user_denied(userID)) // Deny access to the user
+    {
+        // Calculate the node key index for the user ID
+        unsigned int key_index = userID + allowed_users.size() - 1;
+        if (!node_tree.empty())
+        { // keep the persistent cover up to date, only the path of the user changes
+            set_node_type(key_index, D_node);
+            update_cover_paths(vector<unsigned int>(1, key_index));
         }
-        ++bit_index;
-        if (bit_index == 8) {
-            os.write(reinterpret_cast<const char*>(&byte), sizeof(byte));
-            byte = 0;
-            bit_index = 0;
+    }
+    return 1;
+}
+
+// Method to deny access to a batch of users, returning the change of the cover
+int BES_SDM_scheme::denegate_users(const vector<unsigned int> &userIDs, vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id)
+{
+    vector<unsigned int> denied(userIDs);
+    change_users(denied, false, added_keys_id, added_keys, removed_keys_id);
+    return 1;
+}
+
+// Method to deny access to a range of users, returning the change of the cover
+int BES_SDM_scheme::denegate_range(unsigned int first_user, unsigned int last_user, vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id)
+{
+    if (first_user > last_user || last_user > allowed_users.size())
+    {
+        throw invalid_argument("Invalid User Range"); // Throws an exception if the range is invalid
+        return -1;
+    }
+    vector<unsigned int> userIDs(last_user - first_user);
+    iota(userIDs.begin(), userIDs.end(), first_user);
+    return denegate_users(userIDs, added_keys_id, added_keys, removed_keys_id);
+}
+
+// Method to allow access again to a denied user
+int BES_SDM_scheme::reinstate_user(unsigned int userID)
+{
+    if (userID >= allowed_users.size())
+    {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
+    }
+    else if (mark_user_allowed(userID))
+    {
+        unsigned int key_index = userID + allowed_users.size() - 1;
+        if (!node_tree.empty())
+        { // keep the persistent cover up to date, only the path of the user changes
+            set_node_type(key_index, O_node);
+            update_cover_paths(vector<unsigned int>(1, key_index));
         }
     }
-    // Write any remaining bits (if the size is not a multiple of 8)
-    if (bit_index != 0) {
-        os.write(reinterpret_cast<const char*>(&byte), sizeof(byte));
+    return 1;
+}
+
+// Method to allow access again to a batch of users, returning the change of the cover
+int BES_SDM_scheme::reinstate_users(const vector<unsigned int> &userIDs, vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id)
+{
+    vector<unsigned int> reinstated(userIDs);
+    change_users(reinstated, true, added_keys_id, added_keys, removed_keys_id);
+    return 1;
+}
+
+// Method to get the keys for a specific user
+int BES_SDM_scheme::get_user_labels(unsigned int userID, vector<Key_subset> &user_labels_id, vector<uint8_t *> &user_labels)
+{
+    if (userID >= allowed_users.size())
+    {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
     }
+    size_t first_label = user_labels_id.size(); // position of the first label of the user in the output vectors
+    size_t label_count = depth * (depth + 1) / 2;
 
-    // write all the keys
-    for (int i = 0; i < obj.FCB_tree.size(); i++) {
-        os.write(reinterpret_cast<const char*>(obj.FCB_tree[i]), obj.Key_length / 8);
+    user_labels_id.resize(first_label + label_count);
+    user_labels.resize(first_label + label_count);
+    for (size_t i = first_label; i < first_label + label_count; i++)
+    {
+        user_labels[i] = new uint8_t[Key_length / 8];
     }
-    return os;
+    BES_METRIC_ADD(Metric_key_bytes_allocated, label_count * (Key_length / 8));
+    uint8_t ancestor_keys[max_tree_depth][AES_STREAM_SEEDBYTES];
+    load_ancestor_keys(userID, ancestor_keys);
+    BES_METRIC_ADD(Metric_sdm_user_labels_calls, 1);
+    if (label_cache_sets > 0)
+        derive_user_labels_cached(userID, ancestor_keys, user_labels_id.data() + first_label, user_labels.data() + first_label);
+    else
+        derive_user_labels(userID, ancestor_keys, user_labels_id.data() + first_label, user_labels.data() + first_label);
+    return 1;
 }
 
-istream& operator >> (istream& is, BES_SDM_scheme& obj) {
-    unsigned char scheme_name[scheme_name_size];
+int BES_SDM_scheme::get_user_labels(unsigned int userID, Key_subset *user_labels_id, uint8_t *user_labels)
+{
+    if (userID >= allowed_users.size())
+    {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
+    }
+    uint8_t *labels[max_tree_depth * (max_tree_depth + 1) / 2]; // position of each label in the packed buffer
+    size_t label_count = depth * (depth + 1) / 2;
 
-    is.read(reinterpret_cast<char*>(scheme_name), scheme_name_size); // read the scheme name
+    for (size_t i = 0; i < label_count; i++)
+    {
+        labels[i] = user_labels + i * (Key_length / 8);
+    }
+    uint8_t ancestor_keys[max_tree_depth][AES_STREAM_SEEDBYTES];
+    load_ancestor_keys(userID, ancestor_keys);
+    BES_METRIC_ADD(Metric_sdm_user_labels_calls, 1);
+    if (label_cache_sets > 0)
+        derive_user_labels_cached(userID, ancestor_keys, user_labels_id, labels);
+    else
+        derive_user_labels(userID, ancestor_keys, user_labels_id, labels);
+    return 1;
+}
 
-    // verify scheme name
-    if (strncmp(reinterpret_cast<const char*>(scheme_name), "SDM_BES_scheme", scheme_name_size) != 0) {
-        cerr << "Error: Nombre del esquema incorrecto." << std::endl;
-        return is;
+int BES_SDM_scheme::read_user_keys(unsigned int userID, Key_subset *user_labels_id, uint8_t *user_labels) const
+{
+    if (userID >= allowed_users.size())
+    {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
     }
+    uint8_t *labels[max_tree_depth * (max_tree_depth + 1) / 2];
+    uint8_t ancestor_keys[max_tree_depth][AES_STREAM_SEEDBYTES];
+    unsigned int user_node_index = (1u << depth) + userID - 1;
 
-    is.read(reinterpret_cast<char*>(&obj.depth), sizeof(obj.depth)); // read the depth of the tree
+    for (size_t i = 0; i < get_user_key_count(); i++)
+    {
+        labels[i] = user_labels + i * (Key_length / 8);
+    }
+    for (unsigned int chain = 0; chain < depth; chain++)
+    { // the keys are read bypassing the cache of derived keys, nothing shared is modified
+        memset(ancestor_keys[chain], 0, AES_STREAM_SEEDBYTES);
+        read_node_key(get_ancestor_index(user_node_index, chain + 1), ancestor_keys[chain]);
+    }
+    BES_METRIC_ADD(Metric_sdm_user_labels_calls, 1);
+    derive_user_labels(userID, ancestor_keys, user_labels_id, labels);
+    return 1;
+}
 
-    is.read(reinterpret_cast<char*>(&obj.Key_length), sizeof(obj.Key_length)); // read the Key_length of the tree
+int BES_SDM_scheme::provision_range(unsigned int first_user, unsigned int last_user, const User_keys_sink<Key_subset> &sink, unsigned int threads) const
+{
+    if (first_user > last_user || last_user > allowed_users.size())
+    {
+        throw invalid_argument("Invalid User Range"); // Throws an exception if the range is invalid
+        return -1;
+    }
+    parallel_user_ranges(first_user, last_user, threads, [&](size_t task_first_user, size_t task_last_user) {
+        Provision_state state;
+        state.chain_labels.assign((depth + 1) * (depth + 1) * AES_STREAM_SEEDBYTES, 0); // zero padded for short keys
+        state.right_labels.resize(depth * depth * AES_STREAM_SEEDBYTES);
+        state.package_id.resize(get_user_key_count());
+        state.package.resize(get_user_key_count() * (Key_length / 8));
+        read_node_key(0, state.chain_label(0, 0, depth));
+        provision_subtree(0, 0, task_first_user, task_last_user, state, sink);
+    });
+    return 1;
+}
 
-    size_t allowed_users_size;
-    is.read(reinterpret_cast<char*>(&allowed_users_size), sizeof(size_t)); // read the allowed users vector size
-    obj.allowed_users.resize(allowed_users_size);
+int BES_SDM_scheme::get_user_labels(unsigned int userID, Key_batch<Key_subset> &batch)
+{
+    if (userID >= allowed_users.size())
+    {
+        throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+        return -1;
+    }
+    batch.reset(Key_length / 8);
+    batch.resize(depth * (depth + 1) / 2);
+    return get_user_labels(userID, batch.ids(), batch.keys());
+}
 
-    // read allowed users vector
-    uint8_t byte = 0;
-    size_t bit_index = 0;
+void BES_SDM_scheme::get_allowed_keys(std::vector<Key_subset> &user_keys_id, std::vector<uint8_t *> &user_keys)
+{
+    BES_METRIC_TIMER(Metric_sdm_allowed_keys_time);
+    size_t first_key = user_keys_id.size();
 
-    for (size_t i = 0; i < allowed_users_size; ++i) {
-        if (bit_index == 0) {
-            // read next byte
-            is.read(reinterpret_cast<char*>(&byte), sizeof(byte));
-        }
+    report_cover();
+    BES_METRIC_ADD(Metric_sdm_allowed_keys_calls, 1);
 
-        obj.allowed_users[i] = (byte & (1 << (7 - bit_index))) != 0; // if bit is 1 write true, else write false
-        ++bit_index;
+    //Check if no user is denied, if no user is denied, return all_users_allowed_key, else continue with normal execution of the functionn
+    if (revoked_users.empty())
+    {
+        append_all_users_key(user_keys_id, user_keys);
+        BES_METRIC_SET(Metric_sdm_cover_size, 1);
+        return;
+    }
+    size_t bound = get_cover_size_bound();
+    user_keys_id.reserve(user_keys_id.size() + bound);
+    user_keys.reserve(user_keys.size() + bound);
+    for (const auto &node : cover_nodes)
+    {
+        append_cover_node(node.second, user_keys_id, user_keys);
+    }
+    BES_METRIC_SET(Metric_sdm_cover_size, user_keys_id.size() - first_key);
+}
+
+size_t BES_SDM_scheme::get_allowed_keys(Key_subset *user_keys_id, uint8_t *user_keys, size_t capacity)
+{
+    BES_METRIC_TIMER(Metric_sdm_allowed_keys_time);
+    size_t Key_length_bytes = Key_length / 8;
+    size_t cover_size = 0;
 
-        if (bit_index == 8) {
-            bit_index = 0;
+    report_cover();
+    BES_METRIC_ADD(Metric_sdm_allowed_keys_calls, 1);
+    if (revoked_users.empty())
+    {
+        BES_METRIC_SET(Metric_sdm_cover_size, 1);
+        if (capacity > 0)
+        {
+            user_keys_id[0] = {0, 0};
+            memcpy(user_keys, all_users_allowed_key, Key_length_bytes);
         }
+        return 1;
     }
+    for (const auto &node : cover_nodes)
+    {
+        for (unsigned int i = 0; i < node.second.subset_count; i++, cover_size++)
+        {
+            if (cover_size < capacity)
+            { // the subsets that do not fit are only counted
+                user_keys_id[cover_size] = node.second.subsets[i];
+                memcpy(user_keys + cover_size * Key_length_bytes, node.second.keys[i], Key_length_bytes);
+            }
+        }
+    }
+    BES_METRIC_SET(Metric_sdm_cover_size, cover_size);
+    return cover_size;
+}
+
+void BES_SDM_scheme::get_allowed_keys(Key_batch<Key_subset> &batch)
+{
+    size_t bound = get_cover_size_bound();
 
-    // free any old keys in the tree
-    for (int i = 0; i < obj.FCB_tree.size(); i++) {
-        delete obj.FCB_tree[i];
+    batch.reset(Key_length / 8);
+    batch.resize(bound);
+    batch.resize(get_allowed_keys(batch.ids(), batch.keys(), bound));
+}
+
+size_t BES_SDM_scheme::get_cover_size_bound() const
+{
+    // r denied users split the allowed ones in at most 2r - 1 subsets, none denied needs the all users allowed key
+    return revoked_users.empty() ? 1 : 2 * revoked_users.size() - 1;
+}
+
+void BES_SDM_scheme::set_cover_method(Cover_method method)
+{
+    if (method == Revoked_leaves_cover)
+    { // the cover is computed from revoked_users from now on, the classification of the tree is not needed
+        node_tree.clear();
+        node_tree.shrink_to_fit();
     }
-    // read all keys of the SDM_tree
-    obj.FCB_tree.resize(pow(2, obj.depth + 1) - 1);
-    for (int i = 0; i < obj.FCB_tree.size(); i++) {
-        obj.FCB_tree[i] = new uint8_t[obj.Key_length / 8];
-        is.read(reinterpret_cast<char*>(obj.FCB_tree[i]), obj.Key_length / 8);
+    cover_method = method;
+}
+
+void BES_SDM_scheme::set_cover_threads(unsigned int threads)
+{
+    cover_threads = threads == 0 ? max(1u, thread::hardware_concurrency()) : threads;
+}
+
+void BES_SDM_scheme::set_label_cache_capacity(size_t entries)
+{
+    label_cache_sets = 0;
+    if (entries > 0)
+    {
+        label_cache_sets = 1;
+        while (label_cache_sets * label_cache_ways < entries)
+            label_cache_sets *= 2;
+    }
+    label_cache_tags.assign(label_cache_sets * label_cache_ways, UINT64_MAX);
+    label_cache_labels.assign(label_cache_sets * label_cache_ways * 2 * (Key_length / 8), 0);
+    label_cache_tags.shrink_to_fit();
+    label_cache_labels.shrink_to_fit();
+    label_cache_entries = 0;
+    reset_label_cache_stats();
+}
+
+Label_cache_stats BES_SDM_scheme::get_label_cache_stats() const
+{
+    return {label_cache_hits, label_cache_misses, label_cache_sets * label_cache_ways, label_cache_entries};
+}
+
+void BES_SDM_scheme::reset_label_cache_stats()
+{
+    label_cache_hits = 0;
+    label_cache_misses = 0;
+}
+
+void BES_SDM_scheme::get_cover_delta(vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id)
+{
+    if (!cover_reported)
+    { // nothing reported yet, the whole cover is new
+        get_allowed_keys(added_keys_id, added_keys);
+        return;
     }
+    update_cover();
+    derive_pending_cover_keys();
+
+    collect_cover_changes(cover_changes, all_users_reported, added_keys_id, added_keys, removed_keys_id);
+    cover_changes.clear();
+    all_users_reported = revoked_users.empty();
+}
+
+void BES_SDM_scheme::map_file(const string& path, Map_mode mode)
+{
+    map_tree(path, "SDM_BES_scheme", mode);
+    invalidate_cover(); // the cover of the previous state is no longer valid, it is rebuilt when needed
+}
 
+ostream& operator << (ostream& os, const BES_SDM_scheme& obj) {
+    // header, allowed users as words and key arena
+    obj.write_tree(os, "SDM_BES_scheme");
+    return os;
+}
+
+istream& operator >> (istream& is, BES_SDM_scheme& obj) {
+    if (obj.read_tree(is, "SDM_BES_scheme", false)) {
+        // the cover of the previous state is no longer valid, it is rebuilt when needed
+        obj.invalidate_cover();
+    }
     return is;
 }
 
@@ -8,6 +8,8 @@
 #include "Key_Tree.hpp"
 #include "DRBG_AES.hpp"
 
+#include <map>
+
 /**
  *@brief struct representing a subset group in the SDM scheme
  *
@@ -26,6 +28,34 @@ const char O_node = 0; // Operative user
 const char D_node = 1; // Denied user
 const char S_node = 2; // Semi operative node
 
+/**
+ *@brief number of ways of each set of the label cache of get_user_labels
+ *
+ */
+const size_t label_cache_ways = 4;
+
+/**
+ *@brief counters of the label cache of get_user_labels, to size it
+ *
+ */
+struct Label_cache_stats
+{
+    uint64_t hits;   ///< chain steps whose labels were found in the cache
+    uint64_t misses; ///< chain steps derived with the DRBG and added to the cache
+    size_t capacity; ///< number of entries the cache holds, each one the two labels of a chain step
+    size_t entries;  ///< number of entries in use
+};
+
+/**
+ *@brief algorithms available to compute the cover of the allowed users
+ *
+ */
+enum Cover_method
+{
+    Tree_cover,          ///< classification of the whole tree kept in memory and updated along the path of each denied user
+    Revoked_leaves_cover ///< Steiner tree built level by level from the sorted denied users in O(r log n), no per node state
+};
+
 /**
  * @class BES_SDM_scheme
  * @brief Class representing a Subset Difference Broadcast Encryption Scheme (BES) which inherits from Keytree.
@@ -40,42 +70,339 @@ private:
     uint8_t all_users_allowed_key[32];
 
     /*!
-     * @brief Finds the path between a leaf and a node.
+     * @brief Generates a triple-sized key using a Deterministic Random Byte Generator (DRBG), computing only the requested thirds.
      *
-     * @param leaf_node_index The index of the leaf node.
-     * @param root_node_index The index of the root node.
-     * @param path Vector to store the path.
-     * @return 1 if the path is found, -1 if the leaf and root nodes are the same.
+     * @param key_in The input key, zero padded up to AES_STREAM_SEEDBYTES bytes.
+     * @param left Buffer to store the left third (label of the left child), or nullptr if not needed.
+     * @param middle Buffer to store the middle third (key of the node), or nullptr if not needed.
+     * @param right Buffer to store the right third (label of the right child), or nullptr if not needed.
      */
-    int find_path(unsigned int leaf_node_index, unsigned int root_node_index, vector<unsigned int> &path);
+    void drbg_triplesize(const uint8_t *key_in, uint8_t *left, uint8_t *middle, uint8_t *right);
 
-    /*!
-     * @brief Generates a triple-sized key using a Deterministic Random Byte Generator (DRBG).
+    /**
+     * @brief subsets emitted by one node of the cover finding algorithm, with their cached keys
      *
-     * @param key_in The input key.
-     * @param key_size The size of the input key.
-     * @param triple_out Buffer to store the triple-sized key output.
      */
-    void drbg_triplesize(uint8_t *key_in, size_t key_size, uint8_t *triple_out);
+    struct Cover_node
+    {
+        unsigned int subset_count;
+        Key_subset subsets[2];
+        bool keys_ready; ///< false until the keys of the subsets are derived
+        uint8_t keys[2][32];
+    };
+
+    Cover_method cover_method;                                   ///< algorithm used to compute the cover
+    vector<uint64_t> node_tree;                                  ///< persistent O/D/S classification of the Steiner tree (Tree_cover) packed in 2 bits per node (see get_node_type), empty until the cover is first needed
+    map<unsigned long long, Cover_node> cover_nodes;             ///< nodes emitting subsets, ordered as the cover is output (see cover_order)
+    map<unsigned long long, Cover_node> cover_changes;           ///< subsets last reported by each node whose subsets changed since then
+    vector<unsigned long long> pending_cover_keys;               ///< cover nodes whose keys are not derived yet
+    bool cover_reported;                                         ///< whether a cover was already returned, so that deltas are relative to it
+    bool all_users_reported;                                     ///< whether the last returned cover was the all users allowed special key
+    unsigned int cover_threads;                                  ///< threads used to build the cover from scratch and derive its keys
+    vector<uint64_t> label_cache_tags;                           ///< (high node << 32 | node) of each way, label_cache_ways per set most recently used first, UINT64_MAX if empty
+    vector<uint8_t> label_cache_labels;                          ///< left and right labels of each way, 2 * Key_length / 8 bytes, in the same order as the tags
+    size_t label_cache_sets;                                     ///< number of sets of the label cache, a power of two, 0 if disabled
+    size_t label_cache_entries;                                  ///< ways in use
+    uint64_t label_cache_hits;
+    uint64_t label_cache_misses;
+
+    /*!
+     * @brief Position of a node in the cover: deeper levels first, then by index, as the bottom up scan finds the subsets.
+     */
+    unsigned long long cover_order(unsigned int node_index) const
+    {
+        return (static_cast<unsigned long long>(depth - get_node_level(node_index)) << 32) | node_index;
+    }
+
+    /*!
+     * @brief Type of a node in node_tree. Node i is kept at position i + 1, so each level starts a word once it has 32 nodes
+     * and the children of the node at position p are at positions 2p and 2p + 1.
+     */
+    char get_node_type(unsigned int node_index) const
+    {
+        size_t position = static_cast<size_t>(node_index) + 1;
+        return static_cast<char>((node_tree[position / 32] >> (2 * (position % 32))) & 3);
+    }
+
+    /*!
+     * @brief Sets the type of a node in node_tree.
+     */
+    void set_node_type(unsigned int node_index, char type)
+    {
+        size_t position = static_cast<size_t>(node_index) + 1;
+        unsigned int shift = 2 * (position % 32);
+        node_tree[position / 32] = (node_tree[position / 32] & ~(3ull << shift)) | (static_cast<uint64_t>(type) << shift);
+    }
 
     /*!
-     * @brief Finds the subset and key for a given subtree in the node tree.
+     * @brief Finds the subset for a given subtree in the node tree.
      *
      * @param subtree_root_node The index of the subtree root node.
-     * @param node_tree Vector representing the structure of the node tree.
-     * @param key Buffer to store the derived key.
      * @return An instance of Key_subset containing the high and low nodes of the subset.
      */
-    Key_subset find_subset_and_key(int subtree_root_node, vector<char> node_tree, uint8_t *key);
+    Key_subset find_subset(unsigned int subtree_root_node) const;
+
+    /*!
+     * @brief Type of a node from the types of its children, and which of its S children close a subset.
+     *
+     * @param left_node Type of the left child.
+     * @param right_node Type of the right child.
+     * @param close_left Set to true if the left child subtree is emitted as a subset.
+     * @param close_right Set to true if the right child subtree is emitted as a subset.
+     * @return The type of the node.
+     */
+    static char classify_children(char left_node, char right_node, bool &close_left, bool &close_right);
+
+    /*!
+     * @brief Classifies an internal node from its children in node_tree and finds the subsets it emits.
+     *
+     * @param node_index The index of the node.
+     * @param emitted Cover node to store the emitted subsets.
+     */
+    void classify_node(unsigned int node_index, Cover_node &emitted);
+
+    /*!
+     * @brief Classifies consecutive nodes of a level in node_tree a word of 32 nodes at a time, their children must be classified already.
+     * The packed types of the children give the types of the parents and a mask of the children closing a subset, the subsets
+     * are then found from the mask. Ranges of whole words can be classified by several threads at once.
+     *
+     * @param first_position Position in node_tree of the first node (its index + 1).
+     * @param node_count Number of nodes, all in the same level: a power of two, with first_position a multiple of it.
+     * @param emitted Vector to store the nodes emitting subsets, with their cover_order.
+     */
+    void classify_level_range(size_t first_position, size_t node_count, vector<pair<unsigned long long, Cover_node>> &emitted);
+
+    /*!
+     * @brief Builds node_tree from scratch scanning the whole tree bottom up a level at a time, and updates cover_nodes with it.
+     * With several cover_threads the subtrees below parallel_split_level are classified in parallel, down to the levels
+     * where they own whole words of node_tree, and the levels above them after.
+     */
+    void build_cover();
+
+    /**
+     * @brief Node of the Steiner tree of the denied users, the nodes missing from it are O nodes.
+     */
+    struct Steiner_node
+    {
+        unsigned int index;
+        char type;
+        unsigned int low_node; ///< for S nodes, the denied node ending the S chain (what find_subset walks to)
+    };
+
+    /*!
+     * @brief Merges sibling paths of the Steiner tree from one level up to another.
+     *
+     * @param level The non O nodes of bottom_level by index, replaced with the ones of top_level.
+     * @param bottom_level Level of the nodes in level.
+     * @param top_level Level to stop at.
+     * @param emitted Vector to store the nodes emitting subsets, with their cover_order.
+     */
+    void merge_steiner_levels(vector<Steiner_node> &level, size_t bottom_level, size_t top_level,
+                              vector<pair<unsigned long long, Cover_node>> &emitted) const;
+
+    /*!
+     * @brief Finds the subsets of the cover from revoked_users alone, merging sibling paths level by level.
+     * With several cover_threads the denied users of each subtree below parallel_split_level are merged in parallel.
+     *
+     * @param fresh Map to store the nodes emitting subsets, by cover_order.
+     */
+    void build_revoked_leaves_cover(map<unsigned long long, Cover_node> &fresh) const;
+
+    /*!
+     * @brief Replaces the subsets emitted by a node, keeping the cached keys if they did not change and
+     * remembering the reported subsets for get_cover_delta if they did.
+     *
+     * @param order The cover_order of the node.
+     * @param emitted The subsets the node emits now (none to remove it from the cover).
+     */
+    void set_cover_node(unsigned long long order, const Cover_node &emitted);
+
+    /*!
+     * @brief Replaces cover_nodes with a freshly computed cover, through set_cover_node.
+     */
+    void merge_cover(const map<unsigned long long, Cover_node> &fresh);
+
+    /*!
+     * @brief Brings cover_nodes up to date with the denied users, with the current cover_method.
+     */
+    void update_cover();
+
+    /*!
+     * @brief Reclassifies the paths from some leaves to the root after their users changed, updating the subsets emitted along them.
+     * Shared ancestors are reclassified once, and a path stops at a node whose type does not change unless it is an S node
+     * (the subsets found above it walk down its S chain).
+     *
+     * @param leaf_indexes The indexes of the leaf nodes, in ascending order.
+     */
+    void update_cover_paths(const vector<unsigned int> &leaf_indexes);
+
+    /*!
+     * @brief Denies or allows again a batch of users, updating the cover and getting the change it causes.
+     *
+     * @param userIDs The IDs of the users, on return only the ones that changed, sorted.
+     * @param allowed Whether the users are allowed again (true) or denied (false).
+     * @param added_keys_id Vector to store the subset IDs new in the cover.
+     * @param added_keys Vector to store the keys of the new subsets.
+     * @param removed_keys_id Vector to store the subset IDs no longer in the cover.
+     * @throws invalid_argument if any user ID is invalid, nothing is changed then.
+     */
+    void change_users(vector<unsigned int> &userIDs, bool allowed, vector<Key_subset> &added_keys_id,
+                      vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id);
+
+    /*!
+     * @brief Appends the difference between the subsets recorded in a change log and the current cover to the output vectors.
+     *
+     * @param changes Subsets emitted by each changed node before the changes.
+     * @param all_users_before Whether the cover before the changes was the all users allowed special key.
+     */
+    void collect_cover_changes(const map<unsigned long long, Cover_node> &changes, bool all_users_before,
+                               vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id);
+
+    /*!
+     * @brief Derives the keys of the cover nodes in pending_cover_keys.
+     */
+    void derive_pending_cover_keys();
+
+    /*!
+     * @brief Brings the cover up to date and derives its pending keys, as the new base of get_cover_delta.
+     */
+    void report_cover();
+
+    /*!
+     * @brief Appends the subsets of a cover node, and copies of their keys, to the output vectors.
+     */
+    void append_cover_node(const Cover_node &node, vector<Key_subset> &keys_id, vector<uint8_t *> &keys) const;
+
+    /*!
+     * @brief Appends the all users allowed subset {0,0} and a copy of its key to the output vectors.
+     */
+    void append_all_users_key(vector<Key_subset> &keys_id, vector<uint8_t *> &keys) const;
+
+    /*!
+     * @brief Drops the persistent cover, it is rebuilt the next time it is needed (used when the whole state changes).
+     */
+    void invalidate_cover();
+
+    /*!
+     * @brief Derives the keys of a set of subsets, walking the label chains from each high node to its low node
+     * with up to AES_TRIPLE_PRG_LANES chains advanced in lock-step.
+     *
+     * @param subsets The subsets whose keys are derived.
+     * @param count Number of subsets.
+     * @param keys Buffers of Key_length / 8 bytes to store the key of each subset.
+     * @param cached Whether the node keys go through the cache of derived keys, false reads them with read_node_key
+     * so several threads can derive keys at once.
+     */
+    void derive_subset_keys(const Key_subset *subsets, size_t count, uint8_t *const *keys, bool cached = true);
+
+    /*!
+     * @brief Copies the keys of the ancestors of the leaf of a user, where its label chains start, zero padded up to a seed.
+     *
+     * @param userID The ID of the user, it must be valid.
+     * @param ancestor_keys Array of depth seeds, seed c is the key of the ancestor c + 1 levels above the leaf.
+     */
+    void load_ancestor_keys(unsigned int userID, uint8_t (*ancestor_keys)[AES_STREAM_SEEDBYTES]);
+
+    /*!
+     * @brief Derives the labels of a user with the derive_user_labels_fixed kernel of the key length of the tree.
+     *
+     * @param userID The ID of the user, it must be valid.
+     * @param ancestor_keys Keys of the ancestors, as load_ancestor_keys.
+     * @param user_labels_id Buffer of depth * (depth + 1) / 2 subset IDs to store the labels subset IDs.
+     * @param user_labels Buffers of Key_length / 8 bytes to store each label.
+     */
+    void derive_user_labels(unsigned int userID, const uint8_t (*ancestor_keys)[AES_STREAM_SEEDBYTES],
+                            Key_subset *user_labels_id, uint8_t *const *user_labels) const;
+
+    /*!
+     * @brief Finds the labels of the children of a node in the chain starting at a high node, and marks them as most recently used.
+     *
+     * @param high_node The node where the chain starts.
+     * @param node The node of the chain.
+     * @return Pointer to the left label followed by the right label, or nullptr if they are not in the cache.
+     */
+    uint8_t *find_label_pair(unsigned int high_node, unsigned int node);
+
+    /*!
+     * @brief Adds the labels of the children of a node in the chain starting at a high node, evicting the least recently used way of its set.
+     *
+     * @return Pointer to the 2 * Key_length / 8 bytes where the left and right labels must be written.
+     */
+    uint8_t *insert_label_pair(unsigned int high_node, unsigned int node);
+
+    /*!
+     * @brief Derives the labels of a user as derive_user_labels, taking the steps of each chain from the label cache while
+     * they are found and deriving the rest in lock-step, adding them to the cache.
+     *
+     * @param userID The ID of the user, it must be valid.
+     * @param ancestor_keys Keys of the ancestors, as load_ancestor_keys, used as the seeds of the chains.
+     * @param user_labels_id Buffer of depth * (depth + 1) / 2 subset IDs to store the labels subset IDs.
+     * @param user_labels Buffers of Key_length / 8 bytes to store each label.
+     */
+    void derive_user_labels_cached(unsigned int userID, uint8_t (*ancestor_keys)[AES_STREAM_SEEDBYTES],
+                                   Key_subset *user_labels_id, uint8_t *const *user_labels);
+
+    /*!
+     * @brief Buffers of a provisioning task, the labels of every chain walking down the current path of the tree.
+     */
+    struct Provision_state
+    {
+        vector<uint8_t> chain_labels;  ///< seed j at level L is the label of node L of the chain starting at level j, j <= L
+        vector<uint8_t> right_labels;  ///< right outputs of the chains at each level, used when the walk turns right
+        vector<Key_subset> package_id; ///< label subset IDs of the current leaf, as get_user_labels
+        vector<uint8_t> package;       ///< labels of the current leaf, packed
+
+        uint8_t *chain_label(size_t level, size_t chain, size_t depth)
+        {
+            return chain_labels.data() + (level * (depth + 1) + chain) * AES_STREAM_SEEDBYTES;
+        }
+    };
+
+    /*!
+     * @brief Walks down the subtree of a node sharing the labels of every chain among the leaves below it, and passes
+     * the labels of the leaves of the users in a range to a sink.
+     *
+     * @param node_index The node, the labels of the chains reaching it are in state.
+     * @param level Level of the node.
+     * @param first_user The ID of the first user to provision.
+     * @param last_user The ID after the last user to provision.
+     * @param state Buffers of the task.
+     * @param sink Receiver of the labels.
+     */
+    void provision_subtree(unsigned int node_index, unsigned int level, size_t first_user, size_t last_user,
+                           Provision_state &state, const User_keys_sink<Key_subset> &sink) const;
+
+protected:
+    /*!
+     * @brief Derives the labels of a user in a single pass over the path of its leaf, walking down one label chain from each
+     * ancestor with the chains packed in the lanes of aes_triple_prg_batch. Only fixed size arrays on the stack are used,
+     * and every label copy has the size of the key known at compile time. Instantiated for keys of 16, 24 and 32 bytes.
+     *
+     * @tparam Key_bytes Key_length / 8.
+     * @param userID The ID of the user, it must be valid.
+     * @param ancestor_keys Keys of the ancestors, as load_ancestor_keys.
+     * @param user_labels_id Buffer of depth * (depth + 1) / 2 subset IDs to store the labels subset IDs.
+     * @param user_labels Buffers of Key_bytes bytes to store each label.
+     */
+    template <size_t Key_bytes>
+    void derive_user_labels_fixed(unsigned int userID, const uint8_t (*ancestor_keys)[AES_STREAM_SEEDBYTES],
+                                  Key_subset *user_labels_id, uint8_t *const *user_labels) const;
 
 public:
+    /**
+     * @brief Type of the IDs of the keys of the scheme, the subset.
+     */
+    typedef Key_subset Key_id;
+
     /**
      * @brief Constructor for a Subset Difference BES scheme.
      *
      * @param Tree_Depth The depth of the tree.
      * @param node_key_length The length of the node keys in bits.
+     * @param key_generation_threads Number of threads used to generate the node keys (0 uses all the hardware threads).
+     * @param storage Whether the node keys are stored (default) or derived on demand from a master secret.
      */
-    BES_SDM_scheme(size_t Tree_Depth, size_t node_key_length);
+    BES_SDM_scheme(size_t Tree_Depth, size_t node_key_length, unsigned int key_generation_threads = 1, Key_storage storage = Stored_keys);
 
     /**
      * @brief Destructor for a Subset Difference BES scheme.
@@ -92,6 +419,16 @@ public:
      */
     friend istream& operator >> ( istream& is, BES_SDM_scheme& obj);
 
+    /**
+     * @brief Opens a tree written with operator << over a memory mapped file instead of reading it, so it is available at once
+     * and its keys are paged in when used. Read only mappings of the same file share one physical copy among processes.
+     *
+     * @param path Path of the file.
+     * @param mode Map_read_only (default, the node keys can not be modified) or Map_copy_on_write.
+     * @throws runtime_error if the file can not be mapped or does not hold a tree of this scheme.
+     */
+    void map_file(const string& path, Map_mode mode = Map_read_only);
+
     /*!
      * @brief Denies access to a user by their user ID.
      *
@@ -101,6 +438,53 @@ public:
      */
     int denegate_user(unsigned int userID);
 
+    /*!
+     * @brief Denies access to a batch of users at once, and gets the change of the cover it causes.
+     * The users are sorted, the paths to the root are reclassified once for the whole batch and users already denied are skipped.
+     *
+     * @param userIDs The IDs of the users.
+     * @param added_keys_id Vector to store the subset IDs new in the cover.
+     * @param added_keys Vector to store the keys of the new subsets (allocated with new[], owned by the caller).
+     * @param removed_keys_id Vector to store the subset IDs no longer in the cover.
+     * @return 1 if the users are successfully denied, -1 if any user ID is invalid.
+     * @throws invalid_argument if any user ID is invalid, no user is denied then.
+     */
+    int denegate_users(const vector<unsigned int> &userIDs, vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id);
+
+    /*!
+     * @brief Denies access to the users with IDs in [first_user, last_user), as denegate_users.
+     *
+     * @param first_user The ID of the first user.
+     * @param last_user The ID after the last user.
+     * @param added_keys_id Vector to store the subset IDs new in the cover.
+     * @param added_keys Vector to store the keys of the new subsets (allocated with new[], owned by the caller).
+     * @param removed_keys_id Vector to store the subset IDs no longer in the cover.
+     * @return 1 if the users are successfully denied, -1 if the range is invalid.
+     * @throws invalid_argument if the range is invalid.
+     */
+    int denegate_range(unsigned int first_user, unsigned int last_user, vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id);
+
+    /*!
+     * @brief Allows access again to a denied user, only the classification of its path is updated.
+     *
+     * @param userID The ID of the user.
+     * @return 1 if the user access is successfully allowed, -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid.
+     */
+    int reinstate_user(unsigned int userID);
+
+    /*!
+     * @brief Allows access again to a batch of denied users at once, and gets the change of the cover it causes, as denegate_users.
+     *
+     * @param userIDs The IDs of the users.
+     * @param added_keys_id Vector to store the subset IDs new in the cover.
+     * @param added_keys Vector to store the keys of the new subsets (allocated with new[], owned by the caller).
+     * @param removed_keys_id Vector to store the subset IDs no longer in the cover.
+     * @return 1 if the users are successfully allowed, -1 if any user ID is invalid.
+     * @throws invalid_argument if any user ID is invalid, no user is allowed then.
+     */
+    int reinstate_users(const vector<unsigned int> &userIDs, vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id);
+
     /*!
      * @brief Gets the key_labels for a specific user according to the SDM scheme (remark on it gets the key_labels, not the direct keys).
      *
@@ -112,13 +496,153 @@ public:
      */
     int get_user_labels(unsigned int userID, vector<Key_subset> &user_labels_id, vector<uint8_t *> &user_labels);
 
+    /*!
+     * @brief Gets the key_labels for a specific user into caller buffers, without allocating memory.
+     *
+     * @param userID The ID of the user.
+     * @param user_labels_id Buffer of depth * (depth + 1) / 2 subset IDs to store the labels subset IDs.
+     * @param user_labels Buffer of depth * (depth + 1) / 2 * Key_length / 8 bytes to store the labels, packed in the same order.
+     * @return 1 if the user labels are successfully retrieved, -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid.
+     */
+    int get_user_labels(unsigned int userID, Key_subset *user_labels_id, uint8_t *user_labels);
+
+    /*!
+     * @brief Gets the key_labels for a specific user into a reusable batch, emptied first.
+     *
+     * @param userID The ID of the user.
+     * @param batch Batch to store the user's labels.
+     * @return 1 if the user labels are successfully retrieved, -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid.
+     */
+    int get_user_labels(unsigned int userID, Key_batch<Key_subset> &batch);
+
+    /*!
+     * @brief Sets the size of the cache of labels used by get_user_labels, dropping its content and counters. Each entry keeps the
+     * two labels one step of a chain derives, so users whose paths share nodes near the root take those steps from the cache.
+     * The memory used is 8 + 2 * Key_length / 8 bytes per entry, the entries are rounded up to a power of two.
+     *
+     * @param entries Number of entries, 0 disables the cache (the default).
+     */
+    void set_label_cache_capacity(size_t entries);
+
+    /*!
+     * @brief Gets the hit and miss counters of the label cache.
+     */
+    Label_cache_stats get_label_cache_stats() const;
+
+    /*!
+     * @brief Resets the hit and miss counters of the label cache, keeping its content.
+     */
+    void reset_label_cache_stats();
+
+    /*!
+     * @brief Gets the key_labels for a specific user into caller buffers as get_user_labels, without modifying the scheme
+     * (derived keys bypass their cache), so several threads can call it at once while no other method is running.
+     *
+     * @param userID The ID of the user.
+     * @param user_labels_id Buffer of get_user_key_count() subset IDs to store the labels subset IDs.
+     * @param user_labels Buffer of get_user_key_count() * Key_length / 8 bytes to store the labels, packed in the same order.
+     * @return 1 if the user labels are successfully retrieved, -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid.
+     */
+    int read_user_keys(unsigned int userID, Key_subset *user_labels_id, uint8_t *user_labels) const;
+
+    /*!
+     * @brief Gets the number of labels of a user, depth * (depth + 1) / 2.
+     */
+    size_t get_user_key_count() const { return depth * (depth + 1) / 2; }
+
+    /*!
+     * @brief Derives the labels of the users in [first_user, last_user) walking the tree once: the labels of the chains on a
+     * path are derived once for every leaf below it instead of once per user. The range is split by subtrees run on a pool of threads.
+     * The scheme is not modified (derived keys bypass their cache), as read_user_keys.
+     *
+     * @param first_user The ID of the first user.
+     * @param last_user The ID after the last user.
+     * @param sink Receiver of the labels of each user, in the order of get_user_labels, called from several threads at once.
+     * @param threads Number of threads to use (0 uses all the hardware threads, 1 runs in the calling thread).
+     * @return 1 if the users are provisioned, -1 if the range is invalid.
+     * @throws invalid_argument if the range is invalid.
+     */
+    int provision_range(unsigned int first_user, unsigned int last_user, const User_keys_sink<Key_subset> &sink, unsigned int threads = 0) const;
+
+    /*!
+     * @brief Derives the labels of every user, as provision_range.
+     */
+    int provision_all(const User_keys_sink<Key_subset> &sink, unsigned int threads = 0) const
+    {
+        return provision_range(0, allowed_users.size(), sink, threads);
+    }
+
     /*!
      * @brief Gets the allowed keys for operative users in the system.
+     * The classification of the tree is kept between calls and only the paths of the users denied since then are updated,
+     * so the keys of unchanged subsets are not derived again. The returned cover becomes the base of get_cover_delta.
      *
      * @param user_keys_id Vector to store the key subset IDs.
-     * @param user_keys Vector to store the keys.
+     * @param user_keys Vector to store the keys (allocated with new[], owned by the caller).
      */
     void get_allowed_keys(vector<Key_subset> &user_keys_id, vector<uint8_t *> &user_keys);
+
+    /*!
+     * @brief Gets the allowed keys into caller buffers as get_allowed_keys, without allocating memory for the output.
+     * If the cover does not fit only its first subsets are written, get_cover_size_bound gives a size that always fits.
+     *
+     * @param user_keys_id Buffer of capacity subset IDs to store the key subset IDs.
+     * @param user_keys Buffer of capacity * Key_length / 8 bytes to store the keys, packed in the same order.
+     * @param capacity Number of keys the buffers hold.
+     * @return The number of keys of the cover.
+     */
+    size_t get_allowed_keys(Key_subset *user_keys_id, uint8_t *user_keys, size_t capacity);
+
+    /*!
+     * @brief Gets the allowed keys into a reusable batch as get_allowed_keys, emptied first and pre-sized with get_cover_size_bound.
+     *
+     * @param batch Batch to store the keys.
+     */
+    void get_allowed_keys(Key_batch<Key_subset> &batch);
+
+    /*!
+     * @brief Gets an upper bound of the number of keys of the cover with the current denied users, 2r - 1 for r denied users.
+     */
+    size_t get_cover_size_bound() const;
+
+    /*!
+     * @brief Selects the algorithm used to compute the cover, both give the same cover.
+     * Revoked_leaves_cover frees the classification of the whole tree kept by Tree_cover.
+     *
+     * @param method The cover method.
+     */
+    void set_cover_method(Cover_method method);
+
+    /*!
+     * @brief Gets the algorithm used to compute the cover.
+     */
+    Cover_method get_cover_method() const { return cover_method; }
+
+    /*!
+     * @brief Sets the number of threads used to build the cover from scratch and to derive the keys of its new subsets.
+     * Incremental updates along the paths of the changed users stay in the calling thread.
+     *
+     * @param threads Number of threads (0 uses all the hardware threads, 1 computes the cover in the calling thread).
+     */
+    void set_cover_threads(unsigned int threads);
+
+    /*!
+     * @brief Gets the number of threads used to compute the cover.
+     */
+    unsigned int get_cover_threads() const { return cover_threads; }
+
+    /*!
+     * @brief Gets the changes of the cover since the last one returned by get_allowed_keys or get_cover_delta, in time proportional
+     * to the number of changed subsets. If no cover was returned yet, the whole cover is added.
+     *
+     * @param added_keys_id Vector to store the subset IDs new in the cover.
+     * @param added_keys Vector to store the keys of the new subsets (allocated with new[], owned by the caller).
+     * @param removed_keys_id Vector to store the subset IDs no longer in the cover.
+     */
+    void get_cover_delta(vector<Key_subset> &added_keys_id, vector<uint8_t *> &added_keys, vector<Key_subset> &removed_keys_id);
 };
 
 #endif
@@ -1,13 +1,39 @@
 #include "DRBG_AES.hpp"
 
-#if defined(__GNUC__) && !defined(__clang__)
-#pragma GCC target("ssse3")
-#pragma GCC target("aes")
-#endif
-
-#include <immintrin.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+# define AES_STREAM_X86 1
+# include <immintrin.h>
+# if defined(_MSC_VER)
+#  include <intrin.h>
+# else
+#  include <cpuid.h>
+# endif
+#else
+# define AES_STREAM_X86 0
+#endif
+
+/* Each kernel is compiled for its own instruction set and picked at runtime from CPUID, so the
+ * library runs on any host (the portable kernel needs no special instruction at all) */
+#if defined(__GNUC__)
+# define AES_TARGET_AESNI   __attribute__((target("aes,ssse3")))
+# define AES_TARGET_VAES256 __attribute__((target("aes,ssse3,avx2,vaes")))
+# define AES_TARGET_VAES512 __attribute__((target("aes,ssse3,avx2,avx512f,avx512bw,vaes")))
+# define AES_STREAM_VAES    AES_STREAM_X86
+#elif defined(_MSC_VER)
+# define AES_TARGET_AESNI
+# define AES_TARGET_VAES256
+# define AES_TARGET_VAES512
+# define AES_STREAM_VAES    (AES_STREAM_X86 && _MSC_VER >= 1920)
+#else
+# define AES_TARGET_AESNI
+# define AES_TARGET_VAES256
+# define AES_TARGET_VAES512
+# define AES_STREAM_VAES    0
+#endif
 
 #define COMPILER_ASSERT(X) (void) sizeof(char[(X) ? 1 : -1])
 
@@ -19,9 +45,10 @@
 # pragma pack(push, 1)
 #endif
 
+/* Same layout for every kernel: the x86 kernels load the round keys and the counter as __m128i */
 typedef struct CRYPTO_ALIGN(16) _aes_stream_state {
-    __m128i round_keys[AES_STREAM_ROUNDS + 1];
-    __m128i counter;
+    unsigned char round_keys[AES_STREAM_ROUNDS + 1][16];
+    unsigned char counter[16];
 } _aes_stream_state;
 
 #ifdef __IBMC__
@@ -32,6 +59,394 @@ typedef struct CRYPTO_ALIGN(16) _aes_stream_state {
 # pragma pack(pop)
 #endif
 
+/* Round count of the triple PRG: AES-128 for 128 bit outputs, AES-256 otherwise */
+#define AES_TRIPLE_PRG_ROUNDS(OUT_LEN) ((OUT_LEN) == 16 ? 10 : 14)
+#define AES_MAX_ROUNDS 14
+
+typedef struct aes_stream_kernels {
+    void (*init)(_aes_stream_state *_st, const unsigned char seed[AES_STREAM_SEEDBYTES]);
+    void (*stream)(_aes_stream_state *_st, unsigned char *buf, size_t buf_len);
+    void (*prf)(const _aes_stream_state *_st, unsigned long long input, unsigned char *out, size_t out_len);
+    void (*triple_prg_lanes)(size_t lanes, const unsigned char *const *seeds, size_t out_len,
+                             unsigned char *const *left, unsigned char *const *middle,
+                             unsigned char *const *right);
+} aes_stream_kernels;
+
+/* Bit mask of the 16 byte blocks covering the non NULL outputs of one triple PRG lane */
+static unsigned int
+_aes_triple_prg_block_mask(size_t lane, size_t out_len, unsigned char *const *left,
+                           unsigned char *const *middle, unsigned char *const *right)
+{
+    unsigned char *const *outputs[3] = { left, middle, right };
+    unsigned int          mask       = 0;
+    size_t                i, b;
+
+    for (i = 0; i < 3; i++) {
+        if (outputs[i] == NULL || outputs[i][lane] == NULL) {
+            continue;
+        }
+        for (b = (i * out_len) / 16; b <= ((i + 1) * out_len - 1) / 16; b++) {
+            mask |= 1U << b;
+        }
+    }
+    return mask;
+}
+
+/* Copies the requested thirds of one lane out of its 3 * out_len bytes of PRG output */
+static void
+_aes_triple_prg_copy_outputs(size_t lane, const unsigned char *t, size_t out_len, unsigned char *const *left,
+                             unsigned char *const *middle, unsigned char *const *right)
+{
+    unsigned char *const *outputs[3] = { left, middle, right };
+    size_t                i;
+
+    for (i = 0; i < 3; i++) {
+        if (outputs[i] != NULL && outputs[i][lane] != NULL) {
+            memcpy(outputs[i][lane], t + i * out_len, out_len);
+        }
+    }
+}
+
+/* Adds n to the low 64 bits of a little endian counter block, like _mm_add_epi64 does */
+static void
+_aes_counter_add(unsigned char out[16], const unsigned char in[16], uint64_t n)
+{
+    uint64_t low = 0;
+    int      i;
+
+    for (i = 7; i >= 0; i--) {
+        low = (low << 8) | in[i];
+    }
+    low += n;
+    for (i = 0; i < 8; i++) {
+        out[i] = (unsigned char) (low >> (8 * i));
+    }
+    memcpy(out + 8, in + 8, 8);
+}
+
+/////////////////////////////////////// PORTABLE CONSTANT-TIME KERNEL ///////////////////////////////////////
+
+/* The S-box is computed as the GF(2^8) inverse (x^254) followed by the affine map, on bitsliced planes:
+ * plane k holds bit k of 64 bytes, so there is no table lookup and no secret dependent branch. */
+
+static uint64_t
+_aes_transpose8x8(uint64_t x)
+{
+    uint64_t t;
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+static void
+_aes_bytes_to_planes(const unsigned char in[64], uint64_t planes[8])
+{
+    uint64_t w;
+    int      g, k;
+
+    for (k = 0; k < 8; k++) {
+        planes[k] = 0;
+    }
+    for (g = 0; g < 8; g++) {
+        w = 0;
+        for (k = 7; k >= 0; k--) {
+            w = (w << 8) | in[8 * g + k];
+        }
+        w = _aes_transpose8x8(w); /* byte k of w now holds bit k of the 8 input bytes */
+        for (k = 0; k < 8; k++) {
+            planes[k] |= ((w >> (8 * k)) & 0xff) << (8 * g);
+        }
+    }
+}
+
+static void
+_aes_planes_to_bytes(const uint64_t planes[8], unsigned char out[64])
+{
+    uint64_t w;
+    int      g, k;
+
+    for (g = 0; g < 8; g++) {
+        w = 0;
+        for (k = 7; k >= 0; k--) {
+            w = (w << 8) | ((planes[k] >> (8 * g)) & 0xff);
+        }
+        w = _aes_transpose8x8(w);
+        for (k = 0; k < 8; k++) {
+            out[8 * g + k] = (unsigned char) (w >> (8 * k));
+        }
+    }
+}
+
+/* Reduces a bitsliced polynomial of degree <= 14 modulo x^8 + x^4 + x^3 + x + 1 */
+static void
+_aes_gf256_reduce(uint64_t t[15], uint64_t c[8])
+{
+    int k;
+
+    for (k = 14; k >= 8; k--) {
+        t[k - 4] ^= t[k];
+        t[k - 5] ^= t[k];
+        t[k - 7] ^= t[k];
+        t[k - 8] ^= t[k];
+    }
+    for (k = 0; k < 8; k++) {
+        c[k] = t[k];
+    }
+}
+
+static void
+_aes_gf256_mul(const uint64_t a[8], const uint64_t b[8], uint64_t c[8])
+{
+    uint64_t t[15] = { 0 };
+    int      i, j;
+
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 8; j++) {
+            t[i + j] ^= a[i] & b[j];
+        }
+    }
+    _aes_gf256_reduce(t, c);
+}
+
+static void
+_aes_gf256_square(const uint64_t a[8], uint64_t c[8])
+{
+    uint64_t t[15] = { 0 };
+    int      i;
+
+    for (i = 0; i < 8; i++) {
+        t[2 * i] = a[i]; /* squaring is linear in GF(2^8) */
+    }
+    _aes_gf256_reduce(t, c);
+}
+
+/* SubBytes on 64 bytes at once */
+static void
+_aes_sub_bytes64(unsigned char bytes[64])
+{
+    uint64_t x[8], x2[8], x3[8], x12[8], x15[8], x240[8], y[8], s[8];
+    int      i;
+
+    _aes_bytes_to_planes(bytes, x);
+    _aes_gf256_square(x, x2);
+    _aes_gf256_mul(x2, x, x3);
+    _aes_gf256_square(x3, y);
+    _aes_gf256_square(y, x12);
+    _aes_gf256_mul(x12, x3, x15);
+    _aes_gf256_square(x15, y);
+    _aes_gf256_square(y, x240);
+    _aes_gf256_square(x240, y);
+    _aes_gf256_square(y, x240);
+    _aes_gf256_mul(x240, x12, y);
+    _aes_gf256_mul(y, x2, x); /* x^254, the inverse of x (0 for 0) */
+    for (i = 0; i < 8; i++) {
+        s[i] = x[i] ^ x[(i + 4) % 8] ^ x[(i + 5) % 8] ^ x[(i + 6) % 8] ^ x[(i + 7) % 8];
+        if ((0x63 >> i) & 1) {
+            s[i] = ~s[i];
+        }
+    }
+    _aes_planes_to_bytes(s, bytes);
+}
+
+static unsigned char
+_aes_xtime(unsigned char b)
+{
+    return (unsigned char) ((b << 1) ^ (0x1b & (unsigned char) -(b >> 7)));
+}
+
+/* aesenc (or aesenclast) on n <= 4 blocks with their own round keys */
+static void
+_aes_round_portable(unsigned char state[64], const unsigned char *const *round_keys, size_t n, int last)
+{
+    unsigned char shifted[64] = { 0 };
+    unsigned char a0, a1, a2, a3, all;
+    size_t        b;
+    int           r, c;
+
+    for (b = 0; b < n; b++) { /* ShiftRows, byte r + 4c is row r of column c */
+        for (c = 0; c < 4; c++) {
+            for (r = 0; r < 4; r++) {
+                shifted[16 * b + r + 4 * c] = state[16 * b + r + 4 * ((c + r) % 4)];
+            }
+        }
+    }
+    _aes_sub_bytes64(shifted);
+    for (b = 0; b < n; b++) {
+        for (c = 0; c < 4 && !last; c++) { /* MixColumns */
+            unsigned char *col = shifted + 16 * b + 4 * c;
+            a0  = col[0];
+            a1  = col[1];
+            a2  = col[2];
+            a3  = col[3];
+            all = a0 ^ a1 ^ a2 ^ a3;
+            col[0] ^= all ^ _aes_xtime(a0 ^ a1);
+            col[1] ^= all ^ _aes_xtime(a1 ^ a2);
+            col[2] ^= all ^ _aes_xtime(a2 ^ a3);
+            col[3] ^= all ^ _aes_xtime(a3 ^ a0);
+        }
+        for (r = 0; r < 16; r++) {
+            state[16 * b + r] = shifted[16 * b + r] ^ round_keys[b][r];
+        }
+    }
+}
+
+static void
+_aes_key_expand_portable(unsigned char round_keys[][16], const unsigned char *key, int rounds)
+{
+    unsigned char w[4 * (AES_MAX_ROUNDS + 1)][4];
+    unsigned char sub[64];
+    unsigned char temp[4], rcon = 1;
+    int           nk    = rounds == 10 ? 4 : 8;
+    int           total = 4 * (rounds + 1);
+    int           i, k;
+
+    for (i = 0; i < nk; i++) {
+        memcpy(w[i], key + 4 * i, 4);
+    }
+    for (i = nk; i < total; i++) {
+        memcpy(temp, w[i - 1], 4);
+        if (i % nk == 0 || (nk > 6 && i % nk == 4)) {
+            memset(sub, 0, sizeof sub);
+            for (k = 0; k < 4; k++) {
+                sub[k] = i % nk == 0 ? temp[(k + 1) % 4] : temp[k]; /* RotWord only on the first word */
+            }
+            _aes_sub_bytes64(sub);
+            memcpy(temp, sub, 4);
+            if (i % nk == 0) {
+                temp[0] ^= rcon;
+                rcon = _aes_xtime(rcon);
+            }
+        }
+        for (k = 0; k < 4; k++) {
+            w[i][k] = w[i - nk][k] ^ temp[k];
+        }
+    }
+    memcpy(round_keys, w, (size_t) total * 4);
+}
+
+/* n consecutive counter blocks through the rounds, with the same feed forward as COMPUTE_AES_STREAM_ROUNDS */
+static void
+_aes_ctr_blocks_portable(const unsigned char round_keys[][16], int rounds, const unsigned char counter[16],
+                         uint64_t first, size_t n, unsigned char *out)
+{
+    unsigned char        state[64], saved[64];
+    const unsigned char *keys[4];
+    size_t               group, b;
+    int                  i;
+
+    while (n > 0) {
+        group = n < 4 ? n : 4;
+        for (b = 0; b < group; b++) {
+            _aes_counter_add(state + 16 * b, counter, first + b);
+            for (i = 0; i < 16; i++) {
+                state[16 * b + i] ^= round_keys[0][i];
+            }
+        }
+        for (i = 1; i <= rounds; i++) {
+            for (b = 0; b < group; b++) {
+                keys[b] = round_keys[i];
+            }
+            _aes_round_portable(state, keys, group, i == rounds);
+            if (i == rounds / 2 - 1) {
+                memcpy(saved, state, sizeof state);
+            }
+        }
+        for (b = 0; b < 16 * group; b++) {
+            out[b] = state[b] ^ saved[b];
+        }
+        out += 16 * group;
+        first += group;
+        n -= group;
+    }
+}
+
+static void
+_aes_stream_init_portable(_aes_stream_state *_st, const unsigned char seed[AES_STREAM_SEEDBYTES])
+{
+    _aes_key_expand_portable(_st->round_keys, seed, AES_STREAM_ROUNDS);
+#if AES_STREAM_ROUNDS == 10
+    memcpy(_st->counter, seed + 16, 16);
+#else
+    memset(_st->counter, 0, 16);
+#endif
+}
+
+static void
+_aes_stream_portable(_aes_stream_state *_st, unsigned char *buf, size_t buf_len)
+{
+    unsigned char t[64];
+    unsigned char new_key[32];
+    unsigned char rekey_counter[16];
+    size_t        blocks;
+
+    while (buf_len > 0) {
+        blocks = buf_len < sizeof t ? (buf_len + 15) / 16 : sizeof t / 16;
+        _aes_ctr_blocks_portable(_st->round_keys, AES_STREAM_ROUNDS, _st->counter, 0, blocks, t);
+        _aes_counter_add(_st->counter, _st->counter, blocks);
+        memcpy(buf, t, buf_len < 16 * blocks ? buf_len : 16 * blocks);
+        buf += 16 * blocks < buf_len ? 16 * blocks : buf_len;
+        buf_len -= 16 * blocks < buf_len ? 16 * blocks : buf_len;
+    }
+    /* forward secrecy: rekey from the blocks with the top counter bit flipped */
+    memcpy(rekey_counter, _st->counter, 16);
+    rekey_counter[15] ^= 0x80;
+    _aes_ctr_blocks_portable(_st->round_keys, AES_STREAM_ROUNDS, rekey_counter, 0, AES_STREAM_ROUNDS == 10 ? 1 : 2,
+                             new_key);
+    _aes_key_expand_portable(_st->round_keys, new_key, AES_STREAM_ROUNDS);
+}
+
+static void
+_aes_stream_prf_portable(const _aes_stream_state *_st, unsigned long long input, unsigned char *out, size_t out_len)
+{
+    unsigned char counter[16] = { 0 };
+    unsigned char t[64];
+    size_t        blocks, i;
+
+    for (i = 0; i < 8; i++) {
+        counter[8 + i] = (unsigned char) (input >> (8 * i));
+    }
+    for (i = 0; out_len > 0; i += blocks) {
+        blocks = out_len < sizeof t ? (out_len + 15) / 16 : sizeof t / 16;
+        _aes_ctr_blocks_portable(_st->round_keys, AES_STREAM_ROUNDS, counter, i, blocks, t);
+        memcpy(out, t, out_len < 16 * blocks ? out_len : 16 * blocks);
+        out += 16 * blocks < out_len ? 16 * blocks : out_len;
+        out_len -= 16 * blocks < out_len ? 16 * blocks : out_len;
+    }
+}
+
+static void
+_aes_triple_prg_lanes_portable(size_t lanes, const unsigned char *const *seeds, size_t out_len,
+                               unsigned char *const *left, unsigned char *const *middle, unsigned char *const *right)
+{
+    unsigned char round_keys[AES_MAX_ROUNDS + 1][16];
+    unsigned char counter[16] = { 0 };
+    unsigned char t[3 * AES_TRIPLE_PRG_MAX_OUTBYTES + 16];
+    int           rounds = AES_TRIPLE_PRG_ROUNDS(out_len);
+    size_t        j;
+
+    for (j = 0; j < lanes; j++) {
+        _aes_key_expand_portable(round_keys, seeds[j], rounds);
+        if (rounds == 10) {
+            memcpy(counter, seeds[j] + 16, 16);
+        }
+        _aes_ctr_blocks_portable(round_keys, rounds, counter, 0, (3 * out_len + 15) / 16, t);
+        _aes_triple_prg_copy_outputs(j, t, out_len, left, middle, right);
+    }
+}
+
+static const aes_stream_kernels _aes_kernels_portable = {
+    _aes_stream_init_portable, _aes_stream_portable, _aes_stream_prf_portable, _aes_triple_prg_lanes_portable
+};
+
+#if AES_STREAM_X86
+
+/////////////////////////////////////// AES-NI KERNEL ///////////////////////////////////////
+
 #define DRC(ROUND, RC)                                                     \
     do {                                                                   \
         s                 = _mm_aeskeygenassist_si128(t1, (RC));           \
@@ -60,8 +475,8 @@ typedef struct CRYPTO_ALIGN(16) _aes_stream_state {
     } while (0)
 
 #if AES_STREAM_ROUNDS == 10
-static void
-_aes_key_expand_128(__m128i round_keys[AES_STREAM_ROUNDS + 1], __m128i t1)
+static AES_TARGET_AESNI void
+_aes_key_expand_128(__m128i round_keys[10 + 1], __m128i t1)
 {
     __m128i s;
 
@@ -78,10 +493,10 @@ _aes_key_expand_128(__m128i round_keys[AES_STREAM_ROUNDS + 1], __m128i t1)
     round_keys[10] = t1;
 }
 
-#elif AES_STREAM_ROUNDS == 14
+#else
 
-static void
-_aes_key_expand_256(__m128i round_keys[AES_STREAM_ROUNDS + 1], __m128i t1, __m128i t2)
+static AES_TARGET_AESNI void
+_aes_key_expand_256(__m128i round_keys[14 + 1], __m128i t1, __m128i t2)
 {
     __m128i s;
 
@@ -103,19 +518,6 @@ _aes_key_expand_256(__m128i round_keys[AES_STREAM_ROUNDS + 1], __m128i t1, __m12
 }
 #endif
 
-static void
-_aes_stream(_aes_stream_state *_st, unsigned char *buf, size_t buf_len)
-{
-    CRYPTO_ALIGN(16) unsigned char t[16];
-    const __m128i                  one        = _mm_set_epi64x(0, 1);
-    const __m128i                  two        = _mm_set_epi64x(0, 2);
-    __m128i *                      round_keys = _st->round_keys;
-    __m128i                        c0, c1, c2, c3, c4, c5, c6, c7;
-    __m128i                        r0, r1, r2, r3, r4, r5, r6, r7;
-    __m128i                        s0, s1, s2, s3, s4, s5, s6, s7;
-    size_t                         i;
-    size_t                         remaining;
-
 #if AES_STREAM_ROUNDS == 10
 #define COMPUTE_AES_STREAM_ROUNDS(N)                                                        \
     do {                                                                                    \
@@ -146,7 +548,37 @@ _aes_stream(_aes_stream_state *_st, unsigned char *buf, size_t buf_len)
     } while (0)
 #endif
 
-    c0        = _st->counter;
+static AES_TARGET_AESNI void
+_aes_stream_init_aesni(_aes_stream_state *_st, const unsigned char seed[AES_STREAM_SEEDBYTES])
+{
+    __m128i *round_keys = (__m128i *) (void *) _st->round_keys;
+
+#if AES_STREAM_ROUNDS == 10
+    _aes_key_expand_128(round_keys, _mm_loadu_si128((const __m128i *) (const void *) seed));
+    _mm_store_si128((__m128i *) (void *) _st->counter, _mm_loadu_si128((const __m128i *) (const void *) (seed + 16)));
+
+#elif AES_STREAM_ROUNDS == 14
+
+    _aes_key_expand_256(round_keys, _mm_loadu_si128((const __m128i *) (const void *) seed),
+                        _mm_loadu_si128((const __m128i *) (const void *) (seed + 16)));
+    _mm_store_si128((__m128i *) (void *) _st->counter, _mm_setzero_si128());
+#endif
+}
+
+static AES_TARGET_AESNI void
+_aes_stream_aesni(_aes_stream_state *_st, unsigned char *buf, size_t buf_len)
+{
+    CRYPTO_ALIGN(16) unsigned char t[16];
+    const __m128i                  one        = _mm_set_epi64x(0, 1);
+    const __m128i                  two        = _mm_set_epi64x(0, 2);
+    __m128i *                      round_keys = (__m128i *) (void *) _st->round_keys;
+    __m128i                        c0, c1, c2, c3, c4, c5, c6, c7;
+    __m128i                        r0, r1, r2, r3, r4, r5, r6, r7;
+    __m128i                        s0, s1, s2, s3, s4, s5, s6, s7;
+    size_t                         i;
+    size_t                         remaining;
+
+    c0        = _mm_load_si128((const __m128i *) (const void *) _st->counter);
     remaining = buf_len;
     while (remaining > 128) {
         c1 = _mm_add_epi64(c0, one);
@@ -201,7 +633,7 @@ _aes_stream(_aes_stream_state *_st, unsigned char *buf, size_t buf_len)
             buf[i] = t[i];
         }
     }
-    _st->counter = c0;
+    _mm_store_si128((__m128i *) (void *) _st->counter, c0);
 
     c0 = _mm_xor_si128(c0, _mm_set_epi64x(1ULL << 63, 0));
 
@@ -218,27 +650,634 @@ _aes_stream(_aes_stream_state *_st, unsigned char *buf, size_t buf_len)
 #endif
 }
 
+static AES_TARGET_AESNI void
+_aes_stream_prf_aesni(const _aes_stream_state *_st, unsigned long long input, unsigned char *out, size_t out_len)
+{
+    CRYPTO_ALIGN(16) unsigned char t[16];
+    const __m128i                  one        = _mm_set_epi64x(0, 1);
+    const __m128i *                round_keys = (const __m128i *) (const void *) _st->round_keys;
+    __m128i                        c0, c1;
+    __m128i                        r0, r1;
+    __m128i                        s0, s1;
+    size_t                         i;
+
+    c0 = _mm_set_epi64x((long long) input, 0);
+    while (out_len >= 32) {
+        c1 = _mm_add_epi64(c0, one);
+        COMPUTE_AES_STREAM_ROUNDS(0);
+        COMPUTE_AES_STREAM_ROUNDS(1);
+        c0 = _mm_add_epi64(c1, one);
+        _mm_storeu_si128((__m128i *) (void *) (out + 0), r0);
+        _mm_storeu_si128((__m128i *) (void *) (out + 16), r1);
+        out += 32;
+        out_len -= 32;
+    }
+    while (out_len > 0) {
+        COMPUTE_AES_STREAM_ROUNDS(0);
+        c0 = _mm_add_epi64(c0, one);
+        _mm_store_si128((__m128i *) (void *) t, r0);
+        for (i = 0; i < out_len && i < 16; i++) {
+            out[i] = t[i];
+        }
+        out += i;
+        out_len -= i;
+    }
+}
+
+/* Lock-step versions of DRC, DRC1 and DRC2 expanding the key schedules of several lanes at once,
+ * for any vector width W (V128, V256 or V512, each 128 bit lane of a vector being an AES block).
+ * aeskeygenassist has a poor throughput, so SubWord(RotWord(w3)) ^ rcon is computed instead by
+ * broadcasting the (rotated) last word with pshufb and running aesenclast with rcon as round key:
+ * ShiftRows is a no-op on a block whose four columns are equal. */
+#define ROTWORD3_BROADCAST _mm_set_epi8(12, 15, 14, 13, 12, 15, 14, 13, 12, 15, 14, 13, 12, 15, 14, 13)
+#define WORD3_BROADCAST    _mm_set_epi8(15, 14, 13, 12, 15, 14, 13, 12, 15, 14, 13, 12, 15, 14, 13, 12)
+
+#define V128_XOR(A, B)         _mm_xor_si128((A), (B))
+#define V128_BSLLI(A, N)       _mm_slli_si128((A), (N))
+#define V128_SHUFFLE(A, M)     _mm_shuffle_epi8((A), (M))
+#define V128_AESENC(A, K)      _mm_aesenc_si128((A), (K))
+#define V128_AESENCLAST(A, K)  _mm_aesenclast_si128((A), (K))
+#define V128_SET1(X)           _mm_set1_epi32(X)
+#define V128_BROADCAST(A)      (A)
+#define V128_ADD_BLOCK(A, N)   _mm_add_epi64((A), _mm_set_epi64x(0, (long long) (N)))
+
+#define V256_XOR(A, B)         _mm256_xor_si256((A), (B))
+#define V256_BSLLI(A, N)       _mm256_bslli_epi128((A), (N))
+#define V256_SHUFFLE(A, M)     _mm256_shuffle_epi8((A), (M))
+#define V256_AESENC(A, K)      _mm256_aesenc_epi128((A), (K))
+#define V256_AESENCLAST(A, K)  _mm256_aesenclast_epi128((A), (K))
+#define V256_SET1(X)           _mm256_set1_epi32(X)
+#define V256_BROADCAST(A)      _mm256_broadcastsi128_si256(A)
+#define V256_ADD_BLOCK(A, N)   _mm256_add_epi64((A), _mm256_set_epi64x(0, (long long) (N), 0, (long long) (N)))
+
+#define V512_XOR(A, B)         _mm512_xor_si512((A), (B))
+#define V512_BSLLI(A, N)       _mm512_bslli_epi128((A), (N))
+#define V512_SHUFFLE(A, M)     _mm512_shuffle_epi8((A), (M))
+#define V512_AESENC(A, K)      _mm512_aesenc_epi128((A), (K))
+#define V512_AESENCLAST(A, K)  _mm512_aesenclast_epi128((A), (K))
+#define V512_SET1(X)           _mm512_set1_epi32(X)
+#define V512_BROADCAST(A)      _mm512_maskz_broadcast_i32x4(0xffff, (A)) /* the unmasked one warns on GCC 12 */
+#define V512_ADD_BLOCK(A, N)   _mm512_add_epi64((A), _mm512_set_epi64(0, (long long) (N), 0, (long long) (N), \
+                                                                      0, (long long) (N), 0, (long long) (N)))
+
+#define DRC_LANES(W, ROUND, RC)                                                                       \
+    do {                                                                                              \
+        for (j = 0; j < groups; j++) {                                                                \
+            s = W##_AESENCLAST(W##_SHUFFLE(t1[j], W##_BROADCAST(ROTWORD3_BROADCAST)), W##_SET1(RC));  \
+            round_keys[j][ROUND] = t1[j];                                                             \
+            t1[j]                = W##_XOR(t1[j], W##_BSLLI(t1[j], 4));                               \
+            t1[j]                = W##_XOR(t1[j], W##_BSLLI(t1[j], 8));                               \
+            t1[j]                = W##_XOR(t1[j], s);                                                 \
+        }                                                                                             \
+    } while (0)
+
+#define DRC1_LANES(W, ROUND, RC)                                                                      \
+    do {                                                                                              \
+        for (j = 0; j < groups; j++) {                                                                \
+            s = W##_AESENCLAST(W##_SHUFFLE(t2[j], W##_BROADCAST(ROTWORD3_BROADCAST)), W##_SET1(RC));  \
+            round_keys[j][ROUND] = t2[j];                                                             \
+            t1[j]                = W##_XOR(t1[j], W##_BSLLI(t1[j], 4));                               \
+            t1[j]                = W##_XOR(t1[j], W##_BSLLI(t1[j], 8));                               \
+            t1[j]                = W##_XOR(t1[j], s);                                                 \
+        }                                                                                             \
+    } while (0)
+
+#define DRC2_LANES(W, ROUND, RC)                                                                      \
+    do {                                                                                              \
+        for (j = 0; j < groups; j++) {                                                                \
+            s = W##_AESENCLAST(W##_SHUFFLE(t1[j], W##_BROADCAST(WORD3_BROADCAST)), W##_SET1(0));      \
+            round_keys[j][ROUND] = t1[j];                                                             \
+            t2[j]                = W##_XOR(t2[j], W##_BSLLI(t2[j], 4));                               \
+            t2[j]                = W##_XOR(t2[j], W##_BSLLI(t2[j], 8));                               \
+            t2[j]                = W##_XOR(t2[j], s);                                                 \
+        }                                                                                             \
+    } while (0)
+
+/* Expands the AES-128 or AES-256 key schedules of the groups of lanes in t1 (and t2) */
+#define KEY_EXPAND_LANES(W, ROUNDS)                                      \
+    do {                                                                 \
+        if ((ROUNDS) == 10) {                                            \
+            DRC_LANES(W, 0, 1);                                          \
+            DRC_LANES(W, 1, 2);                                          \
+            DRC_LANES(W, 2, 4);                                          \
+            DRC_LANES(W, 3, 8);                                          \
+            DRC_LANES(W, 4, 16);                                         \
+            DRC_LANES(W, 5, 32);                                         \
+            DRC_LANES(W, 6, 64);                                         \
+            DRC_LANES(W, 7, 128);                                        \
+            DRC_LANES(W, 8, 27);                                         \
+            DRC_LANES(W, 9, 54);                                         \
+            for (j = 0; j < groups; j++) {                               \
+                round_keys[j][10] = t1[j];                               \
+            }                                                            \
+        } else {                                                         \
+            for (j = 0; j < groups; j++) {                               \
+                round_keys[j][0] = t1[j];                                \
+            }                                                            \
+            DRC1_LANES(W, 1, 1);                                         \
+            DRC2_LANES(W, 2, 1);                                         \
+            DRC1_LANES(W, 3, 2);                                         \
+            DRC2_LANES(W, 4, 2);                                         \
+            DRC1_LANES(W, 5, 4);                                         \
+            DRC2_LANES(W, 6, 4);                                         \
+            DRC1_LANES(W, 7, 8);                                         \
+            DRC2_LANES(W, 8, 8);                                         \
+            DRC1_LANES(W, 9, 16);                                        \
+            DRC2_LANES(W, 10, 16);                                       \
+            DRC1_LANES(W, 11, 32);                                       \
+            DRC2_LANES(W, 12, 32);                                       \
+            DRC1_LANES(W, 13, 64);                                       \
+            for (j = 0; j < groups; j++) {                               \
+                round_keys[j][14] = t1[j];                               \
+            }                                                            \
+        }                                                                \
+    } while (0)
+
+/* Runs the blocks listed in block_group/block_index through the rounds of their group, interleaved,
+ * with the same feed forward as COMPUTE_AES_STREAM_ROUNDS */
+#define TRIPLE_PRG_ROUNDS_LANES(W, ROUNDS)                                                    \
+    do {                                                                                      \
+        for (k = 0; k < n; k++) {                                                             \
+            r[k] = W##_ADD_BLOCK(counters[block_group[k]], block_index[k]);                   \
+            r[k] = W##_XOR(r[k], round_keys[block_group[k]][0]);                              \
+        }                                                                                     \
+        for (i = 1; i < (ROUNDS); i++) {                                                      \
+            for (k = 0; k < n; k++) {                                                         \
+                r[k] = W##_AESENC(r[k], round_keys[block_group[k]][i]);                       \
+            }                                                                                 \
+            if (i == (ROUNDS) / 2 - 1) {                                                      \
+                for (k = 0; k < n; k++) {                                                     \
+                    f[k] = r[k];                                                              \
+                }                                                                             \
+            }                                                                                 \
+        }                                                                                     \
+        for (k = 0; k < n; k++) {                                                             \
+            r[k] = W##_XOR(f[k], W##_AESENCLAST(r[k], round_keys[block_group[k]][(ROUNDS)])); \
+        }                                                                                     \
+    } while (0)
+
+/* Lists the blocks needed by every group of lanes, the union of the blocks of its lanes */
+#define TRIPLE_PRG_BLOCKS_LANES(LANES_PER_GROUP)                                                     \
+    do {                                                                                             \
+        for (j = 0; j < groups; j++) {                                                               \
+            mask = 0;                                                                                \
+            for (l = j * (LANES_PER_GROUP); l < (j + 1) * (LANES_PER_GROUP) && l < lanes; l++) {     \
+                mask |= _aes_triple_prg_block_mask(l, out_len, left, middle, right);                 \
+            }                                                                                        \
+            for (b = 0; b < 6; b++) {                                                                \
+                if ((mask >> b) & 1) {                                                               \
+                    block_group[n] = j;                                                              \
+                    block_index[n] = b;                                                              \
+                    n++;                                                                             \
+                }                                                                                    \
+            }                                                                                        \
+        }                                                                                            \
+    } while (0)
+
+/* Length tripling PRG on up to AES_TRIPLE_PRG_LANES independent seeds: the key schedules are expanded
+ * in lock-step and every requested block of every lane goes through the AES rounds interleaved */
+static AES_TARGET_AESNI void
+_aes_triple_prg_lanes_aesni(size_t lanes, const unsigned char *const *seeds, size_t out_len,
+                            unsigned char *const *left, unsigned char *const *middle, unsigned char *const *right)
+{
+    CRYPTO_ALIGN(16) unsigned char t[AES_TRIPLE_PRG_LANES][6 * 16];
+    __m128i                        round_keys[AES_TRIPLE_PRG_LANES][AES_MAX_ROUNDS + 1];
+    __m128i                        t1[AES_TRIPLE_PRG_LANES], t2[AES_TRIPLE_PRG_LANES];
+    __m128i                        counters[AES_TRIPLE_PRG_LANES];
+    __m128i                        r[AES_TRIPLE_PRG_LANES * 6], f[AES_TRIPLE_PRG_LANES * 6];
+    __m128i                        s;
+    size_t                         block_group[AES_TRIPLE_PRG_LANES * 6];
+    size_t                         block_index[AES_TRIPLE_PRG_LANES * 6];
+    size_t                         groups = lanes;
+    size_t                         n      = 0;
+    size_t                         i, j, k, l, b;
+    unsigned int                   mask;
+    size_t                         rounds = AES_TRIPLE_PRG_ROUNDS(out_len);
+
+    for (j = 0; j < groups; j++) {
+        t1[j]       = _mm_loadu_si128((const __m128i *) (const void *) seeds[j]);
+        t2[j]       = _mm_loadu_si128((const __m128i *) (const void *) (seeds[j] + 16));
+        counters[j] = rounds == 10 ? t2[j] : _mm_setzero_si128();
+    }
+    KEY_EXPAND_LANES(V128, rounds);
+    TRIPLE_PRG_BLOCKS_LANES(1);
+    TRIPLE_PRG_ROUNDS_LANES(V128, rounds);
+    for (k = 0; k < n; k++) {
+        _mm_store_si128((__m128i *) (void *) (t[block_group[k]] + 16 * block_index[k]), r[k]);
+    }
+    for (j = 0; j < lanes; j++) {
+        _aes_triple_prg_copy_outputs(j, t[j], out_len, left, middle, right);
+    }
+}
+
+static const aes_stream_kernels _aes_kernels_aesni = {
+    _aes_stream_init_aesni, _aes_stream_aesni, _aes_stream_prf_aesni, _aes_triple_prg_lanes_aesni
+};
+
+#if AES_STREAM_VAES
+
+/////////////////////////////////////// VAES 256 BIT KERNEL ///////////////////////////////////////
+
+/* Same rounds as COMPUTE_AES_STREAM_ROUNDS, on vectors of 2 (V256) or 4 (V512) blocks, interleaved */
+#define COMPUTE_AES_STREAM_ROUNDS_4(W)                                           \
+    do {                                                                         \
+        r0 = W##_XOR(c0, rk[0]);                                                 \
+        r1 = W##_XOR(c1, rk[0]);                                                 \
+        r2 = W##_XOR(c2, rk[0]);                                                 \
+        r3 = W##_XOR(c3, rk[0]);                                                 \
+        for (i = 1; i < AES_STREAM_ROUNDS; i++) {                                \
+            r0 = W##_AESENC(r0, rk[i]);                                          \
+            r1 = W##_AESENC(r1, rk[i]);                                          \
+            r2 = W##_AESENC(r2, rk[i]);                                          \
+            r3 = W##_AESENC(r3, rk[i]);                                          \
+            if (i == AES_STREAM_ROUNDS / 2 - 1) {                                \
+                s0 = r0;                                                         \
+                s1 = r1;                                                         \
+                s2 = r2;                                                         \
+                s3 = r3;                                                         \
+            }                                                                    \
+        }                                                                        \
+        r0 = W##_XOR(s0, W##_AESENCLAST(r0, rk[AES_STREAM_ROUNDS]));             \
+        r1 = W##_XOR(s1, W##_AESENCLAST(r1, rk[AES_STREAM_ROUNDS]));             \
+        r2 = W##_XOR(s2, W##_AESENCLAST(r2, rk[AES_STREAM_ROUNDS]));             \
+        r3 = W##_XOR(s3, W##_AESENCLAST(r3, rk[AES_STREAM_ROUNDS]));             \
+    } while (0)
+
+/* 8 blocks per iteration on 4 ymm registers, the tail and the rekey are left to the AES-NI kernel */
+static AES_TARGET_VAES256 void
+_aes_stream_vaes256(_aes_stream_state *_st, unsigned char *buf, size_t buf_len)
+{
+    const __m128i *round_keys = (const __m128i *) (const void *) _st->round_keys;
+    const __m256i  eight      = _mm256_set_epi64x(0, 8, 0, 8);
+    __m256i        rk[AES_STREAM_ROUNDS + 1];
+    __m256i        c0, c1, c2, c3, r0, r1, r2, r3, s0, s1, s2, s3;
+    __m128i        counter;
+    size_t         i;
+
+    if (buf_len > 128) {
+        counter = _mm_load_si128((const __m128i *) (const void *) _st->counter);
+        for (i = 0; i <= AES_STREAM_ROUNDS; i++) {
+            rk[i] = _mm256_broadcastsi128_si256(round_keys[i]);
+        }
+        c0 = _mm256_add_epi64(_mm256_broadcastsi128_si256(counter), _mm256_set_epi64x(0, 1, 0, 0));
+        c1 = V256_ADD_BLOCK(c0, 2);
+        c2 = V256_ADD_BLOCK(c0, 4);
+        c3 = V256_ADD_BLOCK(c0, 6);
+        while (buf_len > 128) {
+            COMPUTE_AES_STREAM_ROUNDS_4(V256);
+            _mm256_storeu_si256((__m256i *) (void *) (buf + 0), r0);
+            _mm256_storeu_si256((__m256i *) (void *) (buf + 32), r1);
+            _mm256_storeu_si256((__m256i *) (void *) (buf + 64), r2);
+            _mm256_storeu_si256((__m256i *) (void *) (buf + 96), r3);
+            c0 = _mm256_add_epi64(c0, eight);
+            c1 = _mm256_add_epi64(c1, eight);
+            c2 = _mm256_add_epi64(c2, eight);
+            c3 = _mm256_add_epi64(c3, eight);
+            counter = _mm_add_epi64(counter, _mm_set_epi64x(0, 8));
+            buf += 128;
+            buf_len -= 128;
+        }
+        _mm_store_si128((__m128i *) (void *) _st->counter, counter);
+    }
+    _aes_stream_aesni(_st, buf, buf_len);
+}
+
+static AES_TARGET_VAES256 void
+_aes_triple_prg_lanes_vaes256(size_t lanes, const unsigned char *const *seeds, size_t out_len,
+                              unsigned char *const *left, unsigned char *const *middle, unsigned char *const *right)
+{
+    CRYPTO_ALIGN(16) unsigned char t[AES_TRIPLE_PRG_LANES][6 * 16];
+    __m256i                        round_keys[AES_TRIPLE_PRG_LANES / 2][AES_MAX_ROUNDS + 1];
+    __m256i                        t1[AES_TRIPLE_PRG_LANES / 2], t2[AES_TRIPLE_PRG_LANES / 2];
+    __m256i                        counters[AES_TRIPLE_PRG_LANES / 2];
+    __m256i                        r[AES_TRIPLE_PRG_LANES / 2 * 6], f[AES_TRIPLE_PRG_LANES / 2 * 6];
+    __m256i                        s;
+    size_t                         block_group[AES_TRIPLE_PRG_LANES / 2 * 6];
+    size_t                         block_index[AES_TRIPLE_PRG_LANES / 2 * 6];
+    size_t                         groups = (lanes + 1) / 2; /* two lanes per ymm register */
+    size_t                         n      = 0;
+    size_t                         i, j, k, l, b;
+    unsigned int                   mask;
+    size_t                         rounds = AES_TRIPLE_PRG_ROUNDS(out_len);
+
+    for (j = 0; j < groups; j++) {
+        const unsigned char *lo = seeds[2 * j];
+        const unsigned char *hi = seeds[2 * j + 1 < lanes ? 2 * j + 1 : 2 * j]; /* odd lane count: duplicate */
+        t1[j] = _mm256_set_m128i(_mm_loadu_si128((const __m128i *) (const void *) hi),
+                                 _mm_loadu_si128((const __m128i *) (const void *) lo));
+        t2[j] = _mm256_set_m128i(_mm_loadu_si128((const __m128i *) (const void *) (hi + 16)),
+                                 _mm_loadu_si128((const __m128i *) (const void *) (lo + 16)));
+        counters[j] = rounds == 10 ? t2[j] : _mm256_setzero_si256();
+    }
+    KEY_EXPAND_LANES(V256, rounds);
+    TRIPLE_PRG_BLOCKS_LANES(2);
+    TRIPLE_PRG_ROUNDS_LANES(V256, rounds);
+    for (k = 0; k < n; k++) {
+        _mm_store_si128((__m128i *) (void *) (t[2 * block_group[k]] + 16 * block_index[k]),
+                        _mm256_castsi256_si128(r[k]));
+        _mm_store_si128((__m128i *) (void *) (t[2 * block_group[k] + 1] + 16 * block_index[k]),
+                        _mm256_extracti128_si256(r[k], 1));
+    }
+    for (j = 0; j < lanes; j++) {
+        _aes_triple_prg_copy_outputs(j, t[j], out_len, left, middle, right);
+    }
+}
+
+static const aes_stream_kernels _aes_kernels_vaes256 = {
+    _aes_stream_init_aesni, _aes_stream_vaes256, _aes_stream_prf_aesni, _aes_triple_prg_lanes_vaes256
+};
+
+/////////////////////////////////////// VAES 512 BIT KERNEL ///////////////////////////////////////
+
+/* 16 blocks per iteration on 4 zmm registers, the tail and the rekey are left to the AES-NI kernel */
+static AES_TARGET_VAES512 void
+_aes_stream_vaes512(_aes_stream_state *_st, unsigned char *buf, size_t buf_len)
+{
+    const __m128i *round_keys = (const __m128i *) (const void *) _st->round_keys;
+    const __m512i  sixteen    = _mm512_set_epi64(0, 16, 0, 16, 0, 16, 0, 16);
+    __m512i        rk[AES_STREAM_ROUNDS + 1];
+    __m512i        c0, c1, c2, c3, r0, r1, r2, r3, s0, s1, s2, s3;
+    __m128i        counter;
+    size_t         i;
+
+    if (buf_len > 256) {
+        counter = _mm_load_si128((const __m128i *) (const void *) _st->counter);
+        for (i = 0; i <= AES_STREAM_ROUNDS; i++) {
+            rk[i] = V512_BROADCAST(round_keys[i]);
+        }
+        c0 = _mm512_add_epi64(V512_BROADCAST(counter), _mm512_set_epi64(0, 3, 0, 2, 0, 1, 0, 0));
+        c1 = V512_ADD_BLOCK(c0, 4);
+        c2 = V512_ADD_BLOCK(c0, 8);
+        c3 = V512_ADD_BLOCK(c0, 12);
+        while (buf_len > 256) {
+            COMPUTE_AES_STREAM_ROUNDS_4(V512);
+            _mm512_storeu_si512((void *) (buf + 0), r0);
+            _mm512_storeu_si512((void *) (buf + 64), r1);
+            _mm512_storeu_si512((void *) (buf + 128), r2);
+            _mm512_storeu_si512((void *) (buf + 192), r3);
+            c0 = _mm512_add_epi64(c0, sixteen);
+            c1 = _mm512_add_epi64(c1, sixteen);
+            c2 = _mm512_add_epi64(c2, sixteen);
+            c3 = _mm512_add_epi64(c3, sixteen);
+            counter = _mm_add_epi64(counter, _mm_set_epi64x(0, 16));
+            buf += 256;
+            buf_len -= 256;
+        }
+        _mm_store_si128((__m128i *) (void *) _st->counter, counter);
+    }
+    _aes_stream_aesni(_st, buf, buf_len);
+}
+
+static AES_TARGET_VAES512 void
+_aes_triple_prg_lanes_vaes512(size_t lanes, const unsigned char *const *seeds, size_t out_len,
+                              unsigned char *const *left, unsigned char *const *middle, unsigned char *const *right)
+{
+    CRYPTO_ALIGN(16) unsigned char t[AES_TRIPLE_PRG_LANES][6 * 16];
+    __m512i                        round_keys[AES_TRIPLE_PRG_LANES / 4][AES_MAX_ROUNDS + 1];
+    __m512i                        t1[AES_TRIPLE_PRG_LANES / 4], t2[AES_TRIPLE_PRG_LANES / 4];
+    __m512i                        counters[AES_TRIPLE_PRG_LANES / 4];
+    __m512i                        r[AES_TRIPLE_PRG_LANES / 4 * 6], f[AES_TRIPLE_PRG_LANES / 4 * 6];
+    __m512i                        s;
+    __m128i                        lane_seed[4];
+    size_t                         block_group[AES_TRIPLE_PRG_LANES / 4 * 6];
+    size_t                         block_index[AES_TRIPLE_PRG_LANES / 4 * 6];
+    size_t                         groups = (lanes + 3) / 4; /* four lanes per zmm register */
+    size_t                         n      = 0;
+    size_t                         i, j, k, l, b;
+    unsigned int                   mask;
+    size_t                         rounds = AES_TRIPLE_PRG_ROUNDS(out_len);
+
+    for (j = 0; j < groups; j++) {
+        for (i = 0; i < 2; i++) {
+            for (l = 0; l < 4; l++) { /* missing lanes duplicate the first lane of the group */
+                lane_seed[l] = _mm_loadu_si128(
+                    (const __m128i *) (const void *) (seeds[4 * j + l < lanes ? 4 * j + l : 4 * j] + 16 * i));
+            }
+            s = _mm512_inserti32x4(_mm512_castsi128_si512(lane_seed[0]), lane_seed[1], 1);
+            s = _mm512_inserti32x4(s, lane_seed[2], 2);
+            s = _mm512_inserti32x4(s, lane_seed[3], 3);
+            if (i == 0) {
+                t1[j] = s;
+            } else {
+                t2[j] = s;
+            }
+        }
+        counters[j] = rounds == 10 ? t2[j] : _mm512_setzero_si512();
+    }
+    KEY_EXPAND_LANES(V512, rounds);
+    TRIPLE_PRG_BLOCKS_LANES(4);
+    TRIPLE_PRG_ROUNDS_LANES(V512, rounds);
+    for (k = 0; k < n; k++) {
+        _mm_store_si128((__m128i *) (void *) (t[4 * block_group[k]] + 16 * block_index[k]),
+                        _mm512_maskz_extracti32x4_epi32(0xf, r[k], 0));
+        _mm_store_si128((__m128i *) (void *) (t[4 * block_group[k] + 1] + 16 * block_index[k]),
+                        _mm512_maskz_extracti32x4_epi32(0xf, r[k], 1));
+        _mm_store_si128((__m128i *) (void *) (t[4 * block_group[k] + 2] + 16 * block_index[k]),
+                        _mm512_maskz_extracti32x4_epi32(0xf, r[k], 2));
+        _mm_store_si128((__m128i *) (void *) (t[4 * block_group[k] + 3] + 16 * block_index[k]),
+                        _mm512_maskz_extracti32x4_epi32(0xf, r[k], 3));
+    }
+    for (j = 0; j < lanes; j++) {
+        _aes_triple_prg_copy_outputs(j, t[j], out_len, left, middle, right);
+    }
+}
+
+static const aes_stream_kernels _aes_kernels_vaes512 = {
+    _aes_stream_init_aesni, _aes_stream_vaes512, _aes_stream_prf_aesni, _aes_triple_prg_lanes_vaes512
+};
+
+#endif /* AES_STREAM_VAES */
+
+/////////////////////////////////////// CPU FEATURE DETECTION ///////////////////////////////////////
+
+static void
+_aes_cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+    int r[4];
+
+    __cpuidex(r, (int) leaf, (int) subleaf);
+    regs[0] = (unsigned int) r[0];
+    regs[1] = (unsigned int) r[1];
+    regs[2] = (unsigned int) r[2];
+    regs[3] = (unsigned int) r[3];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long
+_aes_xgetbv0(void)
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long) edx << 32) | eax;
+#endif
+}
+
+/* Best implementation supported by both the CPU and the OS (which must save the ymm/zmm registers) */
+static aes_stream_implementation
+_aes_detect_implementation(void)
+{
+    unsigned int       regs[4];
+    unsigned int       max_leaf, leaf1_ecx;
+    unsigned long long xcr0 = 0;
+    int                aesni, ymm_state, zmm_state, avx2, avx512, vaes;
+
+    _aes_cpuid(0, 0, regs);
+    max_leaf = regs[0];
+    if (max_leaf < 1) {
+        return AES_STREAM_IMPL_PORTABLE;
+    }
+    _aes_cpuid(1, 0, regs);
+    leaf1_ecx = regs[2];
+    aesni     = (leaf1_ecx >> 25) & (leaf1_ecx >> 9) & 1; /* AES and SSSE3 */
+    if (!aesni) {
+        return AES_STREAM_IMPL_PORTABLE;
+    }
+    if (((leaf1_ecx >> 27) & (leaf1_ecx >> 28) & 1) != 0) { /* OSXSAVE and AVX */
+        xcr0 = _aes_xgetbv0();
+    }
+    ymm_state = (xcr0 & 0x6) == 0x6;
+    zmm_state = (xcr0 & 0xe6) == 0xe6;
+    if (max_leaf < 7 || !ymm_state || !AES_STREAM_VAES) {
+        return AES_STREAM_IMPL_AESNI;
+    }
+    _aes_cpuid(7, 0, regs);
+    avx2   = (regs[1] >> 5) & 1;
+    avx512 = (regs[1] >> 16) & (regs[1] >> 30) & 1; /* AVX512F and AVX512BW */
+    vaes   = (regs[2] >> 9) & 1;
+    if (!avx2 || !vaes) {
+        return AES_STREAM_IMPL_AESNI;
+    }
+    return avx512 && zmm_state ? AES_STREAM_IMPL_VAES512 : AES_STREAM_IMPL_VAES256;
+}
+
+#endif /* AES_STREAM_X86 */
+
+/////////////////////////////////////// DISPATCH ///////////////////////////////////////
+
+static aes_stream_implementation
+_aes_best_implementation(void)
+{
+#if AES_STREAM_X86
+    static const aes_stream_implementation best = _aes_detect_implementation();
+    return best;
+#else
+    return AES_STREAM_IMPL_PORTABLE;
+#endif
+}
+
+static const aes_stream_kernels *
+_aes_kernels_of(aes_stream_implementation impl)
+{
+    switch (impl) {
+#if AES_STREAM_X86
+    case AES_STREAM_IMPL_AESNI:
+        return &_aes_kernels_aesni;
+# if AES_STREAM_VAES
+    case AES_STREAM_IMPL_VAES256:
+        return &_aes_kernels_vaes256;
+    case AES_STREAM_IMPL_VAES512:
+        return &_aes_kernels_vaes512;
+# endif
+#endif
+    default:
+        return &_aes_kernels_portable;
+    }
+}
+
+static aes_stream_implementation _aes_forced_implementation = AES_STREAM_IMPL_AUTO;
+
+static const aes_stream_kernels *
+_aes_kernels(void)
+{
+    static const aes_stream_kernels *best = _aes_kernels_of(_aes_best_implementation());
+
+    return _aes_forced_implementation == AES_STREAM_IMPL_AUTO ? best
+                                                              : _aes_kernels_of(_aes_forced_implementation);
+}
+
+int
+aes_stream_set_implementation(aes_stream_implementation impl)
+{
+    if (impl != AES_STREAM_IMPL_AUTO && impl != AES_STREAM_IMPL_PORTABLE && impl > _aes_best_implementation()) {
+        return -1; /* not supported on this host */
+    }
+    _aes_forced_implementation = impl;
+    return 0;
+}
+
+aes_stream_implementation
+aes_stream_get_implementation(void)
+{
+    return _aes_forced_implementation == AES_STREAM_IMPL_AUTO ? _aes_best_implementation()
+                                                              : _aes_forced_implementation;
+}
+
+const char *
+aes_stream_implementation_name(aes_stream_implementation impl)
+{
+    switch (impl) {
+    case AES_STREAM_IMPL_PORTABLE:
+        return "portable";
+    case AES_STREAM_IMPL_AESNI:
+        return "aesni";
+    case AES_STREAM_IMPL_VAES256:
+        return "vaes256";
+    case AES_STREAM_IMPL_VAES512:
+        return "vaes512";
+    default:
+        return "auto";
+    }
+}
+
 void
 aes_stream_init(aes_stream_state *st, const unsigned char seed[AES_STREAM_SEEDBYTES])
 {
     _aes_stream_state *_st = (_aes_stream_state *) (void *) st;
 
     COMPILER_ASSERT(sizeof *st >= sizeof *_st);
+    _aes_kernels()->init(_st, seed);
+}
 
-#if AES_STREAM_ROUNDS == 10
-    _aes_key_expand_128(_st->round_keys, _mm_loadu_si128((const __m128i *) (const void *) seed));
-    _st->counter = _mm_loadu_si128((const __m128i *) (const void *) (seed + 16));
+void
+aes_stream(aes_stream_state *st, unsigned char *buf, size_t buf_len)
+{
+    _aes_kernels()->stream((_aes_stream_state *) (void *) st, buf, buf_len);
+}
 
-#elif AES_STREAM_ROUNDS == 14
+void
+aes_triple_prg(const unsigned char seed[AES_STREAM_SEEDBYTES], size_t out_len,
+               unsigned char *left, unsigned char *middle, unsigned char *right)
+{
+    _aes_kernels()->triple_prg_lanes(1, &seed, out_len, &left, &middle, &right);
+}
 
-    _aes_key_expand_256(_st->round_keys, _mm_loadu_si128((const __m128i *) (const void *) seed),
-                        _mm_loadu_si128((const __m128i *) (const void *) (seed + 16)));
-    _st->counter = _mm_setzero_si128();
-#endif
+void
+aes_triple_prg_batch(size_t count, const unsigned char *const *seeds, size_t out_len,
+                     unsigned char *const *left, unsigned char *const *middle, unsigned char *const *right)
+{
+    const aes_stream_kernels *kernels = _aes_kernels();
+    size_t                    lanes;
+
+    while (count > 0) {
+        lanes = count < AES_TRIPLE_PRG_LANES ? count : AES_TRIPLE_PRG_LANES;
+        kernels->triple_prg_lanes(lanes, seeds, out_len, left, middle, right);
+        seeds += lanes;
+        left   = left != NULL ? left + lanes : NULL;
+        middle = middle != NULL ? middle + lanes : NULL;
+        right  = right != NULL ? right + lanes : NULL;
+        count -= lanes;
+    }
 }
 
 void
-aes_stream(aes_stream_state *st, unsigned char *buf, size_t buf_len)
+aes_stream_prf(const aes_stream_state *st, unsigned long long input, unsigned char *out, size_t out_len)
 {
-    _aes_stream((_aes_stream_state *) (void *) st, buf, buf_len);
+    _aes_kernels()->prf((const _aes_stream_state *) (const void *) st, input, out, out_len);
 }
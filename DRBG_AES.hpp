@@ -26,4 +26,49 @@ void aes_stream_init(aes_stream_state *st,
 
 void aes_stream(aes_stream_state *st, unsigned char *buf, size_t buf_len);
 
+/* Keyed PRF over a 64 bit input: out = AES stream blocks with counters (input, 0), (input, 1)...
+ * The state is only read (no counter update and no rekey), so the same state evaluates any number of inputs. */
+void aes_stream_prf(const aes_stream_state *st, unsigned long long input,
+                    unsigned char *out, size_t out_len);
+
+/* One-shot length tripling PRG: expands a seed into 3 * out_len bytes of AES-CTR output (with the
+ * aes_stream feed forward), split in a left, middle and right output of out_len bytes each
+ * (out_len <= AES_TRIPLE_PRG_MAX_OUTBYTES). 128 bit outputs use AES-128 keyed with seed[0..15] and
+ * seed[16..31] as initial counter, longer outputs use AES-256 keyed with the whole seed and a zero
+ * counter, which is what aes_stream produces after aes_stream_init with AES_STREAM_ROUNDS 14.
+ * Only the AES blocks covering the non NULL outputs are computed, in a single interleaved pass, and
+ * there is no final rekey since the state is discarded. Outputs may alias the seed. */
+#define AES_TRIPLE_PRG_MAX_OUTBYTES 32
+
+void aes_triple_prg(const unsigned char seed[AES_STREAM_SEEDBYTES], size_t out_len,
+                    unsigned char *left, unsigned char *middle, unsigned char *right);
+
+/* Multi-buffer aes_triple_prg: expands count independent seeds, advancing up to AES_TRIPLE_PRG_LANES
+ * of them in lock-step so the AES unit always has independent blocks in flight. left, middle and right
+ * are arrays of count output pointers; a whole array or any of its entries may be NULL to skip it. */
+#define AES_TRIPLE_PRG_LANES 8
+
+void aes_triple_prg_batch(size_t count, const unsigned char *const *seeds, size_t out_len,
+                          unsigned char *const *left, unsigned char *const *middle,
+                          unsigned char *const *right);
+
+/* Kernels selectable at runtime. AUTO uses the best one supported by the CPU (detected once with
+ * CPUID); PORTABLE is a constant-time bitsliced implementation needing no AES instruction. Every
+ * implementation produces exactly the same output. */
+typedef enum aes_stream_implementation {
+    AES_STREAM_IMPL_AUTO = 0,
+    AES_STREAM_IMPL_PORTABLE,
+    AES_STREAM_IMPL_AESNI,
+    AES_STREAM_IMPL_VAES256,
+    AES_STREAM_IMPL_VAES512
+} aes_stream_implementation;
+
+/* Forces an implementation (not thread safe, meant for start up and testing).
+ * Returns -1 and changes nothing if the host does not support it. */
+int aes_stream_set_implementation(aes_stream_implementation impl);
+
+aes_stream_implementation aes_stream_get_implementation(void);
+
+const char *aes_stream_implementation_name(aes_stream_implementation impl);
+
 #endif
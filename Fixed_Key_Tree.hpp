@@ -0,0 +1,312 @@
+/**
+ * @file Fixed_Key_Tree.hpp
+ * @brief File containing the BES schemes specialized for a depth and key length fixed at compile time.
+ *
+ * A deployment using a single (depth, key length) pair instantiates Fixed_CSM_scheme or Fixed_SDM_scheme: the sizes of the
+ * tree and of the key packages are constant expressions, the keys are std::array values and the paths are stack arrays
+ * sized by the depth, so the compiler unrolls the per user loops. Everything else is the runtime scheme they derive from.
+ * The runtime scheme is a protected base and only its operations that keep the geometry are exported: trees are read or
+ * mapped through the fixed scheme, which rejects files of another depth or key length before changing anything.
+ */
+#ifndef FIXED_KEY_TREE_H
+#define FIXED_KEY_TREE_H
+
+#include "BES_CSM.hpp"
+#include "BES_SDM.hpp"
+
+#include <array>
+#include <stdexcept>
+
+/**
+ * @brief Node key of a fixed key length.
+ *
+ * @tparam Key_bits Length of the key in bits.
+ */
+template <size_t Key_bits>
+using Fixed_key = array<uint8_t, Key_bits / 8>;
+
+/**
+ * @brief Sizes and index arithmetic of a complete binary tree of a fixed depth and key length.
+ *
+ * @tparam Depth Depth of the tree.
+ * @tparam Key_bits Length of the node keys in bits.
+ */
+template <size_t Depth, size_t Key_bits>
+struct Fixed_tree_geometry {
+    static_assert(Depth <= max_tree_depth, "Invalid depth for the BES tree");
+    static_assert(Key_bits == 128 || Key_bits == 192 || Key_bits == 256, "Invalid key_size for the BES tree");
+
+    static constexpr size_t depth = Depth;
+    static constexpr size_t key_length = Key_bits;
+    static constexpr size_t key_bytes = Key_bits / 8;
+    static constexpr size_t number_of_users = static_cast<size_t>(1) << Depth;
+    static constexpr size_t number_of_nodes = (static_cast<size_t>(1) << (Depth + 1)) - 1;
+
+    /**
+     * @brief Index of the leaf of a user.
+     */
+    static constexpr unsigned int leaf_index(unsigned int userID) {
+        return static_cast<unsigned int>(number_of_users - 1) + userID;
+    }
+};
+
+/**
+ * @class Fixed_CSM_scheme
+ * @brief Complete Subtree scheme of a fixed depth and key length.
+ *
+ * @tparam Depth Depth of the tree.
+ * @tparam Key_bits Length of the node keys in bits.
+ */
+template <size_t Depth, size_t Key_bits>
+class Fixed_CSM_scheme : protected BES_CSM_scheme {
+public:
+    typedef BES_CSM_scheme::Key_id Key_id;
+    typedef Fixed_tree_geometry<Depth, Key_bits> Geometry;
+    typedef Fixed_key<Key_bits> Key;
+
+    /**
+     * @brief Number of keys of a user, one per node of the path from the root to its leaf.
+     */
+    static constexpr size_t user_key_count = Depth + 1;
+
+    typedef array<Key_id, user_key_count> User_key_ids;
+    typedef array<Key, user_key_count> User_keys;
+
+    /**
+     * @brief Constructor for a Complete Subtree scheme of Depth and Key_bits.
+     *
+     * @param key_generation_threads Number of threads used to generate the node keys (0 uses all the hardware threads).
+     * @param storage Whether the node keys are stored (default) or derived on demand from a master secret.
+     */
+    explicit Fixed_CSM_scheme(unsigned int key_generation_threads = 1, Key_storage storage = Stored_keys)
+        : BES_CSM_scheme(Depth, Key_bits, key_generation_threads, storage) {
+        fixed_geometry = true;
+    }
+
+    // the operations of the runtime scheme, all of them keep the depth and key length
+    using BES_CSM_scheme::denegate_user;
+    using BES_CSM_scheme::denegate_users;
+    using BES_CSM_scheme::denegate_range;
+    using BES_CSM_scheme::reinstate_user;
+    using BES_CSM_scheme::reinstate_users;
+    using BES_CSM_scheme::get_user_keys;
+    using BES_CSM_scheme::read_user_keys;
+    using BES_CSM_scheme::get_user_key_count;
+    using BES_CSM_scheme::provision_range;
+    using BES_CSM_scheme::provision_all;
+    using BES_CSM_scheme::get_allowed_keys;
+    using BES_CSM_scheme::get_cover_size_bound;
+    using Keytree::get_node_key;
+    using Keytree::copy_node_key;
+    using Keytree::read_node_key;
+    using Keytree::set_key_cache_capacity;
+    using Keytree::is_mapped;
+    using Keytree::get_key_storage;
+    using Keytree::set_io_buffer_size;
+    using Keytree::get_io_buffer_size;
+    using Keytree::get_numberof_nodes;
+    using Keytree::print_KeyTree_info;
+    using Keytree::get_numberof_users;
+    using Keytree::get_revoked_users;
+    using Keytree::get_key_length;
+    using Keytree::get_depth;
+
+    /**
+     * @brief Writes the tree as the runtime scheme does, a runtime scheme of any depth can read it.
+     */
+    friend ostream& operator << (ostream& os, const Fixed_CSM_scheme& obj) {
+        return os << static_cast<const BES_CSM_scheme&>(obj);
+    }
+
+    /**
+     * @brief Reads a tree as the runtime scheme does. A tree of another depth or key length sets the failbit of is and leaves
+     * the scheme unchanged.
+     */
+    friend istream& operator >> (istream& is, Fixed_CSM_scheme& obj) {
+        return is >> static_cast<BES_CSM_scheme&>(obj);
+    }
+
+    /**
+     * @brief Uses the node keys of a tree file through a memory mapping, as the runtime map_file.
+     *
+     * @throws runtime_error if the file can not be mapped, is not a valid tree or has another depth or key length.
+     */
+    void map_file(const string& path, Map_mode mode = Map_read_only) {
+        BES_CSM_scheme::map_file(path, mode);
+    }
+
+    /**
+     * @brief Gets the keys of a user without modifying the scheme, as the runtime read_user_keys.
+     *
+     * @param userID The ID of the user.
+     * @param user_keys_id Array to store the node key IDs, from the root to the leaf.
+     * @param user_keys Array to store the keys.
+     * @return 1 if the keys are retrieved successfully, -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid.
+     */
+    int read_user_keys(unsigned int userID, User_key_ids& user_keys_id, User_keys& user_keys) const {
+        if (userID >= Geometry::number_of_users) {
+            throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+            return -1;
+        }
+        unsigned int key_index = Geometry::leaf_index(userID);
+
+        for (size_t i = user_key_count; i-- > 0;) {
+            user_keys_id[i] = key_index;
+            read_node_key_fixed<Geometry::key_bytes>(key_index, user_keys[i].data());
+            key_index = get_father_index(key_index);
+        }
+        return 1;
+    }
+
+    /**
+     * @brief Gets the allowed keys into caller arrays, as the runtime get_allowed_keys into caller buffers.
+     *
+     * @param node_key_ID Array of capacity entries to store the node key IDs.
+     * @param user_keys Array of capacity keys.
+     * @param capacity Number of entries of the arrays.
+     * @return The size of the cover, only the first capacity entries are stored if it is larger.
+     */
+    size_t get_allowed_keys(Key_id* node_key_ID, Key* user_keys, size_t capacity) {
+        static_assert(sizeof(Key) == Geometry::key_bytes, "the keys must be packed");
+        return BES_CSM_scheme::get_allowed_keys(node_key_ID, reinterpret_cast<uint8_t*>(user_keys), capacity);
+    }
+};
+
+/**
+ * @class Fixed_SDM_scheme
+ * @brief Subset Difference scheme of a fixed depth and key length.
+ *
+ * @tparam Depth Depth of the tree.
+ * @tparam Key_bits Length of the node keys in bits.
+ */
+template <size_t Depth, size_t Key_bits>
+class Fixed_SDM_scheme : protected BES_SDM_scheme {
+public:
+    typedef BES_SDM_scheme::Key_id Key_id;
+    typedef Fixed_tree_geometry<Depth, Key_bits> Geometry;
+    typedef Fixed_key<Key_bits> Key;
+
+    /**
+     * @brief Number of labels of a user, one per node below each ancestor of its leaf and off its path.
+     */
+    static constexpr size_t user_key_count = Depth * (Depth + 1) / 2;
+
+    typedef array<Key_id, user_key_count> User_key_ids;
+    typedef array<Key, user_key_count> User_keys;
+
+    /**
+     * @brief Constructor for a Subset Difference scheme of Depth and Key_bits.
+     *
+     * @param key_generation_threads Number of threads used to generate the node keys (0 uses all the hardware threads).
+     * @param storage Whether the node keys are stored (default) or derived on demand from a master secret.
+     */
+    explicit Fixed_SDM_scheme(unsigned int key_generation_threads = 1, Key_storage storage = Stored_keys)
+        : BES_SDM_scheme(Depth, Key_bits, key_generation_threads, storage) {
+        fixed_geometry = true;
+    }
+
+    // the operations of the runtime scheme, all of them keep the depth and key length
+    using BES_SDM_scheme::denegate_user;
+    using BES_SDM_scheme::denegate_users;
+    using BES_SDM_scheme::denegate_range;
+    using BES_SDM_scheme::reinstate_user;
+    using BES_SDM_scheme::reinstate_users;
+    using BES_SDM_scheme::get_user_labels;
+    using BES_SDM_scheme::set_label_cache_capacity;
+    using BES_SDM_scheme::get_label_cache_stats;
+    using BES_SDM_scheme::reset_label_cache_stats;
+    using BES_SDM_scheme::read_user_keys;
+    using BES_SDM_scheme::get_user_key_count;
+    using BES_SDM_scheme::provision_range;
+    using BES_SDM_scheme::provision_all;
+    using BES_SDM_scheme::get_allowed_keys;
+    using BES_SDM_scheme::get_cover_size_bound;
+    using BES_SDM_scheme::set_cover_method;
+    using BES_SDM_scheme::get_cover_method;
+    using BES_SDM_scheme::set_cover_threads;
+    using BES_SDM_scheme::get_cover_threads;
+    using BES_SDM_scheme::get_cover_delta;
+    using Keytree::get_node_key;
+    using Keytree::copy_node_key;
+    using Keytree::read_node_key;
+    using Keytree::set_key_cache_capacity;
+    using Keytree::is_mapped;
+    using Keytree::get_key_storage;
+    using Keytree::set_io_buffer_size;
+    using Keytree::get_io_buffer_size;
+    using Keytree::get_numberof_nodes;
+    using Keytree::print_KeyTree_info;
+    using Keytree::get_numberof_users;
+    using Keytree::get_revoked_users;
+    using Keytree::get_key_length;
+    using Keytree::get_depth;
+
+    /**
+     * @brief Writes the tree as the runtime scheme does, a runtime scheme of any depth can read it.
+     */
+    friend ostream& operator << (ostream& os, const Fixed_SDM_scheme& obj) {
+        return os << static_cast<const BES_SDM_scheme&>(obj);
+    }
+
+    /**
+     * @brief Reads a tree as the runtime scheme does. A tree of another depth or key length sets the failbit of is and leaves
+     * the scheme unchanged.
+     */
+    friend istream& operator >> (istream& is, Fixed_SDM_scheme& obj) {
+        return is >> static_cast<BES_SDM_scheme&>(obj);
+    }
+
+    /**
+     * @brief Uses the node keys of a tree file through a memory mapping, as the runtime map_file.
+     *
+     * @throws runtime_error if the file can not be mapped, is not a valid tree or has another depth or key length.
+     */
+    void map_file(const string& path, Map_mode mode = Map_read_only) {
+        BES_SDM_scheme::map_file(path, mode);
+    }
+
+    /**
+     * @brief Gets the labels of a user without modifying the scheme, as the runtime read_user_keys.
+     *
+     * @param userID The ID of the user.
+     * @param user_labels_id Array to store the subset IDs of the labels.
+     * @param user_labels Array to store the labels.
+     * @return 1 if the labels are retrieved successfully, -1 if the user ID is invalid.
+     * @throws invalid_argument if the user ID is invalid.
+     */
+    int read_user_keys(unsigned int userID, User_key_ids& user_labels_id, User_keys& user_labels) const {
+        if (userID >= Geometry::number_of_users) {
+            throw invalid_argument("Invalid User Index"); // Throws an exception if the user ID is invalid
+            return -1;
+        }
+        uint8_t ancestor_keys[Depth + 1][AES_STREAM_SEEDBYTES] = {}; // zero padded for short keys, one extra so Depth 0 compiles
+        uint8_t* labels[user_key_count + 1];
+        unsigned int user_node_index = Geometry::leaf_index(userID);
+
+        for (size_t chain = 0; chain < Depth; chain++) {
+            read_node_key_fixed<Geometry::key_bytes>(get_ancestor_index(user_node_index, chain + 1), ancestor_keys[chain]);
+        }
+        for (size_t i = 0; i < user_key_count; i++) {
+            labels[i] = user_labels[i].data();
+        }
+        BES_METRIC_ADD(Metric_sdm_user_labels_calls, 1);
+        derive_user_labels_fixed<Geometry::key_bytes>(userID, ancestor_keys, user_labels_id.data(), labels);
+        return 1;
+    }
+
+    /**
+     * @brief Gets the allowed keys into caller arrays, as the runtime get_allowed_keys into caller buffers.
+     *
+     * @param user_keys_id Array of capacity entries to store the subset IDs.
+     * @param user_keys Array of capacity keys.
+     * @param capacity Number of entries of the arrays.
+     * @return The size of the cover, only the first capacity entries are stored if it is larger.
+     */
+    size_t get_allowed_keys(Key_id* user_keys_id, Key* user_keys, size_t capacity) {
+        static_assert(sizeof(Key) == Geometry::key_bytes, "the keys must be packed");
+        return BES_SDM_scheme::get_allowed_keys(user_keys_id, reinterpret_cast<uint8_t*>(user_keys), capacity);
+    }
+};
+
+#endif
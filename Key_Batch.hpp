@@ -0,0 +1,159 @@
+#ifndef KEY_BATCH_H
+#define KEY_BATCH_H
+
+/**
+ * @file Key_Batch.hpp
+ * @brief File containing a reusable output buffer for the keys returned by the BES schemes.
+ * The IDs and the keys are packed in two contiguous arrays owned by the batch, so filling it again
+ * reuses the same memory and no buffer has to be freed by the caller.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+using namespace std;
+
+/**
+ * @class Key_batch
+ * @brief Move-only batch of keys, the ID of entry i is ids()[i] and its key the key_length() bytes at keys() + i * key_length().
+ *
+ * @tparam Key_id Type of the key IDs (node index for CSM, Key_subset for SDM).
+ */
+template <typename Key_id>
+class Key_batch {
+private:
+    unique_ptr<Key_id[]> key_ids;   ///< IDs of the entries, id_capacity slots.
+    unique_ptr<uint8_t[]> key_bytes; ///< Keys of the entries packed one after the other, key_bytes_capacity bytes.
+    size_t key_length_bytes;         ///< Length of each key in bytes.
+    size_t count;                    ///< Number of entries in the batch.
+    size_t id_capacity;
+    size_t key_bytes_capacity;
+
+public:
+    /**
+     * @brief Constructor for an empty batch, the schemes set the key length when they fill it.
+     */
+    Key_batch() : key_length_bytes(0), count(0), id_capacity(0), key_bytes_capacity(0) {}
+
+    /**
+     * @brief Constructor for an empty batch with memory for some entries.
+     *
+     * @param key_length Length of each key in bytes.
+     * @param capacity Number of entries to allocate memory for.
+     */
+    Key_batch(size_t key_length, size_t capacity) : Key_batch() {
+        reset(key_length);
+        reserve(capacity);
+    }
+
+    /**
+     * @brief The memory is owned by the batch, so batches can only be moved.
+     */
+    Key_batch(const Key_batch&) = delete;
+    Key_batch& operator=(const Key_batch&) = delete;
+
+    Key_batch(Key_batch&& other) noexcept : Key_batch() {
+        swap(other);
+    }
+
+    Key_batch& operator=(Key_batch&& other) noexcept {
+        Key_batch moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+
+    void swap(Key_batch& other) noexcept {
+        key_ids.swap(other.key_ids);
+        key_bytes.swap(other.key_bytes);
+        std::swap(key_length_bytes, other.key_length_bytes);
+        std::swap(count, other.count);
+        std::swap(id_capacity, other.id_capacity);
+        std::swap(key_bytes_capacity, other.key_bytes_capacity);
+    }
+
+    /**
+     * @brief Empties the batch and sets the length of its keys, the memory is kept for the next entries.
+     *
+     * @param key_length Length of each key in bytes.
+     */
+    void reset(size_t key_length) {
+        count = 0;
+        key_length_bytes = key_length;
+    }
+
+    /**
+     * @brief Makes sure the batch holds some entries without allocating memory, keeping the current entries.
+     *
+     * @param capacity Number of entries.
+     */
+    void reserve(size_t capacity) {
+        if (capacity > id_capacity) {
+            unique_ptr<Key_id[]> ids_grown(new Key_id[capacity]);
+            copy(key_ids.get(), key_ids.get() + count, ids_grown.get());
+            key_ids.swap(ids_grown);
+            id_capacity = capacity;
+        }
+        if (capacity * key_length_bytes > key_bytes_capacity) {
+            unique_ptr<uint8_t[]> keys_grown(new uint8_t[capacity * key_length_bytes]);
+            if (count > 0)
+                memcpy(keys_grown.get(), key_bytes.get(), count * key_length_bytes);
+            key_bytes.swap(keys_grown);
+            key_bytes_capacity = capacity * key_length_bytes;
+        }
+    }
+
+    /**
+     * @brief Sets the number of entries, the new ones are uninitialized until they are written through ids() and keys().
+     *
+     * @param new_count Number of entries.
+     */
+    void resize(size_t new_count) {
+        reserve(new_count);
+        count = new_count;
+    }
+
+    /**
+     * @brief Appends an entry, growing the batch geometrically if it is full.
+     *
+     * @param id The ID of the entry.
+     * @return Pointer to the key_length() bytes where the key of the entry must be written.
+     */
+    uint8_t* append(const Key_id& id) {
+        if (count == capacity()) {
+            reserve(count < 8 ? 16 : 2 * count);
+        }
+        key_ids[count] = id;
+        return key_bytes.get() + count++ * key_length_bytes;
+    }
+
+    /**
+     * @brief Empties the batch, the memory is kept for the next entries.
+     */
+    void clear() { count = 0; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t key_length() const { return key_length_bytes; }
+
+    /**
+     * @brief Number of entries the batch holds without allocating memory.
+     */
+    size_t capacity() const {
+        return key_length_bytes == 0 ? id_capacity : min(id_capacity, key_bytes_capacity / key_length_bytes);
+    }
+
+    const Key_id& id(size_t index) const { return key_ids[index]; }
+    uint8_t* key(size_t index) { return key_bytes.get() + index * key_length_bytes; }
+    const uint8_t* key(size_t index) const { return key_bytes.get() + index * key_length_bytes; }
+
+    Key_id* ids() { return key_ids.get(); }
+    const Key_id* ids() const { return key_ids.get(); }
+    uint8_t* keys() { return key_bytes.get(); }
+    const uint8_t* keys() const { return key_bytes.get(); }
+};
+
+#endif // KEY_BATCH_H
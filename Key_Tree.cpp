@@ -1,4 +1,16 @@
 #include "Key_Tree.hpp"
+#include "DRBG_AES.hpp"
+
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 ////////////////////////////////////// AUXILIARY FUNCTIONS ////////////////////////////////////////////////
 
@@ -15,6 +27,26 @@ void Fill_With_Random(uint8_t* buffer, size_t size) {
     }
 }
 
+#elif defined(__linux__)
+// If compiling on Linux, use the getrandom system call, which does not need a file descriptor
+#include <sys/random.h>
+#include <cerrno>
+
+// Function to fill a buffer with random bytes using getrandom
+void Fill_With_Random(uint8_t* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t result = getrandom(buffer, size, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue; // interrupted before any byte was read, try again
+            }
+            throw runtime_error("Error reading random bytes with getrandom");
+        }
+        buffer += result; // large requests may be served partially
+        size -= result;
+    }
+}
+
 #else
 // If compiling on a Unix-like system, include necessary headers for random number generation
 #include <fcntl.h>
@@ -37,6 +69,64 @@ void Fill_With_Random(uint8_t* buffer, size_t size) {
 }
 #endif
 
+// Function to fill a buffer with keys expanded from a single OS seed through the AES DRBG
+void Fill_With_DRBG(uint8_t* buffer, size_t size, unsigned int threads) {
+    const size_t range_alignment = 64; // each range starts on a cache line
+    uint8_t seed[AES_STREAM_SEEDBYTES];
+    aes_stream_state master_drbg;
+
+    Fill_With_Random(seed, sizeof seed); // the only read of OS entropy
+    aes_stream_init(&master_drbg, seed);
+
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    // split the buffer in one range per thread, each range expanded by a DRBG seeded from the master DRBG
+    size_t range_size = (size / threads + range_alignment - 1) / range_alignment * range_alignment;
+    if (range_size == 0) {
+        range_size = range_alignment;
+    }
+    size_t ranges = (size + range_size - 1) / range_size;
+    vector<uint8_t> range_seeds(ranges * AES_STREAM_SEEDBYTES);
+    aes_stream(&master_drbg, range_seeds.data(), range_seeds.size());
+
+    parallel_for(ranges, threads, [&](size_t range) {
+        aes_stream_state range_drbg;
+        size_t offset = range * range_size;
+        aes_stream_init(&range_drbg, range_seeds.data() + range * AES_STREAM_SEEDBYTES);
+        aes_stream(&range_drbg, buffer + offset, min(range_size, size - offset));
+    });
+    BES_METRIC_ADD(Metric_aes_blocks, aes_output_blocks(size));
+}
+
+// Function to run independent tasks on a pool of threads with dynamic scheduling
+void parallel_for(size_t tasks, unsigned int threads, const function<void(size_t)>& task) {
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    if (threads == 1 || tasks <= 1) {
+        for (size_t i = 0; i < tasks; i++) {
+            task(i); // no need for threads, run the tasks in order
+        }
+        return;
+    }
+    atomic<size_t> next_task(0);
+    auto worker = [&]() {
+        for (size_t i = next_task++; i < tasks; i = next_task++) {
+            task(i);
+        }
+    };
+    vector<thread> pool;
+    size_t pool_size = min(static_cast<size_t>(threads), tasks) - 1; // the calling thread also works
+    for (size_t i = 0; i < pool_size; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (thread& t : pool) {
+        t.join();
+    }
+}
+
 // Function to print a buffer in hexadecimal format
 void printHex(const uint8_t* array, std::size_t size) {
     for (size_t i = 0; i < size; ++i) {
@@ -46,46 +136,484 @@ void printHex(const uint8_t* array, std::size_t size) {
     cout << dec << endl; // Switch back to decimal format and end the line
 }
 
+////////////////////////////////////// PROTECTED METHODS ////////////////////////////////////////////////
+
+// Allocates the contiguous key arena, aligned to a cache line and rounded up to a whole number of lines
+uint8_t* Keytree::allocate_key_arena(size_t nodes, size_t key_length_bytes) {
+    size_t arena_size = nodes * key_length_bytes;
+    arena_size = (arena_size + key_arena_alignment - 1) / key_arena_alignment * key_arena_alignment;
+    return static_cast<uint8_t*>(::operator new[](arena_size, align_val_t(key_arena_alignment)));
+}
+
+// Frees a key arena allocated with allocate_key_arena
+void Keytree::free_key_arena(uint8_t* arena) {
+    if (arena != nullptr) {
+        ::operator delete[](arena, align_val_t(key_arena_alignment));
+    }
+}
+
+// Derives a node key as PRF(master_secret, index), keeping the most recently used keys in the cache
+void Keytree::derive_node_key(unsigned int index, uint8_t* key_out) {
+    size_t key_length_bytes = Key_length / 8;
+    auto cached = key_cache_index.find(index);
+    if (cached != key_cache_index.end()) {
+        key_cache_lru.splice(key_cache_lru.begin(), key_cache_lru, cached->second.first); // move to the front of the LRU list
+        memcpy(key_out, key_cache_keys.data() + cached->second.second * key_length_bytes, key_length_bytes);
+        return;
+    }
+    aes_stream_prf(&master_prf, index, key_out, key_length_bytes);
+    BES_METRIC_ADD(Metric_aes_blocks, aes_output_blocks(key_length_bytes));
+    if (key_cache_capacity == 0) {
+        return;
+    }
+    size_t slot;
+    if (key_cache_index.size() < key_cache_capacity) {
+        slot = key_cache_index.size(); // the cache is not full, take the next free slot
+    } else {
+        auto evicted = key_cache_index.find(key_cache_lru.back()); // reuse the slot of the least recently used key
+        slot = evicted->second.second;
+        key_cache_index.erase(evicted);
+        key_cache_lru.pop_back();
+    }
+    key_cache_lru.push_front(index);
+    key_cache_index[index] = make_pair(key_cache_lru.begin(), slot);
+    memcpy(key_cache_keys.data() + slot * key_length_bytes, key_out, key_length_bytes);
+}
+
+// Writes the keys of every node in chunks of io_buffer_size bytes, straight from the arena for stored keys
+void Keytree::write_node_keys(ostream& os) const {
+    size_t key_length_bytes = Key_length / 8;
+    size_t total_bytes = number_of_nodes * key_length_bytes;
+    if (key_storage == Stored_keys) {
+        for (size_t offset = 0; offset < total_bytes && os; offset += io_buffer_size) {
+            os.write(reinterpret_cast<const char*>(FCB_tree) + offset, min(io_buffer_size, total_bytes - offset));
+        }
+        return;
+    }
+    size_t chunk_nodes = max<size_t>(1, io_buffer_size / key_length_bytes);
+    vector<uint8_t> chunk(chunk_nodes * key_length_bytes);
+    for (size_t first = 0; first < number_of_nodes && os; first += chunk_nodes) {
+        size_t nodes = min(chunk_nodes, number_of_nodes - first);
+        for (size_t i = 0; i < nodes; i++) {
+            aes_stream_prf(&master_prf, first + i, chunk.data() + i * key_length_bytes, key_length_bytes); // bypass the cache, it is not const
+        }
+        BES_METRIC_ADD(Metric_aes_blocks, nodes * aes_output_blocks(key_length_bytes));
+        os.write(reinterpret_cast<const char*>(chunk.data()), nodes * key_length_bytes);
+    }
+}
+
+// Writes the header, the allowed users packed in 64 bit words and the key arena
+void Keytree::write_tree(ostream& os, const char* scheme_name) const {
+    BES_METRIC_TIMER(Metric_tree_write_time);
+    Tree_file_header header = {};
+    size_t user_count = allowed_users.size();
+    size_t words = allowed_users.word_count();
+
+    memcpy(header.magic, tree_file_magic, sizeof header.magic);
+    header.version = tree_file_version;
+    header.header_size = sizeof(Tree_file_header);
+    strncpy(header.scheme_name, scheme_name, scheme_name_size - 1);
+    header.depth = depth;
+    header.key_length = Key_length;
+    header.user_count = user_count;
+    header.node_count = number_of_nodes;
+    header.users_offset = sizeof(Tree_file_header);
+    header.users_bytes = words * sizeof(uint64_t);
+    header.keys_offset = (header.users_offset + header.users_bytes + tree_file_key_alignment - 1) / tree_file_key_alignment * tree_file_key_alignment;
+    header.keys_bytes = number_of_nodes * (Key_length / 8);
+    os.write(reinterpret_cast<const char*>(&header), sizeof header);
+
+    // the users are kept in the layout of the file, write their words in chunks straight from the bitset
+    size_t chunk_words = max<size_t>(1, io_buffer_size / sizeof(uint64_t));
+    for (size_t first_word = 0; first_word < words && os; first_word += chunk_words) {
+        os.write(reinterpret_cast<const char*>(allowed_users.words() + first_word), min(chunk_words, words - first_word) * sizeof(uint64_t));
+    }
+    // pad up to the page where the key arena starts
+    const char padding[tree_file_key_alignment] = {};
+    os.write(padding, header.keys_offset - header.users_offset - header.users_bytes);
+    write_node_keys(os);
+    BES_METRIC_ADD(Metric_tree_writes, 1);
+    BES_METRIC_ADD(Metric_tree_write_bytes, header.keys_offset + header.keys_bytes);
+}
+
+// Reads a tree in the versioned format, or in the legacy one if the file starts with the scheme name
+bool Keytree::read_tree(istream& is, const char* scheme_name, bool legacy_node_bits) {
+    BES_METRIC_TIMER(Metric_tree_read_time);
+    Tree_file_header header = {};
+    User_bitset users; // the tree is parsed aside and only replaces this one once it is read whole
+
+    BES_METRIC_ADD(Metric_tree_reads, 1);
+    is.read(header.magic, sizeof header.magic);
+    if (!is) {
+        return false;
+    }
+    if (memcmp(header.magic, tree_file_magic, sizeof header.magic) != 0) {
+        // legacy format: scheme name, depth, key length, allowed users bits, CSM node bits and node keys
+        char legacy_name[scheme_name_size];
+        memcpy(legacy_name, header.magic, sizeof header.magic);
+        is.read(legacy_name + sizeof header.magic, scheme_name_size - sizeof header.magic);
+        if (!is || strncmp(legacy_name, scheme_name, scheme_name_size) != 0) {
+            cerr << "Error: Nombre del esquema incorrecto." << endl;
+            is.setstate(ios::failbit);
+            return false;
+        }
+        size_t legacy_depth, legacy_key_length, user_count;
+        is.read(reinterpret_cast<char*>(&legacy_depth), sizeof legacy_depth); // read the depth of the tree
+        is.read(reinterpret_cast<char*>(&legacy_key_length), sizeof legacy_key_length); // read the Key_length of the tree
+        is.read(reinterpret_cast<char*>(&user_count), sizeof user_count); // read the allowed users vector size
+        if (!is || legacy_depth > max_tree_depth || user_count != (static_cast<size_t>(1) << legacy_depth)
+            || (legacy_key_length != 128 && legacy_key_length != 192 && legacy_key_length != 256)
+            || !accepts_geometry(legacy_depth, legacy_key_length)) {
+            cerr << "Error: Fichero del arbol incorrecto." << endl;
+            is.setstate(ios::failbit);
+            return false;
+        }
+
+        // the users are stored MSB first in bytes, read them all at once and reverse each byte into the words
+        vector<uint8_t> bytes((user_count + 7) / 8);
+        is.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+        vector<uint64_t> words((user_count + 63) / 64, 0);
+        for (size_t i = 0; i < bytes.size(); i++) {
+            uint8_t byte = bytes[i];
+            byte = (byte & 0xF0) >> 4 | (byte & 0x0F) << 4;
+            byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
+            byte = (byte & 0xAA) >> 1 | (byte & 0x55) << 1;
+            words[i / 8] |= static_cast<uint64_t>(byte) << (i % 8 * 8);
+        }
+        users.assign(user_count, false);
+        users.load_words(words.data(), 0, words.size());
+        if (legacy_node_bits) {
+            // the allowed keys follow from the denied users, skip them
+            size_t node_bits;
+            is.read(reinterpret_cast<char*>(&node_bits), sizeof node_bits);
+            is.ignore((node_bits + 7) / 8);
+        }
+        uint8_t* arena = read_node_keys(is, legacy_depth, legacy_key_length);
+        if (arena == nullptr) {
+            return false;
+        }
+        replace_tree(legacy_depth, legacy_key_length, users, arena);
+        return true;
+    }
+
+    is.read(reinterpret_cast<char*>(&header) + sizeof header.magic, sizeof header - sizeof header.magic);
+    if (!is || !check_tree_header(header, scheme_name) || !accepts_geometry(header.depth, header.key_length)) {
+        cerr << "Error: Fichero del arbol incorrecto." << endl;
+        is.setstate(ios::failbit);
+        return false;
+    }
+
+    // sections are read in order, any gap before them is skipped so the stream does not need to be seekable
+    uint64_t position = sizeof header;
+    is.ignore(header.users_offset - position);
+    position = header.users_offset;
+    users.assign(header.user_count, false);
+    vector<uint64_t> chunk(max<size_t>(1, io_buffer_size / sizeof(uint64_t)));
+    size_t words = header.users_bytes / sizeof(uint64_t);
+    for (size_t first_word = 0; first_word < words && is; first_word += chunk.size()) {
+        size_t chunk_words = min(chunk.size(), words - first_word);
+        is.read(reinterpret_cast<char*>(chunk.data()), chunk_words * sizeof(uint64_t));
+        users.load_words(chunk.data(), first_word, chunk_words);
+    }
+    position += header.users_bytes;
+    is.ignore(header.keys_offset - position);
+    uint8_t* arena = read_node_keys(is, header.depth, header.key_length);
+    if (arena == nullptr) {
+        return false;
+    }
+    replace_tree(header.depth, header.key_length, users, arena);
+    BES_METRIC_ADD(Metric_tree_read_bytes, header.keys_offset + header.keys_bytes);
+    return true;
+}
+
+// Checks the scheme, version and sizes of a versioned header
+bool Keytree::check_tree_header(const Tree_file_header& header, const char* scheme_name) {
+    if (memcmp(header.magic, tree_file_magic, sizeof header.magic) != 0 || header.version == 0 || header.version > tree_file_version
+        || header.header_size < sizeof header || strncmp(header.scheme_name, scheme_name, scheme_name_size) != 0) {
+        return false;
+    }
+    return header.depth <= max_tree_depth && header.user_count == (static_cast<uint64_t>(1) << header.depth)
+        && header.node_count == (static_cast<uint64_t>(2) << header.depth) - 1
+        && (header.key_length == 128 || header.key_length == 192 || header.key_length == 256)
+        && header.users_bytes == (header.user_count + 63) / 64 * sizeof(uint64_t)
+        && header.keys_bytes == header.node_count * (header.key_length / 8)
+        && header.users_offset >= header.header_size && header.keys_offset >= header.users_offset + header.users_bytes;
+}
+
+// First level with enough subtrees for every thread
+size_t Keytree::parallel_split_level(unsigned int threads) const {
+    size_t split_level = 0;
+    while (split_level < depth && (static_cast<size_t>(1) << split_level) < threads * parallel_tasks_per_thread) {
+        split_level++;
+    }
+    return split_level;
+}
+
+// Splits the users in the subtrees of the split level
+void Keytree::parallel_user_ranges(size_t first_user, size_t last_user, unsigned int threads, const function<void(size_t, size_t)>& task) const {
+    if (first_user >= last_user) {
+        return;
+    }
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    size_t subtree_users = static_cast<size_t>(1) << (depth - parallel_split_level(threads));
+    size_t first_subtree = first_user / subtree_users;
+    size_t subtrees = (last_user + subtree_users - 1) / subtree_users - first_subtree;
+    parallel_for(subtrees, threads, [&](size_t i) {
+        size_t subtree = first_subtree + i;
+        task(max(first_user, subtree * subtree_users), min(last_user, (subtree + 1) * subtree_users));
+    });
+}
+
+#ifndef _WIN32
+// Maps the whole file, the key arena is used in place and only the allowed users are copied out of it
+void Keytree::map_tree(const string& path, const char* scheme_name, Map_mode mode) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw runtime_error("Error opening the tree file " + path);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < sizeof(Tree_file_header)) {
+        close(fd);
+        throw runtime_error("Invalid tree file " + path);
+    }
+    size_t file_size = file_stat.st_size;
+    // a private mapping is writable without opening the file for writing, the changes never reach the file
+    void* file = mmap(nullptr, file_size, mode == Map_read_only ? PROT_READ : PROT_READ | PROT_WRITE,
+                      mode == Map_read_only ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (file == MAP_FAILED) {
+        throw runtime_error("Error mapping the tree file " + path);
+    }
+    Tree_file_header header;
+    memcpy(&header, file, sizeof header);
+    if (!check_tree_header(header, scheme_name) || header.keys_offset > file_size || header.keys_bytes > file_size - header.keys_offset) {
+        munmap(file, file_size);
+        throw runtime_error("Invalid tree file " + path);
+    }
+    if (!accepts_geometry(header.depth, header.key_length)) {
+        munmap(file, file_size);
+        throw runtime_error("The tree file " + path + " does not have the fixed depth and key length");
+    }
+
+    // the users are read once in order, the node keys are looked up at random so readahead would only waste I/O
+    uint8_t* base = static_cast<uint8_t*>(file);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    madvise(base, header.users_offset + header.users_bytes, MADV_SEQUENTIAL);
+    size_t keys_page = header.keys_offset / page_size * page_size;
+    madvise(base + keys_page, header.keys_offset + header.keys_bytes - keys_page, MADV_RANDOM);
+
+    release_key_arena();
+    depth = header.depth;
+    Key_length = header.key_length;
+    number_of_nodes = header.node_count;
+    allowed_users.assign(header.user_count, false);
+    allowed_users.load_words(reinterpret_cast<const uint64_t*>(base + header.users_offset), 0, header.users_bytes / sizeof(uint64_t));
+    rebuild_revoked_users();
+    mapped_file = file;
+    mapped_file_size = file_size;
+    FCB_tree = base + header.keys_offset;
+    key_storage = Stored_keys; // the keys of the file are stored keys
+    set_key_cache_capacity(key_cache_capacity);
+}
+
+// Frees the key arena or unmaps the file holding it
+void Keytree::release_key_arena() {
+    if (mapped_file != nullptr) {
+        munmap(mapped_file, mapped_file_size);
+        mapped_file = nullptr;
+        mapped_file_size = 0;
+    } else {
+        free_key_arena(FCB_tree);
+    }
+    FCB_tree = nullptr;
+}
+#else
+void Keytree::map_tree(const string& path, const char* scheme_name, Map_mode mode) {
+    throw runtime_error("Memory mapped trees are not supported on Windows, read " + path + " with operator >> instead");
+}
+
+void Keytree::release_key_arena() {
+    free_key_arena(FCB_tree);
+    FCB_tree = nullptr;
+}
+#endif
+
+bool Keytree::mark_user_denied(unsigned int userID) {
+    if (!allowed_users.deny(userID)) {
+        return false; // already denied, nothing to update
+    }
+    revoked_users.insert(lower_bound(revoked_users.begin(), revoked_users.end(), userID), userID); // keep the IDs sorted
+    return true;
+}
+
+void Keytree::mark_users_denied(vector<unsigned int>& userIDs) {
+    for (unsigned int userID : userIDs) {
+        if (userID >= allowed_users.size()) {
+            throw invalid_argument("Invalid User Index"); // validate the whole batch before changing anything
+        }
+    }
+    sort(userIDs.begin(), userIDs.end());
+    userIDs.erase(unique(userIDs.begin(), userIDs.end()), userIDs.end());
+    userIDs.erase(remove_if(userIDs.begin(), userIDs.end(), [this](unsigned int userID) { return !allowed_users[userID]; }), userIDs.end());
+    if (!userIDs.empty() && userIDs.back() - userIDs.front() + 1 == userIDs.size()) {
+        allowed_users.deny_range(userIDs.front(), userIDs.back() + 1); // a run of users, e.g. denegate_range, a word at a time
+    } else {
+        for (unsigned int userID : userIDs) {
+            allowed_users.deny(userID);
+        }
+    }
+    // a single linear merge instead of one sorted insertion per user
+    vector<unsigned int> merged(revoked_users.size() + userIDs.size());
+    merge(revoked_users.begin(), revoked_users.end(), userIDs.begin(), userIDs.end(), merged.begin());
+    revoked_users.swap(merged);
+}
+
+bool Keytree::mark_user_allowed(unsigned int userID) {
+    if (!allowed_users.allow(userID)) {
+        return false; // already allowed, nothing to update
+    }
+    revoked_users.erase(lower_bound(revoked_users.begin(), revoked_users.end(), userID));
+    return true;
+}
+
+void Keytree::mark_users_allowed(vector<unsigned int>& userIDs) {
+    for (unsigned int userID : userIDs) {
+        if (userID >= allowed_users.size()) {
+            throw invalid_argument("Invalid User Index"); // validate the whole batch before changing anything
+        }
+    }
+    sort(userIDs.begin(), userIDs.end());
+    userIDs.erase(unique(userIDs.begin(), userIDs.end()), userIDs.end());
+    userIDs.erase(remove_if(userIDs.begin(), userIDs.end(), [this](unsigned int userID) { return allowed_users[userID]; }), userIDs.end());
+    if (!userIDs.empty() && userIDs.back() - userIDs.front() + 1 == userIDs.size()) {
+        allowed_users.allow_range(userIDs.front(), userIDs.back() + 1);
+    } else {
+        for (unsigned int userID : userIDs) {
+            allowed_users.allow(userID);
+        }
+    }
+    // a single linear pass instead of one sorted erase per user
+    vector<unsigned int> remaining(revoked_users.size() - userIDs.size());
+    set_difference(revoked_users.begin(), revoked_users.end(), userIDs.begin(), userIDs.end(), remaining.begin());
+    revoked_users.swap(remaining);
+}
+
+void Keytree::rebuild_revoked_users() {
+    revoked_users.clear();
+    allowed_users.append_revoked(revoked_users);
+}
+
+// Reads the keys of every node into a new arena, in chunks of io_buffer_size bytes
+uint8_t* Keytree::read_node_keys(istream& is, size_t tree_depth, size_t key_length) const {
+    size_t total_bytes = ((static_cast<size_t>(1) << (tree_depth + 1)) - 1) * (key_length / 8);
+    uint8_t* arena = allocate_key_arena((static_cast<size_t>(1) << (tree_depth + 1)) - 1, key_length / 8);
+    for (size_t offset = 0; offset < total_bytes && is; offset += io_buffer_size) {
+        is.read(reinterpret_cast<char*>(arena) + offset, min(io_buffer_size, total_bytes - offset));
+    }
+    if (!is) {
+        free_key_arena(arena); // the file ends early, the tree is left as it was
+        return nullptr;
+    }
+    return arena;
+}
+
+// Replaces the whole state of the tree with one read from a stream
+void Keytree::replace_tree(size_t tree_depth, size_t key_length, User_bitset& users, uint8_t* arena) {
+    release_key_arena();
+    depth = tree_depth;
+    Key_length = key_length;
+    number_of_nodes = (static_cast<size_t>(1) << (depth + 1)) - 1;
+    allowed_users = std::move(users);
+    rebuild_revoked_users();
+    FCB_tree = arena;
+    key_storage = Stored_keys; // the keys read are stored from now on
+    set_key_cache_capacity(key_cache_capacity);
+}
+
 ////////////////////////////////////// PUBLIC METHODS ////////////////////////////////////////////////
 
 // Constructor for Keytree class
-Keytree::Keytree(size_t Tree_Depth, size_t node_key_length) {
+Keytree::Keytree(size_t Tree_Depth, size_t node_key_length, unsigned int key_generation_threads, Key_storage storage) {
+    if (node_key_length % 8 != 0 || (node_key_length != 256 && node_key_length != 192 && node_key_length != 128))
+        throw invalid_argument("Invalid key_size for the BES tree");
+    if (Tree_Depth > max_tree_depth)
+        throw invalid_argument("Invalid depth for the BES tree");
     this->depth = Tree_Depth; // Set the depth of the tree
-    this->allowed_users.assign(pow(2, depth), true); // Initialize allowed_users with true values
+    this->allowed_users.assign(static_cast<size_t>(1) << depth, true); // Initialize allowed_users with every user allowed
     this->Key_length = node_key_length; // Set the key length
+    this->FCB_tree = nullptr;
+    this->key_storage = storage;
+    this->key_cache_capacity = 0;
+    this->io_buffer_size = default_io_buffer_size;
+    this->mapped_file = nullptr;
+    this->mapped_file_size = 0;
+    this->fixed_geometry = false;
 
-    // Resize the tree vector to represent the complete binary tree and assign random keys to each node
-    this->FCB_tree.resize(pow(2, depth + 1) - 1);
-    if (node_key_length % 8 != 0 || (node_key_length != 256 && node_key_length != 192 && node_key_length != 128))
-        throw invalid_argument("Invalid key_size for the BES tree");
 
-    for (int i = 0; i < this->FCB_tree.size(); i++) {
-        FCB_tree[i] = new uint8_t[node_key_length / 8];
-        Fill_With_Random(FCB_tree[i], node_key_length / 8); // Assign a random value to the key using a cryptographic PRNG
+    this->number_of_nodes = (static_cast<size_t>(1) << (depth + 1)) - 1;
+    // Keep a master secret for derived keys, only the master PRF and a small cache of keys live in memory
+    Fill_With_Random(master_secret, sizeof master_secret);
+    aes_stream_init(&master_prf, master_secret);
+    if (storage == Derived_keys) {
+        set_key_cache_capacity(default_key_cache_capacity);
+        return;
     }
+    // Allocate a single arena representing the complete binary tree and assign random keys to each node
+    this->FCB_tree = allocate_key_arena(number_of_nodes, node_key_length / 8);
+    Fill_With_DRBG(FCB_tree, number_of_nodes * (node_key_length / 8), key_generation_threads); // Expand all the keys from a single OS seed
 }
 
 // Destructor for Keytree class
 Keytree::~Keytree() {
-    // Free all the memory assigned to node keys
-    for (int i = 0; i < this->FCB_tree.size(); i++) {
-        delete[] FCB_tree[i];
-    }
+    // Free the arena with all the node keys at once, or unmap the file holding it
+    release_key_arena();
+}
+
+// Method to resize the LRU cache of derived keys
+void Keytree::set_key_cache_capacity(size_t capacity) {
+    key_cache_capacity = capacity;
+    key_cache_lru.clear();
+    key_cache_index.clear();
+    key_cache_keys.assign(key_storage == Derived_keys ? capacity * (Key_length / 8) : 0, 0);
+}
+
+// Method to set the size of the chunks used to write and read the tree
+void Keytree::set_io_buffer_size(size_t bytes) {
+    if (bytes < 64)
+        throw invalid_argument("Invalid I/O buffer size");
+    io_buffer_size = bytes;
+}
+
+// Method to get the size of the chunks used to write and read the tree
+size_t Keytree::get_io_buffer_size() const {
+    return io_buffer_size;
+}
+
+// Method to get whether the node keys are used from a mapped file
+bool Keytree::is_mapped() const {
+    return mapped_file != nullptr;
+}
+
+// Method to get how the node keys are kept
+Key_storage Keytree::get_key_storage() const {
+    return key_storage;
 }
 
 // Method to print information about the KeyTree
 void Keytree::print_KeyTree_info() {
     cout << "KeyTree defined as: " << endl;
     cout << "The depth of the tree is: " << this->depth << ", and the number of users is: " << this->allowed_users.size() << endl;
-    for (int i = 0; i < this->FCB_tree.size(); i++) {
+    uint8_t node_key[32];
+    for (size_t i = 0; i < this->number_of_nodes; i++) {
         cout << "Node " << i << " with key: ";
-        printHex(FCB_tree[i], this->Key_length / 8); // Print the key of each node in hex format
+        copy_node_key(i, node_key);
+        printHex(node_key, this->Key_length / 8); // Print the key of each node in hex format
     }
     cout << endl << "The users denied are:" << endl;
-    for (int i = 0; i < allowed_users.size(); i++) {
-        if (!allowed_users[i]) {
-            cout << "The user: " << i << " at the leaf node: " << i + allowed_users.size() - 1 << " is denied" << endl;
-        }
+    for (size_t i = allowed_users.find_next_revoked(0); i < allowed_users.size(); i = allowed_users.find_next_revoked(i + 1)) {
+        cout << "The user: " << i << " at the leaf node: " << i + allowed_users.size() - 1 << " is denied" << endl;
     }
 }
 
@@ -94,6 +622,21 @@ unsigned int Keytree::get_numberof_users() {
     return allowed_users.size(); // Return number of users
 }
 
+// Method to get the denied users
+const vector<unsigned int>& Keytree::get_revoked_users() const {
+    return revoked_users;
+}
+
+// Method to get the number of nodes of the tree
+size_t Keytree::get_numberof_nodes() const {
+    return number_of_nodes; // Return number of nodes in the complete binary tree
+}
+
+// Method to get the length of the node keys
+size_t Keytree::get_key_length() const {
+    return Key_length;
+}
+
 // Method to get the depth of the tree
 size_t Keytree::get_depth() {
     return depth; // Return depth of the tree
@@ -17,6 +17,16 @@
 #include <cmath>
 #include <random>
 #include <iomanip> // For std::hex and std::setw
+#include <new>     // For the aligned operator new used by the key arena
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <string>
+
+#include "DRBG_AES.hpp"
+#include "Key_Batch.hpp"
+#include "User_Bitset.hpp"
+#include "BES_Metrics.hpp"
 
 using namespace std;
 
@@ -29,6 +39,36 @@ using namespace std;
  */
 void Fill_With_Random(uint8_t* buffer, std::size_t size);
 
+/**
+ * @brief Function to fill a large buffer with keys, drawing a single seed from the OS and expanding it with the AES DRBG.
+ *
+ * The buffer is split in 64 byte aligned ranges, each one expanded by its own DRBG seeded from the master DRBG,
+ * so the work can be spread among several threads.
+ *
+ * @param buffer Pointer to the memory location to be filled.
+ * @param size Size of the memory to be filled in bytes.
+ * @param threads Number of threads used to expand the keys (0 uses all the hardware threads).
+ */
+void Fill_With_DRBG(uint8_t* buffer, std::size_t size, unsigned int threads);
+
+/**
+ * @brief Runs a set of independent tasks on a pool of threads, each thread taking the next pending task when it finishes one.
+ *
+ * @param tasks Number of tasks, numbered from 0 to tasks - 1.
+ * @param threads Number of threads to use (0 uses all the hardware threads, 1 runs the tasks in the calling thread).
+ * @param task Function executing a task given its number.
+ */
+void parallel_for(std::size_t tasks, unsigned int threads, const std::function<void(std::size_t)>& task);
+
+/**
+ * @brief Receives the key package of a user during a bulk provisioning: the user ID and its key IDs and keys, packed as in a Key_batch.
+ * The buffers are only valid during the call, which may come from several threads at once (one user per call).
+ *
+ * @tparam Key_id Type of the key IDs of the scheme.
+ */
+template <typename Key_id>
+using User_keys_sink = std::function<void(unsigned int userID, const Key_id* key_ids, const uint8_t* keys, std::size_t key_count)>;
+
 /**
  * @brief Testing function to print a buffer in hexadecimal format.
  * 
@@ -39,6 +79,84 @@ void printHex(const uint8_t* array, std::size_t size);
 
 const size_t scheme_name_size = 20;
 
+/**
+ * @brief Alignment in bytes of the contiguous key arena of a Keytree (one cache line).
+ */
+const size_t key_arena_alignment = 64;
+
+/**
+ * @brief Default number of node keys kept in the LRU cache of a Keytree using derived keys.
+ */
+const size_t default_key_cache_capacity = 1024;
+
+/**
+ * @brief Maximum depth of a Keytree, so every node index fits in an unsigned int.
+ */
+const size_t max_tree_depth = 31;
+
+/**
+ * @brief Number of subtree tasks per thread when a tree walk is split among threads, so threads finishing early take the pending subtrees.
+ */
+const size_t parallel_tasks_per_thread = 16;
+
+/**
+ * @brief Default size in bytes of the chunks a Keytree is written to and read from a stream with.
+ */
+const size_t default_io_buffer_size = static_cast<size_t>(1) << 20;
+
+/**
+ * @brief Magic number at the start of a versioned Keytree file, legacy files start with the scheme name instead.
+ */
+const char tree_file_magic[8] = {'B', 'E', 'S', '_', 'T', 'R', 'E', 'E'};
+
+/**
+ * @brief Current version of the Keytree file format.
+ */
+const uint32_t tree_file_version = 1;
+
+/**
+ * @brief Alignment in bytes of the key arena inside a versioned Keytree file (one page), so it can be used straight from a mapped file.
+ */
+const size_t tree_file_key_alignment = 4096;
+
+/**
+ * @brief Header of a versioned Keytree file, written as is in host byte order (as the legacy format), followed by the
+ * allowed users as 64 bit words (bit i % 64 of word i / 64 set if user i is allowed) and the key arena.
+ * The offsets are from the start of the header, readers skip any gap before a section. The key arena starts at a
+ * multiple of tree_file_key_alignment.
+ */
+struct Tree_file_header {
+    char magic[8];                        ///< tree_file_magic
+    uint32_t version;                     ///< tree_file_version of the writer
+    uint32_t header_size;                 ///< sizeof(Tree_file_header) of the writer
+    char scheme_name[scheme_name_size];   ///< name of the scheme, zero padded
+    uint32_t reserved;                    ///< zero, keeps the next fields 8 byte aligned
+    uint64_t depth;                       ///< depth of the tree
+    uint64_t key_length;                  ///< length of the node keys in bits
+    uint64_t user_count;                  ///< number of users, 2^depth
+    uint64_t node_count;                  ///< number of nodes, 2^(depth+1) - 1
+    uint64_t users_offset;                ///< offset of the allowed users words
+    uint64_t users_bytes;                 ///< size of the allowed users words
+    uint64_t keys_offset;                 ///< offset of the key arena
+    uint64_t keys_bytes;                  ///< size of the key arena
+};
+
+/**
+ * @brief How the file of a Keytree opened with map_file is mapped in memory.
+ */
+enum Map_mode {
+    Map_read_only,     ///< The node keys are shared with every process mapping the file, and can not be modified.
+    Map_copy_on_write  ///< The node keys are shared until a page is modified, the changes are private and never reach the file.
+};
+
+/**
+ * @brief How the node keys of a Keytree are kept in memory.
+ */
+enum Key_storage {
+    Stored_keys,  ///< Every node key is random and stored in the key arena, O(2^depth) memory.
+    Derived_keys  ///< Every node key is computed on demand as a PRF of a master secret and the node index, O(1) memory.
+};
+
 /**
  *@brief gets the father of a tree node
  *
@@ -47,6 +165,38 @@ inline unsigned int get_father_index(unsigned int index){
 	return (index % 2 == 0) ? (index - 1) / 2 : index / 2;
 }
 
+/**
+ *@brief gets the level of a tree node, the root being at level 0
+ *
+*/
+inline unsigned int get_node_level(unsigned int index){
+#if defined(__GNUC__)
+	return 31 - __builtin_clz(index + 1);
+#else
+	unsigned int level = 0;
+	for (index++; index > 1; index >>= 1) level++;
+	return level;
+#endif
+}
+
+/**
+ *@brief gets the ancestor of a tree node the given number of levels above it
+ *
+*/
+inline unsigned int get_ancestor_index(unsigned int index, unsigned int levels_up){
+	return ((index + 1) >> levels_up) - 1;
+}
+
+/**
+ *@brief gets the users (leaves) under a tree node, the ones with IDs in [first_user, first_user + user_count)
+ *
+*/
+inline void get_subtree_users(unsigned int index, size_t depth, size_t &first_user, size_t &user_count){
+	size_t levels_down = depth - get_node_level(index);
+	first_user = ((static_cast<size_t>(index) + 1) << levels_down) - (static_cast<size_t>(1) << depth);
+	user_count = static_cast<size_t>(1) << levels_down;
+}
+
 /**
  *@brief gets the left child of a tree node
  *
@@ -68,9 +218,201 @@ inline unsigned int get_rightchild_index(unsigned int index){
 class Keytree {
 protected:
     size_t depth; ///< The total depth of the complete binary tree.
-    vector<bool> allowed_users; ///< Vector representing the users allowed or denied access to the communications.
-    vector<uint8_t*> FCB_tree; ///< The complete binary tree represented as a vector where each element is the key of the node.
+    User_bitset allowed_users; ///< Bitset representing the users allowed or denied access to the communications.
+    vector<unsigned int> revoked_users; ///< IDs of the denied users in ascending order, so covers can be computed from them alone.
+    uint8_t* FCB_tree; ///< The complete binary tree stored as a contiguous key arena, the key of node i is at offset i * Key_length / 8.
+    size_t number_of_nodes; ///< Number of nodes of the complete binary tree (2^(depth+1) - 1).
     size_t Key_length; ///< Length of the keys in the nodes of the complete binary tree.
+    Key_storage key_storage; ///< Whether the node keys are stored in FCB_tree or derived from master_secret.
+    uint8_t master_secret[AES_STREAM_SEEDBYTES]; ///< Master secret of the derived node keys.
+    aes_stream_state master_prf; ///< PRF keyed with master_secret, evaluated on the node index to derive a node key.
+    size_t key_cache_capacity; ///< Maximum number of derived node keys kept in the LRU cache.
+    list<unsigned int> key_cache_lru; ///< Nodes in the LRU cache, most recently used first.
+    unordered_map<unsigned int, pair<list<unsigned int>::iterator, size_t>> key_cache_index; ///< Node index to its LRU position and cache slot.
+    vector<uint8_t> key_cache_keys; ///< Keys of the LRU cache, one Key_length / 8 slot per cached node.
+    size_t io_buffer_size; ///< Size in bytes of the chunks the tree is written to and read from a stream with.
+    void* mapped_file; ///< Start of the file mapped by map_tree, FCB_tree points inside it, nullptr if the arena is allocated.
+    size_t mapped_file_size; ///< Size in bytes of the mapped file.
+    bool fixed_geometry; ///< Whether trees of another depth or key length are rejected when read or mapped.
+
+    /**
+     * @brief Derives the key of a node from the master secret, going through the LRU cache.
+     *
+     * @param index The index of the node in the complete binary tree.
+     * @param key_out Buffer of Key_length / 8 bytes to store the key.
+     */
+    void derive_node_key(unsigned int index, uint8_t* key_out);
+
+    /**
+     * @brief Copy the key of a node as read_node_key, with the key length known at compile time.
+     *
+     * @tparam Key_bytes Key_length / 8.
+     * @param index The index of the node in the complete binary tree.
+     * @param key_out Buffer of Key_bytes bytes to store the key.
+     */
+    template <size_t Key_bytes>
+    inline void read_node_key_fixed(unsigned int index, uint8_t* key_out) const {
+        if (key_storage == Stored_keys) {
+            memcpy(key_out, FCB_tree + static_cast<size_t>(index) * Key_bytes, Key_bytes);
+        } else {
+            aes_stream_prf(&master_prf, index, key_out, Key_bytes);
+            BES_METRIC_ADD(Metric_aes_blocks, aes_output_blocks(Key_bytes));
+        }
+    }
+
+    /**
+     * @brief Marks a user as denied in allowed_users and revoked_users.
+     *
+     * @param userID The ID of the user, it must be valid.
+     * @return true if the user was allowed until now, false if it was already denied.
+     */
+    bool mark_user_denied(unsigned int userID);
+
+    /**
+     * @brief Marks a batch of users as denied, merging them into revoked_users at once.
+     *
+     * @param userIDs The IDs of the users, on return only the ones that were allowed until now, sorted.
+     * @throws invalid_argument if any user ID is invalid (nothing is changed then).
+     */
+    void mark_users_denied(vector<unsigned int>& userIDs);
+
+    /**
+     * @brief Marks a denied user as allowed again in allowed_users and revoked_users.
+     *
+     * @param userID The ID of the user, it must be valid.
+     * @return true if the user was denied until now, false if it was already allowed.
+     */
+    bool mark_user_allowed(unsigned int userID);
+
+    /**
+     * @brief Marks a batch of users as allowed again, removing them from revoked_users at once.
+     *
+     * @param userIDs The IDs of the users, on return only the ones that were denied until now, sorted.
+     * @throws invalid_argument if any user ID is invalid (nothing is changed then).
+     */
+    void mark_users_allowed(vector<unsigned int>& userIDs);
+
+    /**
+     * @brief Rebuilds revoked_users from allowed_users (used after allowed_users is replaced, e.g. when loading a tree).
+     */
+    void rebuild_revoked_users();
+
+    /**
+     * @brief Writes the tree in the versioned file format: header, allowed users words and key arena, in chunks of io_buffer_size bytes.
+     *
+     * @param os The output stream.
+     * @param scheme_name Name of the scheme stored in the header.
+     */
+    void write_tree(ostream& os, const char* scheme_name) const;
+
+    /**
+     * @brief Reads a tree written by write_tree, or by the legacy format (scheme name, depth, key length,
+     * allowed users one bit per user, node bits for CSM and node keys), and rebuilds revoked_users. The tree is only replaced
+     * once the whole file is read, so a malformed or truncated file leaves it unchanged.
+     *
+     * @param is The input stream.
+     * @param scheme_name Name of the scheme the file must hold.
+     * @param legacy_node_bits Whether the legacy format of the scheme stores a bit per node to skip (CSM allowed keys).
+     * @return true if the tree is read, false if the file holds another scheme, another depth or key length while the geometry
+     * is fixed, or is malformed (the failbit of is is set then).
+     */
+    bool read_tree(istream& is, const char* scheme_name, bool legacy_node_bits);
+
+    /**
+     * @brief Opens a tree written by write_tree over a memory mapped file, the node keys are used from the file and paged in lazily.
+     * The allowed users are unpacked into memory and revoked_users is rebuilt, the file is not read otherwise.
+     *
+     * @param path Path of the file.
+     * @param scheme_name Name of the scheme the file must hold.
+     * @param mode Whether the mapping is read only or copy on write.
+     * @throws runtime_error if the file can not be mapped, is not a valid tree of the scheme or has another depth or key length
+     * while the geometry is fixed (nothing is changed then).
+     */
+    void map_tree(const string& path, const char* scheme_name, Map_mode mode);
+
+    /**
+     * @brief Whether a tree of a depth and key length can replace this one, any of them unless the geometry is fixed.
+     */
+    bool accepts_geometry(size_t tree_depth, size_t key_length) const {
+        return !fixed_geometry || (tree_depth == depth && key_length == Key_length);
+    }
+
+    /**
+     * @brief Checks that a versioned header belongs to a tree of the scheme and its sections are consistent.
+     *
+     * @param header The header.
+     * @param scheme_name Name of the scheme.
+     * @return true if the header is valid.
+     */
+    static bool check_tree_header(const Tree_file_header& header, const char* scheme_name);
+
+    /**
+     * @brief Frees the key arena, or unmaps the file the node keys are used from.
+     */
+    void release_key_arena();
+
+    /**
+     * @brief Level splitting the tree in subtrees for a walk among threads, the first one with parallel_tasks_per_thread
+     * subtrees per thread (at most the depth).
+     *
+     * @param threads Number of threads, at least 1.
+     * @return The level of the roots of the subtrees.
+     */
+    size_t parallel_split_level(unsigned int threads) const;
+
+    /**
+     * @brief Splits a range of users by the subtrees of parallel_split_level, and runs a task on each piece with parallel_for.
+     *
+     * @param first_user The ID of the first user.
+     * @param last_user The ID after the last user.
+     * @param threads Number of threads to use (0 uses all the hardware threads).
+     * @param task Function receiving the first and after last user of a piece.
+     */
+    void parallel_user_ranges(size_t first_user, size_t last_user, unsigned int threads, const function<void(size_t, size_t)>& task) const;
+
+    /**
+     * @brief Writes the keys of every node in index order, as stored in the key arena.
+     *
+     * @param os The output stream.
+     */
+    void write_node_keys(ostream& os) const;
+
+    /**
+     * @brief Reads the keys of every node of a tree from a stream into a new arena, the tree is not modified.
+     *
+     * @param is The input stream.
+     * @param tree_depth Depth of the tree read.
+     * @param key_length Length of its keys in bits.
+     * @return The arena, to be freed with free_key_arena, or nullptr if the stream ends before every key is read.
+     */
+    uint8_t* read_node_keys(istream& is, size_t tree_depth, size_t key_length) const;
+
+    /**
+     * @brief Replaces the depth, key length, allowed users and node keys with those of a tree read whole, switching to stored keys,
+     * and rebuilds revoked_users.
+     *
+     * @param tree_depth Depth of the tree read.
+     * @param key_length Length of its keys in bits.
+     * @param users Its allowed users, moved from.
+     * @param arena Its node keys, owned by the tree from now on.
+     */
+    void replace_tree(size_t tree_depth, size_t key_length, User_bitset& users, uint8_t* arena);
+
+    /**
+     * @brief Allocates a cache line aligned key arena for a complete binary tree.
+     *
+     * @param nodes Number of nodes of the tree.
+     * @param key_length_bytes Length of each node key in bytes.
+     * @return Pointer to the uninitialized arena.
+     */
+    static uint8_t* allocate_key_arena(size_t nodes, size_t key_length_bytes);
+
+    /**
+     * @brief Frees a key arena allocated with allocate_key_arena.
+     *
+     * @param arena Pointer to the arena, may be nullptr.
+     */
+    static void free_key_arena(uint8_t* arena);
 
 public:
     /**
@@ -78,14 +420,108 @@ public:
      * 
      * @param Tree_Depth The depth of the new tree.
      * @param node_key_length The length of the node keys in bits.
+     * @param key_generation_threads Number of threads used to generate the node keys (0 uses all the hardware threads).
+     * @param storage Whether the node keys are stored (default) or derived on demand from a master secret.
      */
-    Keytree(size_t Tree_Depth, size_t node_key_length);
+    Keytree(size_t Tree_Depth, size_t node_key_length, unsigned int key_generation_threads = 1, Key_storage storage = Stored_keys);
 
     /**
      * @brief Destructor for the Keytree class.
      */
     ~Keytree();
 
+    /**
+     * @brief The key arena is owned by the tree, so trees can not be copied.
+     */
+    Keytree(const Keytree&) = delete;
+    Keytree& operator=(const Keytree&) = delete;
+
+    /**
+     * @brief Get a pointer to the key of a node inside the key arena, only valid with stored keys.
+     *
+     * @param index The index of the node in the complete binary tree.
+     * @return Pointer to the Key_length / 8 bytes of the node key.
+     */
+    inline uint8_t* get_node_key(unsigned int index) {
+        return FCB_tree + static_cast<size_t>(index) * (Key_length / 8);
+    }
+
+    inline const uint8_t* get_node_key(unsigned int index) const {
+        return FCB_tree + static_cast<size_t>(index) * (Key_length / 8);
+    }
+
+    /**
+     * @brief Copy the key of a node, whether it is stored or derived.
+     *
+     * @param index The index of the node in the complete binary tree.
+     * @param key_out Buffer of Key_length / 8 bytes to store the key.
+     */
+    inline void copy_node_key(unsigned int index, uint8_t* key_out) {
+        if (key_storage == Stored_keys) {
+            memcpy(key_out, get_node_key(index), Key_length / 8);
+        } else {
+            derive_node_key(index, key_out);
+        }
+    }
+
+    /**
+     * @brief Copy the key of a node without going through the LRU cache of derived keys, so several threads can read keys at once
+     * while the tree is not modified.
+     *
+     * @param index The index of the node in the complete binary tree.
+     * @param key_out Buffer of Key_length / 8 bytes to store the key.
+     */
+    inline void read_node_key(unsigned int index, uint8_t* key_out) const {
+        if (key_storage == Stored_keys) {
+            memcpy(key_out, get_node_key(index), Key_length / 8);
+        } else {
+            aes_stream_prf(&master_prf, index, key_out, Key_length / 8);
+            BES_METRIC_ADD(Metric_aes_blocks, aes_output_blocks(Key_length / 8));
+        }
+    }
+
+    /**
+     * @brief Set the number of derived node keys kept in the LRU cache, dropping the current cache content.
+     *
+     * @param capacity Number of keys, 0 disables the cache.
+     */
+    void set_key_cache_capacity(size_t capacity);
+
+    /**
+     * @brief Get whether the node keys are used from a file mapped with map_file.
+     *
+     * @return true if the file is mapped.
+     */
+    bool is_mapped() const;
+
+    /**
+     * @brief Get how the node keys of the tree are kept in memory.
+     *
+     * @return Stored_keys or Derived_keys.
+     */
+    Key_storage get_key_storage() const;
+
+    /**
+     * @brief Set the size of the chunks the tree is written to and read from a stream with.
+     *
+     * @param bytes Size in bytes, at least 64.
+     */
+    void set_io_buffer_size(size_t bytes);
+
+    /**
+     * @brief Get the size of the chunks the tree is written to and read from a stream with.
+     *
+     * @return The size in bytes.
+     */
+    size_t get_io_buffer_size() const;
+
+    /**
+     * @brief Get the number of nodes of the complete binary tree.
+     *
+     * @return The number of nodes.
+     */
+    size_t get_numberof_nodes() const;
+
     /**
      * @brief Testing method to print information about the KeyTree.
      */
@@ -98,6 +534,20 @@ public:
      */
     unsigned int get_numberof_users();
 
+    /**
+     * @brief Get the IDs of the denied users.
+     * 
+     * @return The IDs in ascending order.
+     */
+    const vector<unsigned int>& get_revoked_users() const;
+
+    /**
+     * @brief Get the length of the node keys.
+     * 
+     * @return The length in bits.
+     */
+    size_t get_key_length() const;
+
     /**
      * @brief Get the depth of the complete binary tree.
      * 
@@ -0,0 +1,232 @@
+#ifndef USER_BITSET_H
+#define USER_BITSET_H
+
+/**
+ * @file User_Bitset.hpp
+ * @brief File containing the set of allowed users of a BES tree, one bit per user packed in 64 bit words.
+ * Bit userID % 64 of word userID / 64 is set if the user is allowed and the bits past the last user are zero,
+ * the same layout as the allowed users section of the tree file, so the words are written and read as they are.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+/**
+ * @brief Number of set bits of a word.
+ */
+inline unsigned int popcount64(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return static_cast<unsigned int>(__popcnt64(word));
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ull);
+    word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return static_cast<unsigned int>((word * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+/**
+ * @brief Position of the lowest set bit of a word, which must not be 0.
+ */
+inline unsigned int ctz64(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    unsigned long position;
+    _BitScanForward64(&position, word);
+    return static_cast<unsigned int>(position);
+#else
+    unsigned int position = 0;
+    for (; (word & 1) == 0; word >>= 1) position++;
+    return position;
+#endif
+}
+
+/**
+ * @class User_bitset
+ * @brief Allowed users packed in words, keeping the number of denied users so it is known without a scan.
+ */
+class User_bitset {
+private:
+    vector<uint64_t> bits; ///< The users packed 64 per word.
+    size_t user_count;     ///< Number of users.
+    size_t revoked;        ///< Number of denied users.
+
+    /**
+     * @brief Mask of the users of word w in [first_user, last_user), the range must overlap the word.
+     */
+    static uint64_t range_mask(size_t w, size_t first_user, size_t last_user) {
+        size_t low = first_user > w * 64 ? first_user - w * 64 : 0;
+        size_t high = last_user < (w + 1) * 64 ? last_user - w * 64 : 64;
+        return (high == 64 ? ~0ull : (1ull << high) - 1) & ~((1ull << low) - 1);
+    }
+
+    /**
+     * @brief Allows or denies a range of users a word at a time.
+     *
+     * @return The number of users whose state changed.
+     */
+    size_t change_range(size_t first_user, size_t last_user, bool allowed) {
+        size_t changed = 0;
+        if (first_user >= last_user)
+            return 0;
+        for (size_t w = first_user / 64; w <= (last_user - 1) / 64; w++) {
+            uint64_t mask = range_mask(w, first_user, last_user);
+            changed += popcount64(allowed ? mask & ~bits[w] : mask & bits[w]);
+            bits[w] = allowed ? bits[w] | mask : bits[w] & ~mask;
+        }
+        revoked = allowed ? revoked - changed : revoked + changed;
+        return changed;
+    }
+
+public:
+    User_bitset() : user_count(0), revoked(0) {}
+
+    /**
+     * @brief Sets the number of users, all of them allowed or denied.
+     */
+    void assign(size_t count, bool allowed) {
+        user_count = count;
+        revoked = allowed ? 0 : count;
+        bits.assign((count + 63) / 64, allowed ? ~0ull : 0);
+        if (allowed && count % 64 != 0)
+            bits.back() = (1ull << (count % 64)) - 1; // bits past the last user are zero
+    }
+
+    /**
+     * @brief Number of users.
+     */
+    size_t size() const { return user_count; }
+
+    /**
+     * @brief Whether a user is allowed, the user ID must be valid.
+     */
+    bool operator[](size_t userID) const { return (bits[userID / 64] >> (userID % 64)) & 1; }
+
+    /**
+     * @brief Number of denied users.
+     */
+    size_t revoked_count() const { return revoked; }
+
+    /**
+     * @brief Whether every user is allowed.
+     */
+    bool all_allowed() const { return revoked == 0; }
+
+    /**
+     * @brief Allows a user, the user ID must be valid.
+     *
+     * @return true if the user was denied until now.
+     */
+    bool allow(size_t userID) {
+        uint64_t bit = 1ull << (userID % 64);
+        if (bits[userID / 64] & bit)
+            return false;
+        bits[userID / 64] |= bit;
+        revoked--;
+        return true;
+    }
+
+    /**
+     * @brief Denies a user, the user ID must be valid.
+     *
+     * @return true if the user was allowed until now.
+     */
+    bool deny(size_t userID) {
+        uint64_t bit = 1ull << (userID % 64);
+        if (!(bits[userID / 64] & bit))
+            return false;
+        bits[userID / 64] &= ~bit;
+        revoked++;
+        return true;
+    }
+
+    /**
+     * @brief Allows the users in [first_user, last_user), which must be a valid range.
+     *
+     * @return The number of users that were denied until now.
+     */
+    size_t allow_range(size_t first_user, size_t last_user) { return change_range(first_user, last_user, true); }
+
+    /**
+     * @brief Denies the users in [first_user, last_user), which must be a valid range.
+     *
+     * @return The number of users that were allowed until now.
+     */
+    size_t deny_range(size_t first_user, size_t last_user) { return change_range(first_user, last_user, false); }
+
+    /**
+     * @brief First denied user from a user on.
+     *
+     * @param first_user The user the search starts at.
+     * @return The ID of the user, or size() if every user from first_user on is allowed.
+     */
+    size_t find_next_revoked(size_t first_user) const {
+        if (first_user >= user_count)
+            return user_count;
+        size_t w = first_user / 64;
+        uint64_t denied = ~bits[w] & (~0ull << (first_user % 64));
+        while (denied == 0) {
+            if (++w == bits.size())
+                return user_count;
+            denied = ~bits[w];
+        }
+        size_t userID = w * 64 + ctz64(denied);
+        return userID < user_count ? userID : user_count; // the zero bits past the last user read as denied
+    }
+
+    /**
+     * @brief Appends the IDs of the denied users to a vector, in ascending order.
+     */
+    void append_revoked(vector<unsigned int>& userIDs) const {
+        userIDs.reserve(userIDs.size() + revoked);
+        for (size_t w = 0; w < bits.size(); w++) {
+            for (uint64_t denied = ~bits[w]; denied != 0; denied &= denied - 1) {
+                size_t userID = w * 64 + ctz64(denied);
+                if (userID >= user_count)
+                    break;
+                userIDs.push_back(userID);
+            }
+        }
+    }
+
+    /**
+     * @brief The packed words, as stored in the tree file.
+     */
+    const uint64_t* words() const { return bits.data(); }
+
+    /**
+     * @brief Number of packed words.
+     */
+    size_t word_count() const { return bits.size(); }
+
+    /**
+     * @brief Replaces a run of the packed words, e.g. with the ones read from a tree file. Bits past the last user are ignored.
+     *
+     * @param words The words.
+     * @param first_word Position of the first word to replace.
+     * @param count Number of words, first_word + count must not exceed word_count().
+     */
+    void load_words(const uint64_t* words, size_t first_word, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            size_t w = first_word + i;
+            uint64_t word = words[i];
+            if (w == bits.size() - 1 && user_count % 64 != 0)
+                word &= (1ull << (user_count % 64)) - 1;
+            revoked += popcount64(bits[w]);
+            revoked -= popcount64(word);
+            bits[w] = word;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,600 @@
+// benchmarks of both schemes, compile the code with g++ in release mode:
+// g++ -O2 BES_SDM.cpp BES_CSM.cpp BES_Journal.cpp DRBG_AES.cpp benchmark_main.cpp Key_Tree.cpp -pthread -o benchmark
+//
+// ./benchmark [--benchmark_filter=<regex>] [--benchmark_out=<file.json>] [--benchmark_min_time=<seconds>]
+//             [--depths=10,14,18,22] [--key_lengths=128,192,256] [--revocations=1,100,10000] [--max_arena_mb=1024]
+//
+// Each benchmark runs until it has been timed for min_time seconds, and the results are printed as a table and written
+// as JSON in the layout of Google Benchmark, so the files of two versions can be compared with its tools.
+// Trees whose key arena would exceed max_arena_mb use derived keys, the storage is part of the benchmark name.
+
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <numeric>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <thread>
+#include <tuple>
+
+#include "Key_Tree.hpp"
+#include "BES_CSM.hpp"
+#include "BES_SDM.hpp"
+#include "DRBG_AES.hpp"
+
+using namespace std;
+
+/**
+ * @brief Options of a run, from the command line.
+ */
+struct Benchmark_options {
+    string filter = ".*";
+    string out_path;
+    double min_time = 0.2;
+    vector<size_t> depths = {10, 14, 18, 22};
+    vector<size_t> key_lengths = {128, 192, 256};
+    vector<size_t> revocations = {1, 100, 10000};
+    size_t max_arena_bytes = static_cast<size_t>(1024) << 20;
+};
+
+/**
+ * @brief Measures the iterations of a benchmark, only the time between resume_timing and pause_timing is counted.
+ */
+class Benchmark_state {
+private:
+    typedef chrono::steady_clock Clock;
+
+    double min_time;
+    size_t completed;
+    bool started;
+    bool timing;
+    Clock::time_point real_start;
+    clock_t cpu_start;
+    double real_seconds;
+    double cpu_seconds;
+
+public:
+    map<string, double> counters; ///< user counters, reported as they are
+    double bytes_processed;       ///< bytes processed by all the iterations, reported per second
+    double items_processed;       ///< items processed by all the iterations, reported per second
+
+    explicit Benchmark_state(double seconds)
+        : min_time(seconds), completed(0), started(false), timing(false), cpu_start(0), real_seconds(0), cpu_seconds(0),
+          bytes_processed(0), items_processed(0) {}
+
+    /**
+     * @brief Starts the next iteration, or ends the benchmark once it has been timed long enough.
+     */
+    bool keep_running() {
+        if (!started) {
+            started = true;
+            resume_timing();
+            return true;
+        }
+        completed++;
+        if (elapsed() >= min_time) {
+            pause_timing();
+            return false;
+        }
+        return true;
+    }
+
+    void pause_timing() {
+        if (timing) {
+            real_seconds += chrono::duration<double>(Clock::now() - real_start).count();
+            cpu_seconds += static_cast<double>(clock() - cpu_start) / CLOCKS_PER_SEC;
+            timing = false;
+        }
+    }
+
+    void resume_timing() {
+        if (!timing) {
+            timing = true;
+            cpu_start = clock();
+            real_start = Clock::now();
+        }
+    }
+
+    double elapsed() const {
+        return real_seconds + (timing ? chrono::duration<double>(Clock::now() - real_start).count() : 0);
+    }
+
+    size_t iterations() const { return completed; }
+    double real_time() const { return real_seconds; }
+    double cpu_time() const { return cpu_seconds; }
+};
+
+/**
+ * @brief Result of a benchmark, times per iteration in nanoseconds.
+ */
+struct Benchmark_result {
+    string name;
+    size_t iterations;
+    double real_time;
+    double cpu_time;
+    double bytes_per_second;
+    double items_per_second;
+    map<string, double> counters;
+};
+
+/**
+ * @brief Registered benchmarks, run in order.
+ */
+vector<pair<string, function<void(Benchmark_state&)>>> benchmarks;
+
+void register_benchmark(const string& name, function<void(Benchmark_state&)> benchmark) {
+    benchmarks.emplace_back(name, benchmark);
+}
+
+////////////////////////////////////// FIXTURES ////////////////////////////////////////////////
+
+// Key storage of a tree, derived when the arena of stored keys would not fit in the memory allowed
+Key_storage storage_for(const Benchmark_options& options, size_t depth, size_t key_length) {
+    size_t arena_bytes = ((static_cast<size_t>(2) << depth) - 1) * (key_length / 8);
+    return arena_bytes > options.max_arena_bytes ? Derived_keys : Stored_keys;
+}
+
+string tree_name(size_t depth, size_t key_length, Key_storage storage) {
+    return "/depth:" + to_string(depth) + "/key:" + to_string(key_length) + (storage == Stored_keys ? "/stored" : "/derived");
+}
+
+typedef map<tuple<size_t, size_t, bool>, size_t> Sdm_cover_memo;
+
+// Splits of the denied users of a node between its children tried by the SDM adversarial pattern: the even one, the power of
+// two below half of them and its double, and a full child. Up to depth 11 they reach the largest cover of all the splits
+vector<size_t> sdm_pattern_splits(size_t height, size_t revocations) {
+    size_t child_users = static_cast<size_t>(1) << (height - 1);
+    size_t power = 1;
+    while (power * 2 <= revocations / 2) {
+        power *= 2;
+    }
+    vector<size_t> splits;
+    for (size_t left : {revocations / 2, (revocations + 1) / 2, power, 2 * power, child_users, revocations - child_users}) {
+        if (left >= 1 && left < revocations && left <= child_users && revocations - left <= child_users) {
+            splits.push_back(left); // the unsigned differences that wrap around are left out here
+        }
+    }
+    return splits;
+}
+
+// Largest SDM cover with some denied users below a node of a height. Stepped tells whether the subset whose chain reaches
+// the node started above it, the subset is only there if its high and low nodes differ
+size_t sdm_pattern_cover(size_t height, size_t revocations, bool stepped, Sdm_cover_memo& memo) {
+    if (revocations == 1) {
+        return stepped || height > 0 ? 1 : 0;
+    }
+    auto found = memo.find(make_tuple(height, revocations, stepped));
+    if (found != memo.end()) {
+        return found->second;
+    }
+    size_t cover = 0;
+    for (size_t left : sdm_pattern_splits(height, revocations)) { // the chain ends here, both children start their own
+        cover = max(cover, (stepped ? 1 : 0) + sdm_pattern_cover(height - 1, left, false, memo)
+                               + sdm_pattern_cover(height - 1, revocations - left, false, memo));
+    }
+    if (revocations <= static_cast<size_t>(1) << (height - 1)) { // the chain goes on through a single child
+        cover = max(cover, sdm_pattern_cover(height - 1, revocations, true, memo));
+    }
+    memo[make_tuple(height, revocations, stepped)] = cover;
+    return cover;
+}
+
+// Denied users of the largest SDM cover below a node, following the choices of sdm_pattern_cover
+void sdm_pattern_users(size_t height, size_t revocations, bool stepped, size_t first_user, Sdm_cover_memo& memo, vector<unsigned int>& userIDs) {
+    if (revocations == 1) {
+        userIDs.push_back(first_user);
+        return;
+    }
+    size_t cover = sdm_pattern_cover(height, revocations, stepped, memo);
+    if (revocations <= static_cast<size_t>(1) << (height - 1) && sdm_pattern_cover(height - 1, revocations, true, memo) == cover) {
+        sdm_pattern_users(height - 1, revocations, true, first_user, memo, userIDs);
+        return;
+    }
+    for (size_t left : sdm_pattern_splits(height, revocations)) {
+        if ((stepped ? 1 : 0) + sdm_pattern_cover(height - 1, left, false, memo) + sdm_pattern_cover(height - 1, revocations - left, false, memo) == cover) {
+            sdm_pattern_users(height - 1, left, false, first_user, memo, userIDs);
+            sdm_pattern_users(height - 1, revocations - left, false, first_user + (static_cast<size_t>(1) << (height - 1)), memo, userIDs);
+            return;
+        }
+    }
+}
+
+// Denied users of a revocation pattern, in ascending order without repetitions
+vector<unsigned int> revocation_pattern(const string& pattern, bool sdm, size_t depth, size_t revocations) {
+    size_t users = static_cast<size_t>(1) << depth;
+    vector<unsigned int> userIDs;
+    mt19937_64 random(depth * 1000003 + revocations);
+
+    if (pattern == "random") {
+        while (userIDs.size() < revocations) {
+            userIDs.push_back(random() % users);
+            if (userIDs.size() == revocations) {
+                sort(userIDs.begin(), userIDs.end());
+                userIDs.erase(unique(userIDs.begin(), userIDs.end()), userIDs.end());
+            }
+        }
+    } else if (pattern == "clustered") {
+        // runs of 16 consecutive users at random places, the cover stays small
+        size_t run = min<size_t>(16, revocations);
+        while (userIDs.size() < revocations) {
+            size_t first = random() % (users / run) * run;
+            for (size_t i = 0; i < run && userIDs.size() < revocations; i++) {
+                userIDs.push_back(first + i);
+            }
+            if (userIDs.size() == revocations) {
+                sort(userIDs.begin(), userIDs.end());
+                userIDs.erase(unique(userIDs.begin(), userIDs.end()), userIDs.end());
+            }
+        }
+    } else if (!sdm) {
+        // adversarial for CSM: evenly spread users, the cover reaches r * log2(n / r) subtrees
+        for (size_t i = 0; i < revocations; i++) {
+            userIDs.push_back(i * users / revocations);
+        }
+    } else {
+        // adversarial for SDM: the denied paths branch so that as many subsets as possible start below each branch. Every
+        // branch needs a level between it and the next one, so the cover reaches the 2r - 1 bound only for r <= 2^((depth - 1) / 2),
+        // with more users it is the largest of the splits tried (e.g. 178 subsets for r = 100 at depth 10, 194721 for r = 100000 at 22)
+        Sdm_cover_memo memo;
+        if (revocations > 0) {
+            sdm_pattern_users(depth, min(revocations, users), false, 0, memo, userIDs);
+        }
+    }
+    return userIDs;
+}
+
+template <class Scheme>
+void deny_users(Scheme& scheme, const vector<unsigned int>& userIDs) {
+    vector<typename Scheme::Key_id> added_keys_id, removed_keys_id;
+    vector<uint8_t*> added_keys;
+    scheme.denegate_users(userIDs, added_keys_id, added_keys, removed_keys_id);
+    for (uint8_t* key : added_keys) {
+        delete[] key;
+    }
+}
+
+template <class Scheme>
+void allow_users(Scheme& scheme, const vector<unsigned int>& userIDs) {
+    vector<typename Scheme::Key_id> added_keys_id, removed_keys_id;
+    vector<uint8_t*> added_keys;
+    scheme.reinstate_users(userIDs, added_keys_id, added_keys, removed_keys_id);
+    for (uint8_t* key : added_keys) {
+        delete[] key;
+    }
+}
+
+////////////////////////////////////// BENCHMARKS ////////////////////////////////////////////////
+
+template <class Scheme>
+void register_tree_benchmarks(const Benchmark_options& options, const string& scheme_name, size_t depth, size_t key_length) {
+    Key_storage storage = storage_for(options, depth, key_length);
+    string suffix = tree_name(depth, key_length, storage);
+
+    register_benchmark("BM_" + scheme_name + "_construct" + suffix, [=](Benchmark_state& state) {
+        while (state.keep_running()) {
+            state.resume_timing();
+            Scheme scheme(depth, key_length, 1, storage);
+            state.pause_timing(); // the destruction is not measured
+        }
+        state.items_processed = state.iterations();
+    });
+
+    register_benchmark("BM_" + scheme_name + "_denegate_user" + suffix, [=](Benchmark_state& state) {
+        Scheme scheme(depth, key_length, 1, storage);
+        vector<unsigned int> order(scheme.get_numberof_users());
+        iota(order.begin(), order.end(), 0);
+        shuffle(order.begin(), order.end(), mt19937_64(depth));
+        size_t next = 0;
+        while (state.keep_running()) {
+            state.pause_timing();
+            if (next == order.size()) { // every user is denied, start over
+                allow_users(scheme, order);
+                next = 0;
+            }
+            state.resume_timing();
+            scheme.denegate_user(order[next++]);
+            state.pause_timing();
+        }
+        state.items_processed = state.iterations();
+    });
+}
+
+template <class Scheme>
+void register_user_keys_benchmark(const Benchmark_options& options, const string& name, size_t depth, size_t key_length,
+                                  function<void(Scheme&, unsigned int, Key_batch<typename Scheme::Key_id>&)> get_keys) {
+    Key_storage storage = storage_for(options, depth, key_length);
+
+    register_benchmark(name + tree_name(depth, key_length, storage), [=](Benchmark_state& state) {
+        Scheme scheme(depth, key_length, 1, storage);
+        Key_batch<typename Scheme::Key_id> batch;
+        mt19937_64 random(depth);
+        size_t users = scheme.get_numberof_users();
+        while (state.keep_running()) {
+            get_keys(scheme, random() % users, batch);
+        }
+        state.items_processed = state.iterations();
+        state.counters["keys_per_user"] = batch.size();
+    });
+}
+
+void register_cover_benchmarks(const Benchmark_options& options, size_t depth, size_t key_length, size_t revocations) {
+    Key_storage storage = storage_for(options, depth, key_length);
+    string suffix = "/r:" + to_string(revocations) + tree_name(depth, key_length, storage);
+
+    for (string pattern : {"random", "clustered", "adversarial"}) {
+        // CSM computes the cover from the denied users on every call
+        register_benchmark("BM_CSM_get_allowed_keys/" + pattern + suffix, [=](Benchmark_state& state) {
+            BES_CSM_scheme scheme(depth, key_length, 1, storage);
+            deny_users(scheme, revocation_pattern(pattern, false, depth, revocations));
+            Key_batch<unsigned int> batch;
+            while (state.keep_running()) {
+                scheme.get_allowed_keys(batch);
+            }
+            state.counters["cover_size"] = batch.size();
+        });
+
+        // SDM cover computed from scratch by each algorithm, the keys of the unchanged subsets are kept
+        for (Cover_method method : {Tree_cover, Revoked_leaves_cover}) {
+            string method_name = method == Tree_cover ? "tree" : "revoked_leaves";
+            register_benchmark("BM_SDM_cover/" + method_name + "/" + pattern + suffix, [=](Benchmark_state& state) {
+                BES_SDM_scheme scheme(depth, key_length, 1, storage);
+                deny_users(scheme, revocation_pattern(pattern, true, depth, revocations));
+                Key_batch<Key_subset> batch;
+                scheme.set_cover_method(method);
+                scheme.get_allowed_keys(batch);
+                while (state.keep_running()) {
+                    state.pause_timing();
+                    scheme.set_cover_method(Revoked_leaves_cover); // drops the classification of the tree
+                    scheme.set_cover_method(method);
+                    state.resume_timing();
+                    scheme.get_allowed_keys(batch);
+                    state.pause_timing();
+                }
+                state.counters["cover_size"] = batch.size();
+            });
+        }
+
+        // SDM broadcast header after a batch of revocations: incremental cover and derivation of the keys of the new subsets
+        register_benchmark("BM_SDM_denegate_batch/" + pattern + suffix, [=](Benchmark_state& state) {
+            BES_SDM_scheme scheme(depth, key_length, 1, storage);
+            vector<unsigned int> userIDs = revocation_pattern(pattern, true, depth, revocations);
+            Key_batch<Key_subset> batch;
+            scheme.get_allowed_keys(batch);
+            while (state.keep_running()) {
+                state.resume_timing();
+                deny_users(scheme, userIDs);
+                scheme.get_allowed_keys(batch);
+                state.pause_timing();
+                allow_users(scheme, userIDs);
+            }
+            state.items_processed = static_cast<double>(state.iterations()) * userIDs.size();
+            state.counters["cover_size"] = batch.size();
+        });
+    }
+}
+
+// Writes and reads back a whole tree of a scheme with operator << and operator >>
+template <class Scheme>
+void register_round_trip_benchmarks(const string& scheme_name, size_t depth, size_t key_length, Key_storage storage) {
+    size_t tree_bytes = ((static_cast<size_t>(2) << depth) - 1) * (key_length / 8);
+    string suffix = tree_name(depth, key_length, storage);
+
+    register_benchmark("BM_" + scheme_name + "_write" + suffix, [=](Benchmark_state& state) {
+        Scheme scheme(depth, key_length, 1, storage);
+        while (state.keep_running()) {
+            state.pause_timing();
+            stringstream stream;
+            state.resume_timing();
+            stream << scheme;
+            state.pause_timing();
+        }
+        state.bytes_processed = static_cast<double>(state.iterations()) * tree_bytes;
+    });
+
+    register_benchmark("BM_" + scheme_name + "_read" + suffix, [=](Benchmark_state& state) {
+        stringstream written;
+        {
+            Scheme scheme(depth, key_length, 1, storage);
+            written << scheme;
+        }
+        string contents = written.str();
+        Scheme scheme(depth, key_length, 1, storage);
+        while (state.keep_running()) {
+            state.pause_timing();
+            stringstream stream(contents);
+            state.resume_timing();
+            stream >> scheme;
+            state.pause_timing();
+        }
+        state.bytes_processed = static_cast<double>(state.iterations()) * tree_bytes;
+    });
+}
+
+void register_serialization_benchmarks(const Benchmark_options& options, size_t depth, size_t key_length) {
+    Key_storage storage = storage_for(options, depth, key_length);
+    if (storage == Derived_keys) {
+        return; // a tree is written with all its keys, it would not fit in the memory allowed
+    }
+    register_round_trip_benchmarks<BES_CSM_scheme>("CSM", depth, key_length, storage);
+    register_round_trip_benchmarks<BES_SDM_scheme>("SDM", depth, key_length, storage);
+}
+
+void register_aes_benchmarks() {
+    for (aes_stream_implementation implementation : {AES_STREAM_IMPL_PORTABLE, AES_STREAM_IMPL_AESNI, AES_STREAM_IMPL_VAES256, AES_STREAM_IMPL_VAES512}) {
+        for (size_t size : {4096, 65536, 1048576}) {
+            string name = string("BM_aes_stream/") + aes_stream_implementation_name(implementation) + "/bytes:" + to_string(size);
+            register_benchmark(name, [=](Benchmark_state& state) {
+                aes_stream_implementation previous = aes_stream_get_implementation();
+                if (aes_stream_set_implementation(implementation) != 0) {
+                    state.counters["unsupported"] = 1; // not available on this CPU
+                    return;
+                }
+                unsigned char seed[AES_STREAM_SEEDBYTES] = {0};
+                aes_stream_state stream;
+                vector<unsigned char> buffer(size);
+                aes_stream_init(&stream, seed);
+                while (state.keep_running()) {
+                    aes_stream(&stream, buffer.data(), buffer.size());
+                }
+                aes_stream_set_implementation(previous);
+                state.bytes_processed = static_cast<double>(state.iterations()) * size;
+            });
+        }
+    }
+}
+
+////////////////////////////////////// RUNNER ////////////////////////////////////////////////
+
+vector<size_t> parse_list(const string& value) {
+    vector<size_t> list;
+    stringstream stream(value);
+    string item;
+    while (getline(stream, item, ',')) {
+        list.push_back(stoul(item));
+    }
+    return list;
+}
+
+Benchmark_options parse_options(int argc, char** argv) {
+    Benchmark_options options;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        size_t equals = argument.find('=');
+        string flag = argument.substr(0, equals);
+        string value = equals == string::npos ? "" : argument.substr(equals + 1);
+        if (flag == "--benchmark_filter") {
+            options.filter = value;
+        } else if (flag == "--benchmark_out") {
+            options.out_path = value;
+        } else if (flag == "--benchmark_min_time") {
+            options.min_time = stod(value);
+        } else if (flag == "--depths") {
+            options.depths = parse_list(value);
+        } else if (flag == "--key_lengths") {
+            options.key_lengths = parse_list(value);
+        } else if (flag == "--revocations") {
+            options.revocations = parse_list(value);
+        } else if (flag == "--max_arena_mb") {
+            options.max_arena_bytes = stoul(value) << 20;
+        } else {
+            throw invalid_argument("Unknown option " + argument);
+        }
+    }
+    return options;
+}
+
+void register_all(const Benchmark_options& options) {
+    register_aes_benchmarks();
+    for (size_t depth : options.depths) {
+        for (size_t key_length : options.key_lengths) {
+            register_tree_benchmarks<BES_CSM_scheme>(options, "CSM", depth, key_length);
+            register_tree_benchmarks<BES_SDM_scheme>(options, "SDM", depth, key_length);
+            register_user_keys_benchmark<BES_CSM_scheme>(options, "BM_CSM_get_user_keys", depth, key_length,
+                [](BES_CSM_scheme& scheme, unsigned int userID, Key_batch<unsigned int>& batch) { scheme.get_user_keys(userID, batch); });
+            register_user_keys_benchmark<BES_SDM_scheme>(options, "BM_SDM_get_user_labels", depth, key_length,
+                [](BES_SDM_scheme& scheme, unsigned int userID, Key_batch<Key_subset>& batch) { scheme.get_user_labels(userID, batch); });
+            for (size_t revocations : options.revocations) {
+                if (revocations <= (static_cast<size_t>(1) << depth) / 2) {
+                    register_cover_benchmarks(options, depth, key_length, revocations);
+                }
+            }
+            register_serialization_benchmarks(options, depth, key_length);
+        }
+    }
+}
+
+// Writes the results as the JSON output of Google Benchmark
+void write_json(ostream& os, const vector<Benchmark_result>& results, const string& executable) {
+    time_t now = time(nullptr);
+    char date[64];
+    strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+    os << "{\n  \"context\": {\n";
+    os << "    \"date\": \"" << date << "\",\n";
+    os << "    \"executable\": \"" << executable << "\",\n";
+    os << "    \"num_cpus\": " << thread::hardware_concurrency() << ",\n";
+    os << "    \"aes_implementation\": \"" << aes_stream_implementation_name(aes_stream_get_implementation()) << "\",\n";
+#ifdef NDEBUG
+    os << "    \"library_build_type\": \"release\"\n";
+#else
+    os << "    \"library_build_type\": \"debug\"\n";
+#endif
+    os << "  },\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Benchmark_result& result = results[i];
+        os << (i == 0 ? "\n" : ",\n") << "    {\n";
+        os << "      \"name\": \"" << result.name << "\",\n";
+        os << "      \"run_name\": \"" << result.name << "\",\n";
+        os << "      \"run_type\": \"iteration\",\n";
+        os << "      \"iterations\": " << result.iterations << ",\n";
+        os << "      \"real_time\": " << result.real_time << ",\n";
+        os << "      \"cpu_time\": " << result.cpu_time << ",\n";
+        os << "      \"time_unit\": \"ns\"";
+        if (result.bytes_per_second > 0) {
+            os << ",\n      \"bytes_per_second\": " << result.bytes_per_second;
+        }
+        if (result.items_per_second > 0) {
+            os << ",\n      \"items_per_second\": " << result.items_per_second;
+        }
+        for (const auto& counter : result.counters) {
+            os << ",\n      \"" << counter.first << "\": " << counter.second;
+        }
+        os << "\n    }";
+    }
+    os << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    Benchmark_options options = parse_options(argc, argv);
+    vector<Benchmark_result> results;
+    regex filter(options.filter);
+
+    register_all(options);
+    cout << left << setw(72) << "Benchmark" << right << setw(16) << "Time (ns)" << setw(16) << "CPU (ns)" << setw(12) << "Iterations" << "  Counters" << endl;
+    cout << string(128, '-') << endl;
+    for (const auto& benchmark : benchmarks) {
+        if (!regex_search(benchmark.first, filter)) {
+            continue;
+        }
+        Benchmark_state state(options.min_time);
+        benchmark.second(state);
+
+        Benchmark_result result = {benchmark.first, state.iterations(), 0, 0, 0, 0, state.counters};
+        if (state.iterations() > 0) {
+            result.real_time = state.real_time() * 1e9 / state.iterations();
+            result.cpu_time = state.cpu_time() * 1e9 / state.iterations();
+            if (state.real_time() > 0) {
+                result.bytes_per_second = state.bytes_processed / state.real_time();
+                result.items_per_second = state.items_processed / state.real_time();
+            }
+        }
+        results.push_back(result);
+
+        cout << left << setw(72) << result.name << right << fixed << setprecision(0) << setw(16) << result.real_time
+             << setw(16) << result.cpu_time << setw(12) << result.iterations << " ";
+        if (result.bytes_per_second > 0) {
+            cout << " bytes_per_second=" << setprecision(3) << result.bytes_per_second / (1 << 20) << "Mi/s";
+        }
+        if (result.items_per_second > 0) {
+            cout << " items_per_second=" << setprecision(3) << result.items_per_second / 1000 << "k/s";
+        }
+        for (const auto& counter : result.counters) {
+            cout << " " << counter.first << "=" << setprecision(0) << counter.second;
+        }
+        cout << defaultfloat << endl;
+    }
+    if (!options.out_path.empty()) {
+        ofstream out(options.out_path);
+        if (!out) {
+            cerr << "Error opening " << options.out_path << endl;
+            return 1;
+        }
+        out << setprecision(10);
+        write_json(out, results, argv[0]);
+    }
+    return 0;
+}
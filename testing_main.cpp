@@ -1,5 +1,5 @@
-// compile the code with g++ and the -maes option to tell the compiler to use the INTEL and AMD AES instructions
-// g++ BES_SDM.cpp BES_CSM.cpp DRBG_AES.cpp testing_main.cpp Key_Tree.cpp -maes
+// compile the code with g++, the AES kernel (AES-NI, VAES or portable) is chosen at runtime from the CPU features
+// g++ BES_SDM.cpp BES_CSM.cpp BES_Journal.cpp DRBG_AES.cpp testing_main.cpp Key_Tree.cpp -pthread
 
 #include <cstdio>// for remove function
 
@@ -82,6 +82,15 @@ int main(){
 	print_color("Keys for user 0 are:",BLUE_CYAN);
 	print_keys_CSM(key_indexes_CSM,user_keys_CSM,256);
 
+	//check funcionality get keys for a user into a reusable batch, no buffer has to be freed
+	Key_batch<unsigned int> key_batch_CSM;
+	CSM_scheme.get_user_keys(0,key_batch_CSM);
+	print_color("Keys for user 0 from a key batch are:",BLUE_CYAN);
+	for(size_t i = 0 ; i < key_batch_CSM.size() ; i++){
+		cout << "key index: " << key_batch_CSM.id(i) << " KEY:";
+		printHex(key_batch_CSM.key(i),key_batch_CSM.key_length());
+	}
+
 	//check functionality store and load a CSM scheme
 	ofstream ofs_CSM("CSM_scheme.dat",ios::binary);
 	ofs_CSM << CSM_scheme;
@@ -123,6 +132,19 @@ int main(){
 	SDM_scheme.get_allowed_keys(key_indexes_SDM,user_keys_SDM);
 	print_keys_SDM(key_indexes_SDM,user_keys_SDM,256);
 
+	//check functionality cover delta, only the subsets changed by the new denied user are reported
+	vector <Key_subset> removed_indexes_SDM;
+	user_keys_SDM.clear();
+	key_indexes_SDM.clear();
+	SDM_scheme.denegate_user(4); // deny user with id 4
+	SDM_scheme.get_cover_delta(key_indexes_SDM,user_keys_SDM,removed_indexes_SDM);
+	print_color("subsets added to the cover after denying user 4:",BLUE_CYAN);
+	print_keys_SDM(key_indexes_SDM,user_keys_SDM,256);
+	print_color("subsets removed from the cover after denying user 4:",BLUE_CYAN);
+	for(size_t i = 0 ; i < removed_indexes_SDM.size() ; i++){
+		cout << "key index high: " << removed_indexes_SDM[i].high_node <<" ,key index low: " <<removed_indexes_SDM[i].low_node << endl;
+	}
+
 	//check funcionality get labels for a user
 	user_keys_SDM.clear();
 	key_indexes_SDM.clear();
@@ -141,6 +163,26 @@ int main(){
 	ifs_SDM.close();
 	print_color("SDM KeyTree after store and load in different object is: ",BLUE_CYAN);
 	LOAD_SDM_scheme.print_KeyTree_info();
+
+	//check that loading a tree with longer keys resizes the label cache
+	BES_SDM_scheme CACHED_SDM_scheme(3,128);
+	CACHED_SDM_scheme.set_label_cache_capacity(64);
+	ifstream ifs_cached_SDM("SDM_scheme.dat",ios::binary);
+	ifs_cached_SDM >> CACHED_SDM_scheme;
+	ifs_cached_SDM.close();
+	vector <Key_subset> cached_indexes_SDM, loaded_indexes_SDM;
+	vector <uint8_t*> cached_keys_SDM, loaded_keys_SDM;
+	CACHED_SDM_scheme.get_user_labels(0,cached_indexes_SDM,cached_keys_SDM);
+	CACHED_SDM_scheme.get_user_labels(5,cached_indexes_SDM,cached_keys_SDM); // shares the labels near the root through the cache
+	LOAD_SDM_scheme.get_user_labels(0,loaded_indexes_SDM,loaded_keys_SDM);
+	LOAD_SDM_scheme.get_user_labels(5,loaded_indexes_SDM,loaded_keys_SDM);
+	bool same_labels = cached_keys_SDM.size() == loaded_keys_SDM.size();
+	for(size_t i = 0 ; same_labels && i < cached_keys_SDM.size() ; i++){
+		same_labels = memcmp(cached_keys_SDM[i],loaded_keys_SDM[i],256/8) == 0;
+	}
+	print_color(same_labels ? "labels with the cache after loading 256 bit keys: OK" : "labels with the cache after loading 256 bit keys: FAIL", same_labels ? GREEN : RED);
+	for(size_t i = 0 ; i < cached_keys_SDM.size() ; i++) delete[] cached_keys_SDM[i];
+	for(size_t i = 0 ; i < loaded_keys_SDM.size() ; i++) delete[] loaded_keys_SDM[i];
 	print_color("END OF SDM SCHEME TESTING ",GREEN);
 	cout << endl << endl;
 